@@ -0,0 +1,132 @@
+#include "BlockTimeSteps.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+void BlockTimeSteps::Resize(unsigned int particleCount)
+{
+    step = 0;
+    frameStart = 0;
+    substeps = 1;
+    levels.assign(particleCount, 0);
+    active.assign(particleCount, 1);
+    blockEnds.assign(particleCount, 0);
+    accelerations.assign(particleCount, Float2(0, 0));
+    startVelocities.resize(particleCount);
+    // No limit before the first sort
+    cellLevels.assign(particleCount, MaxLevels);
+    particleSteps = 0;
+    activeSteps = 0;
+    std::fill(levelCounts, levelCounts + MaxLevels, 0);
+}
+
+void BlockTimeSteps::BeginFrame(int frameSubsteps)
+{
+    frameStart = step;
+    substeps = frameSubsteps;
+}
+
+int BlockTimeSteps::LevelLimit(const Physics& physics, unsigned int index) const
+{
+    // The keys the particle was sorted by in the previous substep
+    int smallest = MaxLevels;
+    physics.ForEachNeighbourCell(physics.PredictedPositions[index], [&](ImU32, ImU32 key) {
+        smallest = std::min(smallest, (int)cellLevels[key]);
+    });
+    return smallest + 1;
+}
+
+int BlockTimeSteps::StableLevel(const Physics& physics, unsigned int index) const
+{
+    // TimeStepController::StableStep of the particle alone
+    float radius = physics.smoothingRadius;
+    float speed = std::sqrt(Dot(physics.Velocities[index], physics.Velocities[index]));
+    float acceleration = std::sqrt(Dot(accelerations[index], accelerations[index]));
+    float stable = physics.deltaTime * (1 << (MaxLevels - 1));
+    if (speed > 0) stable = std::min(stable, cflNumber * radius / speed);
+    if (acceleration > 0) stable = std::min(stable, forceNumber * std::sqrt(radius / acceleration));
+
+    int level = 0;
+    while (level + 1 < MaxLevels && physics.deltaTime * (2 << level) <= stable) level++;
+    return level;
+}
+
+void BlockTimeSteps::StartParticle(Physics& physics, unsigned int index)
+{
+    bool due = step >= blockEnds[index];
+    int limit = LevelLimit(physics, index);
+    if (!due && levels[index] > limit)
+    {
+        // A faster neighbour came close: end the block here, without the rest of its velocity change
+        physics.Velocities[index] -= accelerations[index] * ((blockEnds[index] - step) * physics.deltaTime);
+        due = true;
+    }
+    active[index] = due;
+
+    if (!due)
+    {
+        // With the velocity of the block
+        physics.PredictPosition((int)index);
+        return;
+    }
+
+    // The block must start on a multiple of its length and end with the frame
+    int level = std::min(StableLevel(physics, index), limit);
+    int offset = step - frameStart;
+    while (level > 0 && (offset % (1 << level) != 0 || offset + (1 << level) > substeps)) level--;
+    levels[index] = (unsigned char)level;
+    blockEnds[index] = step + (1 << level);
+
+    startVelocities[index] = physics.Velocities[index];
+    physics.ExternalForces((int)index);
+}
+
+void BlockTimeSteps::MarkCellLevels(const Physics& physics)
+{
+    std::fill(cellLevels.begin(), cellLevels.end(), (unsigned char)MaxLevels);
+    for (unsigned int entry = 0; entry < physics.numParticles; entry++)
+    {
+        const SpatialEntry& indexData = physics.SpatialIndices[entry];
+        unsigned char level = levels[indexData.index];
+        cellLevels[indexData.key] = std::min(cellLevels[indexData.key], level);
+        activeSteps += active[indexData.index];
+        levelCounts[level]++;
+    }
+    particleSteps += physics.numParticles;
+}
+
+void BlockTimeSteps::Integrate(Physics& physics, unsigned int index, ParticleMotion& motion)
+{
+    Float2 velocity = physics.Velocities[index];
+    if (active[index])
+    {
+        Float2 start = startVelocities[index];
+        motion.Measure(velocity, start, physics.deltaTime);
+
+        Float2 change = velocity - start;
+        accelerations[index] = change / physics.deltaTime;
+        physics.Velocities[index] = start + change * (float)(1 << levels[index]);
+    }
+    else
+    {
+        motion.Measure(velocity, velocity, physics.deltaTime);
+    }
+    physics.UpdatePositions((int)index);
+}
+
+std::string BlockTimeSteps::Report()
+{
+    std::ostringstream report;
+    report << "Block time steps: " << (particleSteps > 0 ? 100.0 * activeSteps / particleSteps : 0.0)
+        << "% of the particles active per substep, particles per level";
+    for (int level = 0; level < MaxLevels; level++)
+    {
+        report << " " << (particleSteps > 0 ? 100.0 * levelCounts[level] / particleSteps : 0.0) << "%";
+        levelCounts[level] = 0;
+    }
+    report << std::endl;
+
+    particleSteps = 0;
+    activeSteps = 0;
+    return report.str();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "physics.h"
+#include "TimeStepController.h"
+#include <string>
+#include <vector>
+
+// Hierarchical block time steps (SimulationOptions::blockTimeSteps), on top of the adaptive
+// time step. The substeps of a frame, rounded up to a power of two, are the finest level, and
+// every particle steps with its own power of two multiple of them, as long as its own speed and
+// acceleration allow by the TimeStepController criteria. In a substep only the particles whose
+// block starts there are active: they run the force passes, and their velocity change is
+// scaled up to the whole block. Every particle drifts every substep, so the active ones see the
+// others at their extrapolated positions, with the densities of their last evaluation. Blocks
+// never cross a frame, so all particles are in step again at every frame start.
+//
+// A particle steps at most one level above the smallest level in the cells around it (the
+// spatial keys of the previous substep's sort). When a faster particle comes close, a slow one
+// ends its block early and takes back the part of its velocity change for the rest of the block.
+class BlockTimeSteps
+{
+public:
+    static const int MaxLevels = 8;
+
+    float cflNumber = 0.4f;
+    float forceNumber = 0.25f;
+
+    void Resize(unsigned int particleCount);
+    // Serial, before the first substep of a frame of substeps, a power of two
+    void BeginFrame(int substeps);
+    // Serial, after every substep
+    void EndSubstep() { step++; }
+
+    bool IsActive(unsigned int index) const { return active[index] != 0; }
+
+    // First pass of a particle in a substep: decides whether it is active, then applies the
+    // external forces to an active particle or only predicts the position of the others
+    void StartParticle(Physics& physics, unsigned int index);
+    // After the sort, serial: the smallest level of every spatial key
+    void MarkCellLevels(const Physics& physics);
+    // Scales the velocity change of an active particle to its block, then moves any particle by
+    // the substep. motion receives the speed and the acceleration over the substep.
+    void Integrate(Physics& physics, unsigned int index, ParticleMotion& motion);
+
+    // Share of the particles active per substep, and the particles of every level, since the last report
+    std::string Report();
+
+private:
+    int step = 0;       // substeps since Resize
+    int frameStart = 0; // step of the frame's first substep
+    int substeps = 1;   // of the frame
+
+    std::vector<unsigned char> levels;
+    std::vector<unsigned char> active;     // in this substep
+    std::vector<int> blockEnds;            // step after the last substep of the particle's block
+    std::vector<Float2> accelerations;     // velocity change per time of the last evaluation
+    std::vector<Float2> startVelocities;   // of the active particles, before the force passes
+    std::vector<unsigned char> cellLevels; // by spatial key
+
+    long long particleSteps = 0;
+    long long activeSteps = 0;
+    long long levelCounts[MaxLevels] = {};
+
+    int LevelLimit(const Physics& physics, unsigned int index) const;
+    int StableLevel(const Physics& physics, unsigned int index) const;
+};
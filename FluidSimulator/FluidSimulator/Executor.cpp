@@ -0,0 +1,162 @@
+#include "Executor.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if FLUID_PARALLEL_STL
+#include <execution>
+#endif
+
+static const char* backendNames[] = { "taskgraph", "pool", "openmp", "parallel-stl" };
+
+const char* ExecutorBackendName(ExecutorBackend backend)
+{
+    return backendNames[(int)backend];
+}
+
+bool ParseExecutorBackend(const char* name, ExecutorBackend& backend)
+{
+    for (int i = 0; i < (int)(sizeof(backendNames) / sizeof(backendNames[0])); i++)
+    {
+        if (strcmp(name, backendNames[i]) == 0)
+        {
+            backend = (ExecutorBackend)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* ThreadPoolExecutor::Name() const
+{
+    return ExecutorBackendName(dataflow ? ExecutorBackend::TaskGraph : ExecutorBackend::ThreadPool);
+}
+
+int ThreadPoolExecutor::MaxWorkers() const
+{
+    return pool.size();
+}
+
+void ThreadPoolExecutor::ParallelFor(int count, int workers, const std::function<void(int)>& fun)
+{
+    // Only as many jobs as workers are queued, the remaining workers stay parked
+    int workerCount = std::min(pool.size(), count);
+    if (workers > 0) workerCount = std::min(workerCount, workers);
+    if (workerCount <= 1)
+    {
+        for (int i = 0; i < count; i++) fun(i);
+        return;
+    }
+
+    // Every worker keeps taking the next item until none are left
+    std::atomic<int> next{ 0 };
+    std::mutex doneMutex;
+    std::condition_variable done;
+    int remaining = workerCount;
+    for (int w = 0; w < workerCount; w++)
+    {
+        pool.enqueueFunction([&]() {
+            for (int i = next++; i < count; i = next++)
+            {
+                fun(i);
+            }
+            std::unique_lock<std::mutex> lock(doneMutex);
+            remaining--;
+            done.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    done.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+const char* OpenMpExecutor::Name() const
+{
+    return ExecutorBackendName(ExecutorBackend::OpenMP);
+}
+
+int OpenMpExecutor::MaxWorkers() const
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+void OpenMpExecutor::ParallelFor(int count, int workers, const std::function<void(int)>& fun)
+{
+#ifdef _OPENMP
+    int threads = workers > 0 ? std::min(workers, omp_get_max_threads()) : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (int i = 0; i < count; i++)
+    {
+        fun(i);
+    }
+#else
+    for (int i = 0; i < count; i++) fun(i);
+#endif
+}
+
+const char* ParallelStlExecutor::Name() const
+{
+    return ExecutorBackendName(ExecutorBackend::ParallelStl);
+}
+
+void ParallelStlExecutor::ParallelFor(int count, int, const std::function<void(int)>& fun)
+{
+    if ((int)items.size() != count)
+    {
+        items.resize(count);
+        for (int i = 0; i < count; i++) items[i] = i;
+    }
+#if FLUID_PARALLEL_STL
+    std::for_each(std::execution::par_unseq, items.begin(), items.end(), [&fun](int i) { fun(i); });
+#else
+    for (int i : items) fun(i);
+#endif
+}
+
+std::unique_ptr<Executor> CreateExecutor(ExecutorBackend backend, ThreadPool& pool)
+{
+    switch (backend)
+    {
+    case ExecutorBackend::ThreadPool:
+        return std::unique_ptr<Executor>(new ThreadPoolExecutor(pool, false));
+    case ExecutorBackend::OpenMP:
+#ifdef _OPENMP
+        return std::unique_ptr<Executor>(new OpenMpExecutor());
+#else
+        std::cerr << "Built without OpenMP, using the task graph executor" << std::endl;
+        break;
+#endif
+    case ExecutorBackend::ParallelStl:
+#if FLUID_PARALLEL_STL
+        return std::unique_ptr<Executor>(new ParallelStlExecutor());
+#else
+        std::cerr << "Built without std::execution support, using the task graph executor" << std::endl;
+        break;
+#endif
+    default:
+        break;
+    }
+    return std::unique_ptr<Executor>(new ThreadPoolExecutor(pool, true));
+}
+
+void ParallelForRange(Executor* executor, unsigned int start, unsigned int end, unsigned int tileSize, const std::function<void(unsigned int, unsigned int)>& fun)
+{
+    if (executor == nullptr || end - start <= tileSize)
+    {
+        if (start < end) fun(start, end);
+        return;
+    }
+
+    int tileCount = (end - start + tileSize - 1) / tileSize;
+    executor->ParallelFor(tileCount, 0, [start, end, tileSize, &fun](int tile) {
+        unsigned int tileStart = start + tile * tileSize;
+        fun(tileStart, std::min(tileStart + tileSize, end));
+    });
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "ThreadPool.h"
+
+// std::execution needs C++17, and libstdc++ additionally links against TBB for it,
+// so the parallel algorithms backend is only built when asked for (always on MSVC)
+#if !defined(FLUID_PARALLEL_STL) && defined(_MSC_VER) && _HAS_CXX17
+#define FLUID_PARALLEL_STL 1
+#endif
+
+enum class ExecutorBackend
+{
+    TaskGraph,   // thread pool, stages run as tile dataflow (see TaskGraph)
+    ThreadPool,  // thread pool, one barrier per stage
+    OpenMP,      // parallel for with dynamic scheduling
+    ParallelStl  // std::for_each(std::execution::par_unseq)
+};
+
+const char* ExecutorBackendName(ExecutorBackend backend);
+bool ParseExecutorBackend(const char* name, ExecutorBackend& backend);
+
+// Runs the items of one simulation stage in parallel. Every backend schedules items
+// dynamically, an item is usually a tile of particles. workers limits how many threads
+// take part (0 = all of them); backends that cannot limit it ignore the value.
+class Executor
+{
+public:
+    virtual ~Executor() {}
+    virtual const char* Name() const = 0;
+    virtual void ParallelFor(int count, int workers, const std::function<void(int)>& fun) = 0;
+    // Pool to run task graphs as dataflow on, nullptr if stages must run behind barriers
+    virtual ThreadPool* DataflowPool() { return nullptr; }
+    virtual int MaxWorkers() const = 0;
+};
+
+class ThreadPoolExecutor : public Executor
+{
+public:
+    ThreadPoolExecutor(ThreadPool& pool, bool dataflow) : pool(pool), dataflow(dataflow) {}
+    const char* Name() const override;
+    void ParallelFor(int count, int workers, const std::function<void(int)>& fun) override;
+    ThreadPool* DataflowPool() override { return dataflow ? &pool : nullptr; }
+    int MaxWorkers() const override;
+
+private:
+    ThreadPool& pool;
+    bool dataflow;
+};
+
+class OpenMpExecutor : public Executor
+{
+public:
+    const char* Name() const override;
+    void ParallelFor(int count, int workers, const std::function<void(int)>& fun) override;
+    int MaxWorkers() const override;
+};
+
+class ParallelStlExecutor : public Executor
+{
+public:
+    const char* Name() const override;
+    void ParallelFor(int count, int workers, const std::function<void(int)>& fun) override;
+    int MaxWorkers() const override { return 0; }
+
+private:
+    std::vector<int> items;
+};
+
+// Falls back to the task graph on the pool when the backend was not compiled in
+std::unique_ptr<Executor> CreateExecutor(ExecutorBackend backend, ThreadPool& pool);
+
+// Calls fun(tileStart, tileEnd) for the tiles of [start, end) in parallel,
+// or once for the whole range without an executor
+void ParallelForRange(Executor* executor, unsigned int start, unsigned int end, unsigned int tileSize, const std::function<void(unsigned int, unsigned int)>& fun);
@@ -0,0 +1,32 @@
+#include "FixedStepClock.h"
+#include <algorithm>
+
+void FixedStepClock::Configure(float step, int maxCatchUpSteps)
+{
+    // A step that is not positive would pay out negative or endless steps
+    this->step = step > 0 ? step : DefaultStep;
+    this->maxCatchUpSteps = std::max(1, maxCatchUpSteps);
+    Reset();
+}
+
+void FixedStepClock::Reset()
+{
+    accumulated = 0;
+    droppedTime = 0;
+}
+
+int FixedStepClock::Advance(float elapsed)
+{
+    accumulated += std::max(0.0f, elapsed);
+    int steps = (int)(accumulated / step);
+    if (steps > maxCatchUpSteps)
+    {
+        // Keep the fraction of a step, so the blend stays continuous
+        float kept = accumulated - steps * step;
+        droppedTime += accumulated - kept - maxCatchUpSteps * step;
+        accumulated = kept + maxCatchUpSteps * step;
+        steps = maxCatchUpSteps;
+    }
+    accumulated = std::max(0.0f, accumulated - steps * step);
+    return steps;
+}
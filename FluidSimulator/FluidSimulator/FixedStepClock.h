@@ -0,0 +1,35 @@
+#pragma once
+
+// Accumulator of the fixed time step mode (SimulationOptions::fixedTimeStep). Elapsed time is
+// collected and paid out in whole steps of the same length, so a simulated second always costs
+// the same steps whatever the frame rate. What is left over is the part of a step the shown
+// state lags behind, used to blend the last two steps.
+//
+// At most maxCatchUpSteps steps run per frame. A machine that cannot keep up drops the time
+// beyond that and runs slower than real time instead of spiralling into ever longer frames.
+class FixedStepClock
+{
+public:
+    static constexpr float DefaultStep = 1.0f / 60.0f;
+
+    // A step that is not positive falls back to DefaultStep
+    void Configure(float step, int maxCatchUpSteps);
+    void Reset();
+
+    // Adds elapsed simulated time, returns the number of steps due now
+    int Advance(float elapsed);
+
+    float Step() const { return step; }
+    // Time collected towards the next step
+    float Accumulated() const { return accumulated; }
+    // Time until the next step is due
+    float TimeToNextStep() const { return step - accumulated; }
+    // Time dropped by the catch-up budget since the last reset
+    double DroppedTime() const { return droppedTime; }
+
+private:
+    float step = DefaultStep;
+    int maxCatchUpSteps = 5;
+    float accumulated = 0;
+    double droppedTime = 0;
+};
@@ -0,0 +1,92 @@
+#include "HeadlessRunner.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+HeadlessRunner::HeadlessRunner(const SimulationOptions& options
+#if RUN_MPI
+    , Transport& transport
+#endif
+)
+{
+#if RUN_MPI
+    simulation.SetTransport(&transport);
+#endif
+    simulation.options = options;
+#if !RUN_MPI
+    if (options.checkpointInterval > 0 || !options.restartFile.empty())
+    {
+        std::cerr << "Checkpoints need the MPI build, ignored" << std::endl;
+    }
+#endif
+    simulation.Start();
+}
+
+void HeadlessRunner::Run()
+{
+    const SimulationOptions& options = simulation.options;
+    std::cout << "Headless: " << options.headlessSteps << " steps of " << simulation.physics.numParticles
+        << " particles, backend " << simulation.BackendName() << std::endl;
+
+    if (options.snapshotInterval > 0)
+    {
+        WriteSnapshot(0);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int step = 0;
+    while (step < options.headlessSteps)
+    {
+        int batch = std::min(MaxBatchSteps, options.headlessSteps - step);
+        if (options.snapshotInterval > 0)
+        {
+            batch = std::min(batch, options.snapshotInterval - step % options.snapshotInterval);
+        }
+#if RUN_MPI
+        if (options.checkpointInterval > 0)
+        {
+            batch = std::min(batch, options.checkpointInterval - step % options.checkpointInterval);
+        }
+#endif
+
+        simulation.RunSteps(batch, options.headlessTimeStep);
+        step += batch;
+
+        if (options.snapshotInterval > 0 && step % options.snapshotInterval == 0)
+        {
+            WriteSnapshot(step);
+        }
+#if RUN_MPI
+        if (options.checkpointInterval > 0 && step % options.checkpointInterval == 0)
+        {
+            simulation.WriteMpiCheckpoint();
+        }
+#endif
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double seconds = std::max(elapsed.count(), 1e-9);
+    std::cout << "Headless: " << step << " steps in " << seconds << " s, "
+        << step / seconds << " steps/s, "
+        << step * (double)simulation.physics.numParticles / seconds << " particle steps/s" << std::endl;
+}
+
+bool HeadlessRunner::WriteSnapshot(int step)
+{
+    std::string path = simulation.options.snapshotPrefix + "_" + std::to_string(step) + ".csv";
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cerr << "Could not write snapshot " << path << std::endl;
+        return false;
+    }
+
+    const Physics& physics = simulation.physics;
+    file << "x,y,vx,vy\n";
+    for (unsigned int i = 0; i < physics.numParticles; i++)
+    {
+        file << physics.Positions[i].x << ',' << physics.Positions[i].y << ','
+            << physics.Velocities[i].x << ',' << physics.Velocities[i].y << '\n';
+    }
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Simulation.h"
+#include <string>
+
+// Runs the simulation without a window, for throughput runs on nodes without a display:
+// options.headlessSteps steps with a fixed time step, back to back, then a throughput summary.
+// No GLFW or ImGui context is created. Particles can be written to CSV files every
+// options.snapshotInterval steps, and under MPI to a checkpoint every options.checkpointInterval
+// steps.
+//
+// Under MPI this is rank 0 and only coordinates, as in the windowed build. It gathers the
+// particles at most every MaxBatchSteps steps, which also drives the load balancing and reports.
+class HeadlessRunner
+{
+public:
+    static constexpr int MaxBatchSteps = 20;
+
+    Simulation simulation;
+
+    HeadlessRunner(const SimulationOptions& options
+#if RUN_MPI
+        , Transport& transport
+#endif
+    );
+
+    void Run();
+
+private:
+    bool WriteSnapshot(int step);
+};
@@ -0,0 +1,123 @@
+#include "ImplicitPressureSolver.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+void ImplicitPressureSolver::Resize(unsigned int particleCount)
+{
+    pressures.assign(particleCount, 0.0f);
+    diagonals.assign(particleCount, 0.0f);
+    sources.assign(particleCount, 0.0f);
+    compressions.assign(particleCount, 0.0f);
+    accelerations.assign(particleCount, Float2(0, 0));
+    neighbours.assign(particleCount, std::vector<Neighbour>());
+}
+
+void ImplicitPressureSolver::SetParticleSpacing(float spacing)
+{
+    particleSpacing = spacing;
+    restDensityRadius = 0;
+}
+
+void ImplicitPressureSolver::BeginStep(Physics& physics)
+{
+    if (physics.smoothingRadius == restDensityRadius || particleSpacing <= 0) return;
+
+    // Density of a particle inside the square lattice the spawner places them on
+    int reach = (int)(physics.smoothingRadius / particleSpacing);
+    restDensity = 0;
+    for (int y = -reach; y <= reach; y++)
+    {
+        for (int x = -reach; x <= reach; x++)
+        {
+            float dst = std::sqrt((float)(x * x + y * y)) * particleSpacing;
+            restDensity += physics.DensityKernel(dst, physics.smoothingRadius);
+        }
+    }
+    restDensityRadius = physics.smoothingRadius;
+}
+
+void ImplicitPressureSolver::Prepare(Physics& physics, unsigned int index)
+{
+    Float2 velocity = physics.Velocities[index];
+    Float2 gradientSum = 0;
+    float squaredGradientSum = 0;
+    float divergence = 0;
+
+    std::vector<Neighbour>& ownNeighbours = neighbours[index];
+    ownNeighbours.clear();
+    physics.ForEachNeighbour(physics.PredictedPositions[index], index, [&](unsigned int neighbour, Float2 offset, float sqrDst) {
+        if (sqrDst == 0) return;
+        // Gradient of the density kernel with respect to the particle's own position
+        float dst = std::sqrt(sqrDst);
+        Float2 gradient = offset * (physics.DensityDerivative(dst, physics.smoothingRadius) / dst);
+        ownNeighbours.push_back({ neighbour, gradient });
+        gradientSum += gradient;
+        squaredGradientSum += Dot(gradient, gradient);
+        divergence += Dot(velocity - physics.Velocities[neighbour], gradient);
+    });
+
+    float density = physics.Densities[index][0];
+    float dt = physics.deltaTime;
+    diagonals[index] = -dt * dt / (density * density) * (Dot(gradientSum, gradientSum) + squaredGradientSum);
+    sources[index] = restDensity - (density + dt * divergence);
+    pressures[index] *= warmStart;
+}
+
+void ImplicitPressureSolver::ComputePressureAcceleration(Physics& physics, unsigned int index)
+{
+    float density = physics.Densities[index][0];
+    float ownTerm = pressures[index] / (density * density);
+    Float2 acceleration = 0;
+
+    for (const Neighbour& neighbour : neighbours[index])
+    {
+        float neighbourDensity = physics.Densities[neighbour.index][0];
+        acceleration -= neighbour.gradient * (ownTerm + pressures[neighbour.index] / (neighbourDensity * neighbourDensity));
+    }
+
+    accelerations[index] = acceleration;
+}
+
+void ImplicitPressureSolver::UpdatePressure(Physics& physics, unsigned int index)
+{
+    Float2 acceleration = accelerations[index];
+    float densityChange = 0;
+
+    for (const Neighbour& neighbour : neighbours[index])
+    {
+        densityChange += Dot(acceleration - accelerations[neighbour.index], neighbour.gradient);
+    }
+    densityChange *= physics.deltaTime * physics.deltaTime;
+
+    float residual = sources[index] - densityChange;
+    compressions[index] = std::max(0.0f, -residual);
+
+    // Isolated particles have no equation, and no pressure
+    float diagonal = diagonals[index];
+    float pressure = diagonal < 0 ? pressures[index] + relaxation * residual / diagonal : 0.0f;
+    pressures[index] = std::max(0.0f, pressure);
+}
+
+void ImplicitPressureSolver::ApplyPressureAcceleration(Physics& physics, unsigned int index)
+{
+    physics.Velocities[index] += accelerations[index] * physics.deltaTime;
+}
+
+std::string ImplicitPressureSolver::Report(const Physics& physics, int iterations) const
+{
+    double sum = 0;
+    float largest = 0;
+    for (unsigned int i = 0; i < physics.numParticles; i++)
+    {
+        sum += compressions[i];
+        largest = std::max(largest, compressions[i]);
+    }
+    double scale = restDensity > 0 ? 100.0 / restDensity : 0;
+
+    std::ostringstream report;
+    report << "Implicit pressure, " << iterations << " iterations: rest density " << restDensity
+        << ", compression mean " << sum / std::max(1u, physics.numParticles) * scale
+        << "% max " << largest * scale << "%\n";
+    return report.str();
+}
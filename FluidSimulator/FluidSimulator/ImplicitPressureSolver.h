@@ -0,0 +1,65 @@
+#pragma once
+
+#include "physics.h"
+#include <string>
+#include <vector>
+
+// Implicit incompressible SPH (IISPH, Ihmsen et al. 2014) in its relaxed Jacobi form, the
+// pressure scheme of SimulationOptions::pressureSolver == PressureSolver::Implicit. Instead of
+// a pressure from an equation of state, every step solves for the pressures that bring the
+// density after the step back to the rest density:
+//
+//   dt^2 * sum_j (a_i - a_j) . gradW_ij = restDensity - advectedDensity_i
+//
+// where a is the pressure acceleration and advectedDensity the density the velocities after
+// the non-pressure forces would lead to. The system is solved with a fixed number of Jacobi
+// iterations, each two neighbour passes (acceleration, then pressure), so the step stays a
+// static graph of tiled stages. The setup keeps the neighbours and kernel gradients of every
+// particle, the iterations only walk these lists. Pressures never go negative, which is what lets a
+// free surface form, and start from half of the last step's.
+//
+// The rest density is that of the spawn lattice, measured with the current kernel; the
+// targetDensity and pressure multipliers only drive the weakly compressible scheme. All
+// particles have mass 1, as in Physics. The walls only act through the collisions.
+class ImplicitPressureSolver
+{
+public:
+    float relaxation = 0.5f;
+    float warmStart = 0.5f;
+
+    void Resize(unsigned int particleCount);
+    // Distance of the spawned particles, the rest density is the density between them
+    void SetParticleSpacing(float spacing);
+    // Before every step, serial: follows changes of the smoothing radius
+    void BeginStep(Physics& physics);
+    float RestDensity() const { return restDensity; }
+
+    // Per particle, in this order with neighbour dependencies between the passes. Prepare
+    // expects the densities and the velocities after all non-pressure forces.
+    void Prepare(Physics& physics, unsigned int index);
+    void ComputePressureAcceleration(Physics& physics, unsigned int index);
+    void UpdatePressure(Physics& physics, unsigned int index);
+    // After the last ComputePressureAcceleration
+    void ApplyPressureAcceleration(Physics& physics, unsigned int index);
+
+    // Compression left after the last iteration, relative to the rest density. Serial pass.
+    std::string Report(const Physics& physics, int iterations) const;
+
+private:
+    struct Neighbour
+    {
+        unsigned int index;
+        Float2 gradient; // of the density kernel, with respect to the own position
+    };
+
+    float particleSpacing = 0;
+    float restDensity = 0;
+    float restDensityRadius = 0; // smoothing radius restDensity was measured with
+
+    std::vector<float> pressures;
+    std::vector<float> diagonals;      // coefficient of the own pressure in the system
+    std::vector<float> sources;        // restDensity - advected density
+    std::vector<float> compressions;   // predicted density above rest, before the last update
+    std::vector<Float2> accelerations; // of the current pressures
+    std::vector<std::vector<Neighbour>> neighbours; // keep their capacity from step to step
+};
@@ -0,0 +1,66 @@
+#include "InProcessRanks.h"
+#include "MpiWorker2.h"
+#include <algorithm>
+#include <sstream>
+
+// Group ids on the shared hub
+static const int SimulationGroup = 0;
+static const int WorkersGroup = 1;
+
+InProcessRanks::InProcessRanks(int rankCount, const SimulationOptions& options)
+{
+    std::shared_ptr<ThreadTransportHub> hub = std::make_shared<ThreadTransportHub>();
+    for (int rank = 0; rank < rankCount; rank++)
+    {
+        simulationTransports.emplace_back(new ThreadTransport(hub, SimulationGroup, rank, rankCount));
+    }
+    for (int rank = 1; rank < rankCount; rank++)
+    {
+        workersTransports.emplace_back(new ThreadTransport(hub, WorkersGroup, rank - 1, rankCount - 1));
+    }
+
+    // All ranks share the cpus of this process
+    int poolThreads = options.mpiWorkerThreads;
+    if (poolThreads < 0)
+    {
+        poolThreads = std::max(0, (int)std::thread::hardware_concurrency() / rankCount - 1);
+    }
+
+    for (int rank = 1; rank < rankCount; rank++)
+    {
+        Transport* simulation = simulationTransports[rank].get();
+        Transport* workers = workersTransports[rank - 1].get();
+        threads.emplace_back([simulation, workers, options, poolThreads]() {
+            MpiWorker worker(*simulation, *workers, options, poolThreads);
+            worker.Run();
+        });
+    }
+}
+
+InProcessRanks::~InProcessRanks()
+{
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+std::string InProcessRanks::VolumeReport() const
+{
+    std::ostringstream report;
+    report << "In-process transport volume (sent / received):" << std::endl;
+    for (size_t rank = 0; rank < simulationTransports.size(); rank++)
+    {
+        TransportVolume volume = simulationTransports[rank]->Volume();
+        if (rank > 0)
+        {
+            const TransportVolume& workers = workersTransports[rank - 1]->Volume();
+            volume.bytesSent += workers.bytesSent;
+            volume.bytesReceived += workers.bytesReceived;
+            volume.messagesSent += workers.messagesSent;
+        }
+        report << "  rank " << rank << ": " << volume.bytesSent / 1024 << " / " << volume.bytesReceived / 1024
+            << " KiB in " << volume.messagesSent << " messages" << std::endl;
+    }
+    return report.str();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "SimulationOptions.h"
+#include "ThreadTransport.h"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stand-in for mpirun: ranks 1..n-1 of the distributed simulation run as MpiWorker threads of
+// this process and talk through ThreadTransport. Rank 0 is the caller, Rank0() goes to
+// Simulation::SetTransport. Runs the same protocol, domain decomposition and load balancing
+// as over MPI, so they can be tested and their message volumes measured on one machine.
+class InProcessRanks
+{
+public:
+    InProcessRanks(int rankCount, const SimulationOptions& options);
+    // Joins the worker threads, Simulation::StopMpiWorkers must have been called
+    ~InProcessRanks();
+
+    Transport& Rank0() { return *simulationTransports[0]; }
+
+    // Bytes and messages every rank sent and received, on both groups
+    std::string VolumeReport() const;
+
+private:
+    std::vector<std::unique_ptr<ThreadTransport>> simulationTransports; // ranks 0..n-1
+    std::vector<std::unique_ptr<ThreadTransport>> workersTransports;    // ranks 1..n-1 as 0..n-2
+    std::vector<std::thread> threads;
+};
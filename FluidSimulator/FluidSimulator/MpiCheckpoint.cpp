@@ -0,0 +1,67 @@
+#include "MpiCheckpoint.h"
+#include <cstring>
+#include <fstream>
+
+static const char Magic[8] = "FLUIDCK";
+
+MpiCheckpoint::Header MpiCheckpoint::MakeHeader(const Physics& physics, unsigned long long step)
+{
+    Header header;
+    memset((void*)&header, 0, sizeof(header));
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.particleCount = physics.numParticles;
+    header.step = step;
+    header.parameters.Read(physics);
+    return header;
+}
+
+std::string MpiCheckpoint::PathOf(const std::string& prefix, unsigned long long step)
+{
+    return prefix + "_" + std::to_string(step) + ".chk";
+}
+
+unsigned long long MpiCheckpoint::PositionsOffset()
+{
+    return sizeof(Header);
+}
+
+unsigned long long MpiCheckpoint::VelocitiesOffset(unsigned int particleCount)
+{
+    return PositionsOffset() + (unsigned long long)particleCount * sizeof(Float2);
+}
+
+bool MpiCheckpoint::Write(Transport& transport, const std::string& path, const Header& header,
+    const Float2* positions, const Float2* velocities, unsigned int first, unsigned int count)
+{
+    std::vector<FileBlock> blocks;
+    if (transport.Rank() == 0)
+    {
+        blocks.push_back({ 0, (void*)&header, sizeof(header) });
+    }
+    if (count > 0)
+    {
+        blocks.push_back({ PositionsOffset() + (unsigned long long)first * sizeof(Float2), (void*)positions, count * sizeof(Float2) });
+        blocks.push_back({ VelocitiesOffset(header.particleCount) + (unsigned long long)first * sizeof(Float2), (void*)velocities, count * sizeof(Float2) });
+    }
+    return transport.WriteFileAll(path, blocks);
+}
+
+bool MpiCheckpoint::ReadHeader(const std::string& path, Header& header)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read((char*)&header, sizeof(header))) return false;
+    return memcmp(header.magic, Magic, sizeof(Magic)) == 0 && header.version == Version;
+}
+
+bool MpiCheckpoint::Read(Transport& transport, const std::string& path, unsigned int particleCount,
+    Float2* positions, Float2* velocities, unsigned int first, unsigned int count)
+{
+    std::vector<FileBlock> blocks;
+    if (count > 0)
+    {
+        blocks.push_back({ PositionsOffset() + (unsigned long long)first * sizeof(Float2), positions, count * sizeof(Float2) });
+        blocks.push_back({ VelocitiesOffset(particleCount) + (unsigned long long)first * sizeof(Float2), velocities, count * sizeof(Float2) });
+    }
+    return transport.ReadFileAll(path, blocks);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "physics.h"
+#include "Transport.h"
+#include <string>
+#include <type_traits>
+
+// Checkpoint file of the distributed simulation. Every rank writes the particles it owns
+// straight into one shared file and reads its share back, in a single collective file
+// operation (Transport::WriteFileAll, MPI-IO over MPI), so nothing is funnelled through rank 0
+// and the time of a checkpoint stays about the same as ranks are added.
+//
+// Layout: the header, then the positions of all particles, then their velocities. The
+// particles follow the rank order of the writers, so a file written in the domain mode holds
+// them slab by slab. A restart numbers the particles in file order, and may use any number of
+// ranks or the other MPI mode.
+class MpiCheckpoint
+{
+public:
+    static const unsigned int Version = 1;
+
+    struct Header
+    {
+        char magic[8];
+        unsigned int version;
+        unsigned int particleCount;
+        unsigned long long step; // steps run before the checkpoint
+        PhysicsParameters parameters;
+    };
+    static_assert(std::is_trivially_copyable<Header>::value, "the header is written as bytes");
+
+    static Header MakeHeader(const Physics& physics, unsigned long long step);
+
+    // File of the checkpoint after step, <prefix>_<step>.chk
+    static std::string PathOf(const std::string& prefix, unsigned long long step);
+
+    // Collective. Every rank writes its count particles to [first, first + count) of the file,
+    // header is only read on rank 0.
+    static bool Write(Transport& transport, const std::string& path, const Header& header,
+        const Float2* positions, const Float2* velocities, unsigned int first, unsigned int count);
+    // Plain read of the header by one rank, false if the file is missing or no checkpoint
+    static bool ReadHeader(const std::string& path, Header& header);
+    // Collective. Every rank reads [first, first + count) of the particleCount particles in the file.
+    static bool Read(Transport& transport, const std::string& path, unsigned int particleCount,
+        Float2* positions, Float2* velocities, unsigned int first, unsigned int count);
+
+private:
+    static unsigned long long PositionsOffset();
+    static unsigned long long VelocitiesOffset(unsigned int particleCount);
+};
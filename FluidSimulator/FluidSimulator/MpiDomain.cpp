@@ -0,0 +1,575 @@
+#include "MpiDomain.h"
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+static const int HaloTag = 10;
+static const int MigrationTag = 11;
+static const int ExtentTag = 12;
+static const int GhostCountTag = 13;
+static const int MigrantCountTag = 14;
+
+MpiDomain::MpiDomain(Physics& physics) : physics(physics)
+{
+}
+
+void MpiDomain::SetTransport(Transport* transport)
+{
+    this->transport = transport;
+    rank = transport->Rank();
+    rankCount = transport->Size();
+
+    // Workers are ranks 1..rankCount-1 from left to right, rank 0 owns no slab
+    leftRank = rank > 1 ? rank - 1 : Transport::NoRank;
+    rightRank = rank > 0 && rank < rankCount - 1 ? rank + 1 : Transport::NoRank;
+
+    if (rank > 0) {
+        extentExchange = CreateNeighbourExchange(extentsSent, extentsReceived, sizeof(float), ExtentTag);
+        ghostCountExchange = CreateNeighbourExchange(ghostCountsSent, ghostCountsReceived, sizeof(int), GhostCountTag);
+        migrantCountExchange = CreateNeighbourExchange(migrantCountsSent, migrantCountsReceived, sizeof(int), MigrantCountTag);
+    }
+}
+
+// sent and received hold one value of bytes per neighbour, the left one first
+int MpiDomain::CreateNeighbourExchange(void* sent, void* received, size_t bytes, int tag)
+{
+    char* sentValues = (char*)sent;
+    char* receivedValues = (char*)received;
+    return transport->CreatePersistentExchange({
+        { false, receivedValues, bytes, leftRank, tag },
+        { false, receivedValues + bytes, bytes, rightRank, tag },
+        { true, sentValues, bytes, leftRank, tag },
+        { true, sentValues + bytes, bytes, rightRank, tag },
+    });
+}
+
+void MpiDomain::RunPersistentExchange(int exchange)
+{
+    double start = Transport::Seconds();
+    transport->StartPersistentExchange(exchange);
+    transport->WaitPersistentExchange(exchange);
+    waitSeconds += Transport::Seconds() - start;
+}
+
+void MpiDomain::SetWireEncoding(bool wireEncoding, int floatMantissaBits)
+{
+    this->wireEncoding = wireEncoding;
+    haloCodec.SetMantissaBits(floatMantissaBits);
+    gatherVelocityCodec.SetMantissaBits(floatMantissaBits);
+}
+
+float MpiDomain::SlabEdge(int edge, int workersCount, float width)
+{
+    // The outer edges are open, particles outside the bounds still belong to a slab
+    if (edge <= 0) return -std::numeric_limits<float>::infinity();
+    if (edge >= workersCount) return std::numeric_limits<float>::infinity();
+    return width * edge / workersCount;
+}
+
+void MpiDomain::Distribute()
+{
+    unsigned int particle_count = physics.numParticles;
+    SetEvenSlabEdges();
+
+    if (rank == 0) {
+        transport->Broadcast(physics.Positions.data(), particle_count * sizeof(Float2), 0);
+        transport->Broadcast(physics.Velocities.data(), particle_count * sizeof(Float2), 0);
+        return;
+    }
+
+    // Start-up only, so every worker simply receives everything and keeps its own slab
+    std::vector<Float2> positions(particle_count);
+    std::vector<Float2> velocities(particle_count);
+    transport->Broadcast(positions.data(), particle_count * sizeof(Float2), 0);
+    transport->Broadcast(velocities.data(), particle_count * sizeof(Float2), 0);
+
+    slabStart = slabEdges[rank - 1];
+    slabEnd = slabEdges[rank];
+
+    ids.clear();
+    for (unsigned int index = 0; index < particle_count; index++) {
+        if (positions[index].x >= slabStart && positions[index].x < slabEnd) {
+            ids.push_back(index);
+        }
+    }
+
+    ownedCount = ids.size();
+    physics.numParticles = ownedCount;
+    physics.ResizeBuffers();
+    for (unsigned int i = 0; i < ownedCount; i++) {
+        physics.Positions[i] = positions[ids[i]];
+        physics.Velocities[i] = velocities[ids[i]];
+    }
+}
+
+void MpiDomain::SetEvenSlabEdges()
+{
+    int workersCount = rankCount - 1;
+    slabEdges.resize(rankCount);
+    for (int edge = 0; edge < rankCount; edge++) {
+        slabEdges[edge] = SlabEdge(edge, workersCount, physics.boundsSize.x);
+    }
+}
+
+bool MpiDomain::Restore(const std::string& path)
+{
+    unsigned int particleCount = physics.numParticles;
+    SetEvenSlabEdges();
+
+    // The share of a worker has nothing to do with its slab, the file may come from any
+    // number of ranks or from the replicated mode
+    unsigned int first = 0;
+    unsigned int count = 0;
+    int workersCount = rankCount - 1;
+    if (rank > 0) {
+        unsigned int perWorker = particleCount / workersCount;
+        first = (rank - 1) * perWorker;
+        count = rank == workersCount ? particleCount - first : perWorker;
+    }
+    std::vector<Float2> positions(count);
+    std::vector<Float2> velocities(count);
+    if (!MpiCheckpoint::Read(*transport, path, particleCount, positions.data(), velocities.data(), first, count)) {
+        return false;
+    }
+
+    // Hand every particle to the rank whose slab holds it, rank 0 sends and receives nothing
+    std::vector<std::vector<MigratingParticle>> outgoing(rankCount);
+    for (unsigned int i = 0; i < count; i++) {
+        int owner = std::upper_bound(slabEdges.begin(), slabEdges.end(), positions[i].x) - slabEdges.begin();
+        owner = std::max(1, std::min(rankCount - 1, owner));
+        outgoing[owner].push_back({ positions[i], velocities[i], first + i });
+    }
+
+    std::vector<int> sendCounts(rankCount);
+    std::vector<int> receiveCounts(rankCount);
+    for (int r = 0; r < rankCount; r++) {
+        sendCounts[r] = outgoing[r].size();
+    }
+    transport->Alltoall(sendCounts.data(), sizeof(int), receiveCounts.data());
+
+    std::vector<std::vector<MigratingParticle>> incoming(rankCount);
+    for (int r = 0; r < rankCount; r++) {
+        if (r == rank || receiveCounts[r] == 0) continue;
+        incoming[r].resize(receiveCounts[r]);
+        transport->PostReceive(incoming[r].data(), receiveCounts[r] * sizeof(MigratingParticle), r, MigrationTag);
+    }
+    for (int r = 0; r < rankCount; r++) {
+        if (r == rank || sendCounts[r] == 0) continue;
+        transport->PostSend(outgoing[r].data(), sendCounts[r] * sizeof(MigratingParticle), r, MigrationTag);
+    }
+    transport->WaitAll();
+    incoming[rank].swap(outgoing[rank]);
+
+    if (rank == 0) return true;
+
+    // In rank order, so the owned particles keep the file order
+    ids.clear();
+    ownedCount = 0;
+    for (int r = 0; r < rankCount; r++) {
+        ownedCount += incoming[r].size();
+    }
+    physics.numParticles = ownedCount;
+    physics.ResizeBuffers();
+    for (int r = 0; r < rankCount; r++) {
+        for (const MigratingParticle& particle : incoming[r]) {
+            physics.Positions[ids.size()] = particle.position;
+            physics.Velocities[ids.size()] = particle.velocity;
+            ids.push_back(particle.id);
+        }
+    }
+    return true;
+}
+
+bool MpiDomain::WriteCheckpoint(const std::string& path, unsigned long long step)
+{
+    // Every rank needs the counts of the slabs before its own and the total
+    std::vector<int> counts(rankCount, 0);
+    std::vector<int> ones(rankCount, 1);
+    std::vector<int> displacements(rankCount);
+    for (int r = 0; r < rankCount; r++) {
+        displacements[r] = r;
+    }
+    counts[rank] = rank == 0 ? 0 : ownedCount;
+    transport->AllgathervInPlace(counts.data(), ones, displacements, sizeof(int));
+
+    unsigned int first = 0;
+    unsigned int total = 0;
+    for (int r = 0; r < rankCount; r++) {
+        if (r < rank) first += counts[r];
+        total += counts[r];
+    }
+
+    MpiCheckpoint::Header header = MpiCheckpoint::MakeHeader(physics, step);
+    header.particleCount = total;
+    return MpiCheckpoint::Write(*transport, path, header, physics.Positions.data(), physics.Velocities.data(), first, counts[rank]);
+}
+
+void MpiDomain::BroadcastSlabEdges()
+{
+    transport->Broadcast(slabEdges.data(), rankCount * sizeof(float), 0);
+    if (rank > 0) {
+        slabStart = slabEdges[rank - 1];
+        slabEnd = slabEdges[rank];
+    }
+}
+
+void MpiDomain::Step()
+{
+    double stepStart = Transport::Seconds();
+
+    haloPositionCodec.SetCellSize(physics.smoothingRadius);
+    if (measureMotion) {
+        stepStartVelocities.assign(physics.Velocities.begin(), physics.Velocities.begin() + ownedCount);
+    }
+    RunOwned(&Physics::ExternalForces);
+
+    BuildHalo();
+
+    // The spatial index covers owned particles and ghosts, so neighbour searches work unchanged.
+    // Owned particles are hashed while the ghost positions travel.
+    auto hash = [this](unsigned int start, unsigned int end) {
+        physics.HashForSpatialIndex(start, end);
+    };
+    ExchangeAround(physics.PredictedPositions, haloPositionCodec, [this, &hash]() {
+        ParallelForRange(executor, 0, ownedCount, TileSize, hash);
+    });
+    ParallelForRange(executor, ownedCount, physics.numParticles, TileSize, hash);
+    physics.SortSpatialIndex();
+
+    RunParticles(boundary, &Physics::CalculateDensity);
+    ExchangeAround(physics.Densities, haloCodec, [this]() {
+        RunParticles(interior, &Physics::CalculateDensity);
+    });
+
+    RunParticles(boundary, &Physics::CalculatePressureForce);
+    ExchangeAround(physics.Velocities, haloCodec, [this]() {
+        RunParticles(interior, &Physics::CalculatePressureForce);
+        // Interior viscosity reads owned velocities only
+        RunParticles(interior, &Physics::CalculateViscosity);
+    });
+    RunParticles(boundary, &Physics::CalculateViscosity);
+
+    physics.numParticles = ownedCount;
+    if (measureMotion) {
+        motion.Add(MeasureParticleMotion(executor, physics.Velocities.data(), stepStartVelocities.data(), 0, ownedCount, TileSize, physics.deltaTime));
+    }
+    RunOwned(&Physics::UpdatePositions);
+
+    Migrate();
+
+    stepSeconds += Transport::Seconds() - stepStart;
+}
+
+void MpiDomain::RunParticles(const std::vector<unsigned int>& particles, void (Physics::*stage)(int))
+{
+    ParallelForRange(executor, 0, particles.size(), TileSize, [this, &particles, stage](unsigned int start, unsigned int end) {
+        for (unsigned int i = start; i < end; i++) {
+            (physics.*stage)(particles[i]);
+        }
+    });
+}
+
+void MpiDomain::RunOwned(void (Physics::*stage)(int))
+{
+    ParallelForRange(executor, 0, ownedCount, TileSize, [this, stage](unsigned int start, unsigned int end) {
+        for (unsigned int index = start; index < end; index++) {
+            (physics.*stage)(index);
+        }
+    });
+}
+
+void MpiDomain::BuildHalo()
+{
+    // Exchange the predicted extents first, a particle is a ghost of a neighbour if it is
+    // within one smoothing radius of that neighbour's nearest particle
+    float minX = std::numeric_limits<float>::infinity();
+    float maxX = -std::numeric_limits<float>::infinity();
+    for (unsigned int index = 0; index < ownedCount; index++) {
+        minX = std::min(minX, physics.PredictedPositions[index].x);
+        maxX = std::max(maxX, physics.PredictedPositions[index].x);
+    }
+
+    // A missing neighbour leaves its value, which then matches nothing
+    extentsSent[0] = minX;
+    extentsSent[1] = maxX;
+    extentsReceived[0] = -std::numeric_limits<float>::infinity();
+    extentsReceived[1] = std::numeric_limits<float>::infinity();
+    RunPersistentExchange(extentExchange);
+    float leftMaxX = extentsReceived[0];
+    float rightMinX = extentsReceived[1];
+
+    // The distance test is symmetric, so exactly the particles sent to a neighbour have ghosts
+    // of that neighbour in reach
+    sendLeft.clear();
+    sendRight.clear();
+    boundary.clear();
+    interior.clear();
+    for (unsigned int index = 0; index < ownedCount; index++) {
+        float x = physics.PredictedPositions[index].x;
+        bool left = x <= leftMaxX + physics.smoothingRadius;
+        bool right = x >= rightMinX - physics.smoothingRadius;
+        if (left) sendLeft.push_back(index);
+        if (right) sendRight.push_back(index);
+        if (left || right) boundary.push_back(index); else interior.push_back(index);
+    }
+
+    ghostCountsSent[0] = sendLeft.size();
+    ghostCountsSent[1] = sendRight.size();
+    ghostCountsReceived[0] = 0;
+    ghostCountsReceived[1] = 0;
+    RunPersistentExchange(ghostCountExchange);
+    ghostsFromLeft = ghostCountsReceived[0];
+    ghostsFromRight = ghostCountsReceived[1];
+
+    physics.numParticles = ownedCount + ghostsFromLeft + ghostsFromRight;
+    physics.ResizeBuffers();
+}
+
+void MpiDomain::BeginHaloExchange(ParticleBuffer<Float2>& field, MpiWireCodec& codec)
+{
+    // Packed copies, so the owned values may change while the sends are in flight
+    sendBufferLeft.resize(sendLeft.size());
+    sendBufferRight.resize(sendRight.size());
+    for (size_t i = 0; i < sendLeft.size(); i++) sendBufferLeft[i] = field[sendLeft[i]];
+    for (size_t i = 0; i < sendRight.size(); i++) sendBufferRight[i] = field[sendRight[i]];
+
+    if (wireEncoding) {
+        // The ghost counts are known, so the receives take the largest encoding
+        sendBytesLeft.clear();
+        sendBytesRight.clear();
+        codec.Encode(sendBufferLeft.data(), 0, sendBufferLeft.size(), sendBytesLeft);
+        codec.Encode(sendBufferRight.data(), 0, sendBufferRight.size(), sendBytesRight);
+        receiveBytesLeft.resize(MpiWireCodec::MaxBytes(ghostsFromLeft));
+        receiveBytesRight.resize(MpiWireCodec::MaxBytes(ghostsFromRight));
+        haloInFlightCodec = &codec;
+        haloInFlightField = &field;
+
+        transport->PostReceive(receiveBytesLeft.data(), receiveBytesLeft.size(), leftRank, HaloTag);
+        transport->PostReceive(receiveBytesRight.data(), receiveBytesRight.size(), rightRank, HaloTag);
+        transport->PostSend(sendBytesRight.data(), sendBytesRight.size(), rightRank, HaloTag);
+        transport->PostSend(sendBytesLeft.data(), sendBytesLeft.size(), leftRank, HaloTag);
+        return;
+    }
+
+    Float2* ghostsLeft = field.data() + ownedCount;
+    Float2* ghostsRight = ghostsLeft + ghostsFromLeft;
+    transport->PostReceive(ghostsLeft, ghostsFromLeft * sizeof(Float2), leftRank, HaloTag);
+    transport->PostReceive(ghostsRight, ghostsFromRight * sizeof(Float2), rightRank, HaloTag);
+    transport->PostSend(sendBufferRight.data(), sendBufferRight.size() * sizeof(Float2), rightRank, HaloTag);
+    transport->PostSend(sendBufferLeft.data(), sendBufferLeft.size() * sizeof(Float2), leftRank, HaloTag);
+}
+
+void MpiDomain::FinishHaloExchange()
+{
+    double start = Transport::Seconds();
+    transport->WaitAll();
+    waitSeconds += Transport::Seconds() - start;
+
+    if (haloInFlightCodec) {
+        haloInFlightCodec->Decode(receiveBytesLeft.data(), haloInFlightField->data(), ownedCount, ghostsFromLeft);
+        haloInFlightCodec->Decode(receiveBytesRight.data(), haloInFlightField->data(), ownedCount + ghostsFromLeft, ghostsFromRight);
+        haloInFlightCodec = nullptr;
+    }
+}
+
+void MpiDomain::ExchangeAround(ParticleBuffer<Float2>& field, MpiWireCodec& codec, const std::function<void()>& interiorWork)
+{
+    if (overlap) {
+        BeginHaloExchange(field, codec);
+        interiorWork();
+    }
+    else {
+        interiorWork();
+        BeginHaloExchange(field, codec);
+    }
+    FinishHaloExchange();
+}
+
+void MpiDomain::SendReceive(const void* sendBuffer, size_t sendBytes, int destination,
+    void* receiveBuffer, size_t receiveBytes, int source, int tag)
+{
+    double start = Transport::Seconds();
+    transport->SendReceive(sendBuffer, sendBytes, destination, receiveBuffer, receiveBytes, source, tag);
+    waitSeconds += Transport::Seconds() - start;
+}
+
+void MpiDomain::Migrate()
+{
+    migrateLeft.clear();
+    migrateRight.clear();
+
+    // Compact the particles that stay, the others go to the neighbour whose slab they entered
+    unsigned int kept = 0;
+    for (unsigned int index = 0; index < ownedCount; index++) {
+        MigratingParticle particle = { physics.Positions[index], physics.Velocities[index], ids[index] };
+        if (particle.position.x < slabStart && leftRank != Transport::NoRank) {
+            migrateLeft.push_back(particle);
+        }
+        else if (particle.position.x >= slabEnd && rightRank != Transport::NoRank) {
+            migrateRight.push_back(particle);
+        }
+        else {
+            physics.Positions[kept] = particle.position;
+            physics.Velocities[kept] = particle.velocity;
+            ids[kept] = particle.id;
+            kept++;
+        }
+    }
+
+    migrantCountsSent[0] = migrateLeft.size();
+    migrantCountsSent[1] = migrateRight.size();
+    migrantCountsReceived[0] = 0;
+    migrantCountsReceived[1] = 0;
+    RunPersistentExchange(migrantCountExchange);
+
+    migrated.clear();
+    ExchangeMigrants(migrateRight, rightRank, leftRank, migrantCountsReceived[0]);
+    ExchangeMigrants(migrateLeft, leftRank, rightRank, migrantCountsReceived[1]);
+
+    ownedCount = kept + migrated.size();
+    ids.resize(ownedCount);
+    physics.numParticles = ownedCount;
+    physics.ResizeBuffers();
+    for (size_t i = 0; i < migrated.size(); i++) {
+        physics.Positions[kept + i] = migrated[i].position;
+        physics.Velocities[kept + i] = migrated[i].velocity;
+        ids[kept + i] = migrated[i].id;
+    }
+}
+
+// Sends outgoing to destination and appends the receiveCount particles source sends to migrated
+void MpiDomain::ExchangeMigrants(std::vector<MigratingParticle>& outgoing, int destination, int source, int receiveCount)
+{
+    int sendCount = outgoing.size();
+    size_t offset = migrated.size();
+    migrated.resize(offset + receiveCount);
+    SendReceive(outgoing.data(), sendCount * sizeof(MigratingParticle), destination,
+        migrated.data() + offset, receiveCount * sizeof(MigratingParticle), source, MigrationTag);
+}
+
+void MpiDomain::Gather(int steps)
+{
+    int count = rank == 0 ? 0 : ownedCount;
+
+    // The counters of the steps since the last gather travel with the particles
+    double times[2] = { waitSeconds, stepSeconds };
+    waitSeconds = 0;
+    stepSeconds = 0;
+    gatherPositionCodec.SetCellSize(physics.smoothingRadius);
+
+    if (rank != 0) {
+        transport->Gather(times, sizeof(times), nullptr, 0);
+        if (measureMotion) {
+            transport->Gather(&motion, sizeof(ParticleMotion), nullptr, 0);
+            motion = ParticleMotion();
+        }
+        transport->Gather(&count, sizeof(int), nullptr, 0);
+        transport->Gatherv(ids.data(), count, nullptr, gatherCounts, gatherDisplacements, sizeof(unsigned int), 0);
+        if (wireEncoding) {
+            gatherPositionCodec.Gatherv(*transport, physics.Positions.data(), 0, count, nullptr, gatherCounts, gatherDisplacements, 0);
+            gatherVelocityCodec.Gatherv(*transport, physics.Velocities.data(), 0, count, nullptr, gatherCounts, gatherDisplacements, 0);
+            return;
+        }
+        transport->Gatherv(physics.Positions.data(), count, nullptr, gatherCounts, gatherDisplacements, sizeof(Float2), 0);
+        transport->Gatherv(physics.Velocities.data(), count, nullptr, gatherCounts, gatherDisplacements, sizeof(Float2), 0);
+        return;
+    }
+
+    gatherTimes.resize(rankCount * 2);
+    rankTimes.resize(rankCount * 2);
+    transport->Gather(times, sizeof(times), gatherTimes.data(), 0);
+    for (int i = 0; i < rankCount * 2; i++) {
+        rankTimes[i] += gatherTimes[i];
+    }
+    reportSteps += steps;
+
+    if (measureMotion) {
+        ParticleMotion noMotion;
+        std::vector<ParticleMotion> motions(rankCount);
+        transport->Gather(&noMotion, sizeof(ParticleMotion), motions.data(), 0);
+        for (const ParticleMotion& rankMotion : motions) motion.Add(rankMotion);
+    }
+
+    gatherCounts.resize(rankCount);
+    gatherDisplacements.resize(rankCount);
+    transport->Gather(&count, sizeof(int), gatherCounts.data(), 0);
+
+    int total = 0;
+    for (int r = 0; r < rankCount; r++) {
+        gatherDisplacements[r] = total;
+        total += gatherCounts[r];
+    }
+    gatherIds.resize(total);
+    gatherPositions.resize(total);
+    gatherVelocities.resize(total);
+    transport->Gatherv(nullptr, 0, gatherIds.data(), gatherCounts, gatherDisplacements, sizeof(unsigned int), 0);
+    if (wireEncoding) {
+        gatherPositionCodec.Gatherv(*transport, nullptr, 0, 0, gatherPositions.data(), gatherCounts, gatherDisplacements, 0);
+        gatherVelocityCodec.Gatherv(*transport, nullptr, 0, 0, gatherVelocities.data(), gatherCounts, gatherDisplacements, 0);
+    }
+    else {
+        transport->Gatherv(nullptr, 0, gatherPositions.data(), gatherCounts, gatherDisplacements, sizeof(Float2), 0);
+        transport->Gatherv(nullptr, 0, gatherVelocities.data(), gatherCounts, gatherDisplacements, sizeof(Float2), 0);
+    }
+
+    for (int i = 0; i < total; i++) {
+        if (gatherIds[i] >= physics.numParticles) continue;
+        physics.Positions[gatherIds[i]] = gatherPositions[i];
+        physics.Velocities[gatherIds[i]] = gatherVelocities[i];
+    }
+
+    if (loadBalancing) {
+        Rebalance();
+    }
+}
+
+ParticleMotion MpiDomain::TakeMotion()
+{
+    ParticleMotion taken = motion;
+    motion = ParticleMotion();
+    return taken;
+}
+
+// Rank 0, right after a gather
+void MpiDomain::Rebalance()
+{
+    int workersCount = rankCount - 1;
+    std::vector<double> computeSeconds(workersCount);
+    for (int r = 1; r < rankCount; r++) {
+        computeSeconds[r - 1] = gatherTimes[r * 2 + 1] - gatherTimes[r * 2];
+    }
+    if (!balancer.Measure(computeSeconds)) return;
+
+    std::vector<std::pair<float, int>> elements;
+    elements.reserve(gatherPositions.size());
+    for (int r = 1; r < rankCount; r++) {
+        for (int i = gatherDisplacements[r]; i < gatherDisplacements[r] + gatherCounts[r]; i++) {
+            elements.push_back({ gatherPositions[i].x, r - 1 });
+        }
+    }
+
+    std::vector<double> cuts(slabEdges.begin(), slabEdges.end());
+    balancer.Rebalance(cuts, elements, physics.smoothingRadius * 2);
+    for (int edge = 0; edge < rankCount; edge++) {
+        slabEdges[edge] = (float)cuts[edge];
+    }
+}
+
+std::string MpiDomain::WaitReport()
+{
+    std::ostringstream report;
+    report << "MPI wait per step over " << reportSteps << " steps (" << (overlap ? "overlapped" : "blocking") << " halo):" << std::endl;
+    for (int r = 1; r < rankCount && reportSteps > 0; r++) {
+        double wait = rankTimes[r * 2] / reportSteps * 1000;
+        double step = rankTimes[r * 2 + 1] / reportSteps * 1000;
+        report << "  rank " << r << ": " << wait << " of " << step << " ms";
+        if (step > 0) report << " (" << (int)(wait / step * 100) << "%)";
+        report << std::endl;
+    }
+    if (loadBalancing) {
+        report << balancer.Report();
+    }
+    rankTimes.assign(rankTimes.size(), 0.0);
+    reportSteps = 0;
+    return report.str();
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include "Executor.h"
+#include "MpiCheckpoint.h"
+#include "MpiLoadBalancer.h"
+#include "MpiWireCodec.h"
+#include "physics.h"
+#include "TimeStepController.h"
+#include "Transport.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+// Spatial domain decomposition of the MPI simulation. Every worker owns the particles inside
+// a vertical slab of the bounds and keeps them from step to step. A step only exchanges a
+// halo of one smoothing radius with the two neighbouring slabs, and hands particles that left
+// the slab over to its neighbour, so the traffic grows with the slab surface, not with the
+// particle count. Slabs must stay wider than the smoothing radius.
+//
+// Local buffer layout on a worker: owned particles, then ghosts from the left neighbour,
+// then ghosts from the right neighbour.
+//
+// The small fixed-size exchanges of every step (extents, ghost and migrant counts) are
+// persistent, so they are set up once and only started afterwards.
+//
+// Halo exchanges are non-blocking: the boundary particles (the ones the neighbours need,
+// which are also the only ones that read ghosts) are computed first and sent, and the
+// interior is computed while the messages are in flight. Every rank counts the time it
+// spends waiting on MPI, rank 0 collects the counters with the particles.
+//
+// With wire encoding the halos and the gathers travel through MpiWireCodec. The ghosts of a
+// step are different particles every time, so their values are coded against the previous
+// particle of the message, not against the previous step.
+//
+// With load balancing, rank 0 moves the slab edges so the compute time (step minus wait) of
+// the workers evens out. The edges go to the workers with every step command, particles that
+// end up outside their slab migrate at the end of the next step.
+class MpiDomain
+{
+public:
+    MpiDomain(Physics& physics);
+
+    void SetTransport(Transport* transport);
+
+    // Collective, after the parameters and the particle count. Rank 0 broadcasts its full
+    // particle state, every worker keeps the particles of its slab.
+    void Distribute();
+    // Collective, after the parameters and the particle count of the checkpoint. Every worker
+    // reads an even share of the file and hands its particles to the workers whose slabs
+    // hold them, the particles are numbered in file order. False on all ranks if the file
+    // could not be read, the particles are left as they were then.
+    bool Restore(const std::string& path);
+    // Collective. Every worker writes its slab into the checkpoint after step, the slabs follow
+    // the rank order.
+    bool WriteCheckpoint(const std::string& path, unsigned long long step);
+    // Collective. Rank 0 sends the current slab edges, after the step parameters.
+    void BroadcastSlabEdges();
+    // Workers only, after the step parameters have been received
+    void Step();
+    // Collective. Rank 0 receives the particles of all slabs back into their global order,
+    // steps is the number of steps run since the last gather.
+    void Gather(int steps);
+
+    static float SlabEdge(int edge, int workersCount, float width);
+
+    // Runs the particle loops of the step in parallel, nullptr runs them on the calling thread
+    void SetExecutor(Executor* executor) { this->executor = executor; }
+
+    // Compute all particles before exchanging, for comparing against the overlapped step
+    void SetOverlap(bool overlap) { this->overlap = overlap; }
+
+    // Send the halos and gathers encoded, all ranks must agree
+    void SetWireEncoding(bool wireEncoding, int floatMantissaBits);
+
+    // Measure the largest speed and acceleration of the owned particles in every step, they
+    // travel to rank 0 with the gathers. All ranks must agree.
+    void SetMotionMeasurement(bool measureMotion) { this->measureMotion = measureMotion; }
+    // Rank 0: motion of all slabs gathered since the last call
+    ParticleMotion TakeMotion();
+
+    // Rank 0: move the slab edges after gathers that show an imbalance
+    void SetLoadBalancing(bool loadBalancing) { this->loadBalancing = loadBalancing; }
+
+    // Rank 0: steps run since the last report, and per worker wait and step times
+    int StepsSinceReport() const { return reportSteps; }
+    std::string WaitReport();
+
+private:
+    // Particle handed over to a neighbouring slab
+    struct MigratingParticle
+    {
+        Float2 position;
+        Float2 velocity;
+        unsigned int id;
+    };
+
+    static const unsigned int TileSize = 256;
+
+    Physics& physics;
+    Executor* executor = nullptr;
+    Transport* transport = nullptr;
+    int rank = 0;
+    int rankCount = 1;
+    int leftRank = Transport::NoRank;
+    int rightRank = Transport::NoRank;
+    float slabStart = 0;
+    float slabEnd = 0;
+    std::vector<float> slabEdges; // slab of rank r is [slabEdges[r - 1], slabEdges[r])
+    bool loadBalancing = false;
+    MpiLoadBalancer balancer; // rank 0 only
+
+    unsigned int ownedCount = 0;
+    std::vector<unsigned int> ids; // global index of every owned particle
+
+    std::vector<unsigned int> sendLeft; // owned particles that are ghosts of the left neighbour
+    std::vector<unsigned int> sendRight;
+    std::vector<unsigned int> boundary; // owned particles with ghosts in reach, sent ones first
+    std::vector<unsigned int> interior;
+    int ghostsFromLeft = 0;
+    int ghostsFromRight = 0;
+    std::vector<Float2> sendBufferLeft;
+    std::vector<Float2> sendBufferRight;
+    bool overlap = true;
+
+    bool wireEncoding = false;
+    MpiWireCodec haloPositionCodec{ MpiWireCodec::Kind::Position, false };
+    MpiWireCodec haloCodec{ MpiWireCodec::Kind::Float, false };
+    MpiWireCodec gatherPositionCodec{ MpiWireCodec::Kind::Position, false };
+    MpiWireCodec gatherVelocityCodec{ MpiWireCodec::Kind::Float, false };
+    std::vector<unsigned char> sendBytesLeft;
+    std::vector<unsigned char> sendBytesRight;
+    std::vector<unsigned char> receiveBytesLeft;
+    std::vector<unsigned char> receiveBytesRight;
+    MpiWireCodec* haloInFlightCodec = nullptr; // decodes the ghosts once the exchange finished
+    ParticleBuffer<Float2>* haloInFlightField = nullptr;
+
+    bool measureMotion = false;
+    ParticleMotion motion; // since the last gather on workers, gathered ones on rank 0
+    std::vector<Float2> stepStartVelocities;
+
+    double waitSeconds = 0; // time blocked in MPI since the last gather
+    double stepSeconds = 0;
+    int reportSteps = 0;
+    std::vector<double> rankTimes; // rank 0: wait and step seconds of every rank since the last report
+    std::vector<double> gatherTimes;
+
+    // Buffers of the persistent exchanges, index 0 goes to or comes from the left neighbour
+    float extentsSent[2] = { 0, 0 };     // own min x, own max x
+    float extentsReceived[2] = { 0, 0 }; // max x of the left neighbour, min x of the right one
+    int ghostCountsSent[2] = { 0, 0 };
+    int ghostCountsReceived[2] = { 0, 0 };
+    int migrantCountsSent[2] = { 0, 0 };
+    int migrantCountsReceived[2] = { 0, 0 };
+    int extentExchange = -1;
+    int ghostCountExchange = -1;
+    int migrantCountExchange = -1;
+
+    std::vector<MigratingParticle> migrateLeft;
+    std::vector<MigratingParticle> migrateRight;
+    std::vector<MigratingParticle> migrated;
+
+    std::vector<int> gatherCounts; // rank 0 only
+    std::vector<int> gatherDisplacements;
+    std::vector<unsigned int> gatherIds;
+    std::vector<Float2> gatherPositions;
+    std::vector<Float2> gatherVelocities;
+
+    void SetEvenSlabEdges();
+    void BuildHalo();
+    void BeginHaloExchange(ParticleBuffer<Float2>& field, MpiWireCodec& codec);
+    void FinishHaloExchange();
+    void SendReceive(const void* sendBuffer, size_t sendBytes, int destination,
+        void* receiveBuffer, size_t receiveBytes, int source, int tag);
+    int CreateNeighbourExchange(void* sent, void* received, size_t bytes, int tag);
+    void RunPersistentExchange(int exchange);
+    // Runs interiorWork while field is exchanged (or before, without overlap), codec encodes
+    // field with wire encoding
+    void ExchangeAround(ParticleBuffer<Float2>& field, MpiWireCodec& codec, const std::function<void()>& interiorWork);
+    void RunParticles(const std::vector<unsigned int>& particles, void (Physics::*stage)(int));
+    void RunOwned(void (Physics::*stage)(int));
+    void Migrate();
+    void Rebalance();
+    void ExchangeMigrants(std::vector<MigratingParticle>& outgoing, int destination, int source, int receiveCount);
+};
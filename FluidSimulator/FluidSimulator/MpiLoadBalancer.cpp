@@ -0,0 +1,107 @@
+#include "MpiLoadBalancer.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+bool MpiLoadBalancer::Measure(const std::vector<double>& computeSeconds)
+{
+    seconds = computeSeconds;
+    if (seconds.empty()) return false;
+
+    double slowest = 0;
+    double total = 0;
+    for (double s : seconds)
+    {
+        slowest = std::max(slowest, s);
+        total += s;
+    }
+    if (total <= 0) return false;
+
+    imbalance = (float)(slowest / (total / seconds.size()));
+    worstImbalance = std::max(worstImbalance, imbalance);
+
+    if (skipMeasurement)
+    {
+        skipMeasurement = false;
+        return false;
+    }
+    return imbalance > threshold && seconds.size() > 1;
+}
+
+void MpiLoadBalancer::Rebalance(std::vector<double>& cuts, std::vector<std::pair<float, int>>& elements, double minWidth)
+{
+    int workers = (int)cuts.size() - 1;
+    if (workers < 2 || (int)seconds.size() != workers || elements.empty()) return;
+
+    std::vector<int> counts(workers, 0);
+    for (const auto& element : elements)
+    {
+        counts[element.second]++;
+    }
+
+    // Workers without particles give no estimate, they get the mean cost
+    double totalSeconds = 0;
+    for (double s : seconds) totalSeconds += s;
+    double meanCost = totalSeconds / elements.size();
+    std::vector<double> cost(workers);
+    for (int w = 0; w < workers; w++)
+    {
+        cost[w] = counts[w] > 0 ? seconds[w] / counts[w] : meanCost;
+    }
+
+    std::sort(elements.begin(), elements.end());
+    double totalCost = 0;
+    for (const auto& element : elements) totalCost += cost[element.second];
+
+    // The first particle past each equal share of the cost starts the next part
+    std::vector<double> target(cuts);
+    double accumulated = 0;
+    int cut = 1;
+    for (size_t i = 0; i < elements.size() && cut < workers; i++)
+    {
+        while (cut < workers && accumulated >= totalCost * cut / workers)
+        {
+            target[cut++] = elements[i].first;
+        }
+        accumulated += cost[elements[i].second];
+    }
+    while (cut < workers)
+    {
+        target[cut++] = elements.back().first;
+    }
+
+    std::vector<double> moved(cuts);
+    for (int c = 1; c < workers; c++)
+    {
+        double step = (target[c] - cuts[c]) * damping;
+        double leftWidth = cuts[c] - cuts[c - 1];
+        double rightWidth = cuts[c + 1] - cuts[c];
+        if (std::isfinite(leftWidth)) step = std::max(step, -leftWidth / 2);
+        if (std::isfinite(rightWidth)) step = std::min(step, rightWidth / 2);
+        moved[c] = cuts[c] + step;
+    }
+
+    // Keep every part wide enough, from both ends so the outer cuts are respected
+    for (int c = 1; c < workers; c++)
+    {
+        if (std::isfinite(moved[c - 1])) moved[c] = std::max(moved[c], moved[c - 1] + minWidth);
+    }
+    for (int c = workers - 1; c > 0; c--)
+    {
+        if (std::isfinite(moved[c + 1])) moved[c] = std::min(moved[c], moved[c + 1] - minWidth);
+    }
+
+    cuts = moved;
+    rebalances++;
+    skipMeasurement = true;
+}
+
+std::string MpiLoadBalancer::Report()
+{
+    std::ostringstream report;
+    report << "MPI load imbalance (slowest / mean compute time): " << imbalance << ", worst " << worstImbalance
+        << ", rebalanced " << rebalances << " times" << std::endl;
+    worstImbalance = imbalance;
+    rebalances = 0;
+    return report.str();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Moves the cuts between the work of the MPI workers (particle index ranges in the replicated
+// mode, slab edges in the domain mode) so every worker needs about the same compute time.
+// The particles of a worker are assumed to cost the same, so the measured time of a worker
+// spread over its particles gives a cost per particle, and the new cuts split the summed cost
+// evenly. Cuts only move once the imbalance exceeds the threshold, and only part of the way,
+// so noise in the timings does not make the work hop back and forth.
+class MpiLoadBalancer
+{
+public:
+    // Slowest worker / mean above which the cuts are moved
+    float threshold = 1.1f;
+    // Fraction of the way to the balanced cuts moved per rebalancing
+    float damping = 0.5f;
+
+    // Compute seconds of every worker since the last call. True if the cuts should be moved.
+    bool Measure(const std::vector<double>& computeSeconds);
+
+    // cuts holds workers + 1 increasing edges, the outer ones never move. elements are the
+    // (coordinate, worker) pairs of all particles along the cut axis, sorted by this call.
+    // Inner cuts stay at least minWidth apart and move at most half the width of a neighbouring part.
+    void Rebalance(std::vector<double>& cuts, std::vector<std::pair<float, int>>& elements, double minWidth);
+
+    float ImbalanceRatio() const { return imbalance; }
+    std::string Report();
+
+private:
+    std::vector<double> seconds; // of the last measurement
+    float imbalance = 1.0f;
+    float worstImbalance = 1.0f;  // since the last report
+    int rebalances = 0;           // since the last report
+    bool skipMeasurement = false; // the first one after a rebalancing mixes both distributions
+};
@@ -0,0 +1,156 @@
+#include "MpiSharedBuffers.h"
+#include <iostream>
+
+// Cache line alignment of every buffer inside the window
+static const size_t BufferAlignment = 64;
+
+static size_t AlignedBytes(size_t bytes)
+{
+    return (bytes + BufferAlignment - 1) / BufferAlignment * BufferAlignment;
+}
+
+// Points buffer at its part of the window and advances offset past it
+template<typename T>
+static void PlaceBuffer(ParticleBuffer<T>& buffer, char* base, size_t& offset, unsigned int count)
+{
+    size_t bytes = AlignedBytes(count * sizeof(T));
+    buffer = ParticleBuffer<T>(FirstTouchAllocator<T>(base + offset, bytes));
+    buffer.resize(count);
+    offset += bytes;
+}
+
+void MpiSharedBuffers::CreateCommunicators(MPI_Comm workersComm)
+{
+    if (nodeComm != MPI_COMM_NULL) return;
+
+    this->workersComm = workersComm;
+    MPI_Comm_rank(workersComm, &workersRank);
+    MPI_Comm_split_type(workersComm, MPI_COMM_TYPE_SHARED, workersRank, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_rank(nodeComm, &nodeRank);
+    MPI_Comm_split(workersComm, nodeRank == 0 ? 0 : MPI_UNDEFINED, workersRank, &leadersComm);
+    if (leadersComm != MPI_COMM_NULL) leadersTransport.reset(new MpiTransport(leadersComm));
+}
+
+bool MpiSharedBuffers::ComputeLayout(unsigned int rangeStart, unsigned int rangeEnd)
+{
+    // The ranges are disjoint, so they form one block exactly when they add up to its extent
+    unsigned int blockStart, blockEnd, blockCount;
+    unsigned int rangeCount = rangeEnd - rangeStart;
+    MPI_Allreduce(&rangeStart, &blockStart, 1, MPI_UNSIGNED, MPI_MIN, nodeComm);
+    MPI_Allreduce(&rangeEnd, &blockEnd, 1, MPI_UNSIGNED, MPI_MAX, nodeComm);
+    MPI_Allreduce(&rangeCount, &blockCount, 1, MPI_UNSIGNED, MPI_SUM, nodeComm);
+
+    int contiguous = blockCount == 0 || blockEnd - blockStart == blockCount;
+    int allContiguous;
+    MPI_Allreduce(&contiguous, &allContiguous, 1, MPI_INT, MPI_LAND, workersComm);
+    if (!allContiguous) return false;
+
+    // Non-leaders only need to know whether there is anything to wait for
+    nodeCount = 0;
+    if (leadersComm != MPI_COMM_NULL) MPI_Comm_size(leadersComm, &nodeCount);
+    MPI_Bcast(&nodeCount, 1, MPI_INT, 0, nodeComm);
+
+    if (leadersComm != MPI_COMM_NULL) {
+        int block[2] = { (int)blockStart * 2, (int)blockCount * 2 };
+        int leaderCount = nodeCount;
+        std::vector<int> blocks(leaderCount * 2);
+        MPI_Allgather(block, 2, MPI_INT, blocks.data(), 2, MPI_INT, leadersComm);
+
+        leaderCounts.resize(leaderCount);
+        leaderDisplacements.resize(leaderCount);
+        leaderBlockCounts.resize(leaderCount);
+        leaderBlockDisplacements.resize(leaderCount);
+        for (int leader = 0; leader < leaderCount; leader++) {
+            leaderDisplacements[leader] = blocks[leader * 2];
+            leaderCounts[leader] = blocks[leader * 2 + 1];
+            leaderBlockDisplacements[leader] = blocks[leader * 2] / 2;
+            leaderBlockCounts[leader] = blocks[leader * 2 + 1] / 2;
+        }
+    }
+
+    // Loops over all particles (hashing) are split evenly between the ranks of the node
+    int nodeRanks;
+    MPI_Comm_size(nodeComm, &nodeRanks);
+    nodeShareStart = (unsigned int)((unsigned long long)particleCount * nodeRank / nodeRanks);
+    nodeShareEnd = (unsigned int)((unsigned long long)particleCount * (nodeRank + 1) / nodeRanks);
+    return true;
+}
+
+bool MpiSharedBuffers::Attach(MPI_Comm workersComm, Physics& physics, unsigned int rangeStart, unsigned int rangeEnd)
+{
+    CreateCommunicators(workersComm);
+    particleCount = physics.numParticles;
+    if (!ComputeLayout(rangeStart, rangeEnd)) {
+        if (workersRank == 0) {
+            std::cerr << "Worker ranks of a node are not consecutive, not sharing particle buffers" << std::endl;
+        }
+        return false;
+    }
+
+    unsigned int count = physics.numParticles;
+    size_t bytes = AlignedBytes(count * sizeof(Float2)) * 4
+        + AlignedBytes(count * sizeof(SpatialEntry)) * 2
+        + AlignedBytes(count * sizeof(ImU32)) * 2;
+
+    // The leader allocates the whole window, so the node's arrays are contiguous
+    char* base;
+    MPI_Win_allocate_shared(nodeRank == 0 ? bytes : 0, 1, MPI_INFO_NULL, nodeComm, &base, &window);
+    MPI_Aint leaderBytes;
+    int displacementUnit;
+    MPI_Win_shared_query(window, 0, &leaderBytes, &displacementUnit, &base);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+
+    size_t offset = 0;
+    PlaceBuffer(physics.Positions, base, offset, count);
+    PlaceBuffer(physics.PredictedPositions, base, offset, count);
+    PlaceBuffer(physics.Velocities, base, offset, count);
+    PlaceBuffer(physics.Densities, base, offset, count);
+    PlaceBuffer(physics.SpatialIndices, base, offset, count);
+    PlaceBuffer(physics.SpatialOffsets, base, offset, count);
+    PlaceBuffer(physics.unsortedEntries, base, offset, count);
+    PlaceBuffer(physics.keyCursors, base, offset, count);
+    return true;
+}
+
+bool MpiSharedBuffers::SetRange(unsigned int rangeStart, unsigned int rangeEnd)
+{
+    return ComputeLayout(rangeStart, rangeEnd);
+}
+
+void MpiSharedBuffers::Detach(Physics& physics)
+{
+    if (window == MPI_WIN_NULL) return;
+
+    // Swapping with empty buffers hands the window region to temporaries, which never free it
+    physics.FreeBuffers();
+    MPI_Win_unlock_all(window);
+    MPI_Win_free(&window);
+}
+
+void MpiSharedBuffers::Free()
+{
+    leadersTransport.reset();
+    if (leadersComm != MPI_COMM_NULL) MPI_Comm_free(&leadersComm);
+    if (nodeComm != MPI_COMM_NULL) MPI_Comm_free(&nodeComm);
+}
+
+void MpiSharedBuffers::NodeBarrier()
+{
+    MPI_Win_sync(window);
+    MPI_Barrier(nodeComm);
+    MPI_Win_sync(window);
+}
+
+void MpiSharedBuffers::Share(ParticleBuffer<Float2>& field, MpiWireCodec* codec)
+{
+    NodeBarrier();
+    if (nodeCount <= 1) return;
+
+    if (leadersComm != MPI_COMM_NULL && codec) {
+        codec->AllgathervInPlace(*leadersTransport, field.data(), leaderBlockCounts, leaderBlockDisplacements);
+    }
+    else if (leadersComm != MPI_COMM_NULL) {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, field.data(), leaderCounts.data(), leaderDisplacements.data(), MPI_FLOAT, leadersComm);
+    }
+    NodeBarrier();
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "MpiTransport.h"
+#include "MpiWireCodec.h"
+#include "physics.h"
+#include <memory>
+#include <mpi.h>
+#include <vector>
+
+// Places the particle buffers of all worker ranks on a node in one MPI shared memory window
+// (MPI_Win_allocate_shared on a MPI_COMM_TYPE_SHARED split of the workers). Every rank writes
+// its own range straight into the node's arrays, so within a node nothing is copied and the
+// buffers exist once per node instead of once per rank. Across nodes only the node leaders
+// exchange the node blocks, every other rank just waits on the node barrier.
+//
+// This needs the ranges of the ranks of a node to be one contiguous block, which holds for
+// the usual by-slot/by-core placement. Otherwise Attach leaves every rank on private buffers.
+class MpiSharedBuffers
+{
+public:
+    // Collective over workersComm. Sizes the buffers of physics for physics.numParticles inside
+    // the node window, range is the particle range this rank updates.
+    bool Attach(MPI_Comm workersComm, Physics& physics, unsigned int rangeStart, unsigned int rangeEnd);
+    // Collective over the workers, after the ranges moved (they must stay in rank order).
+    // Returns false if the ranges of a node no longer form one block. That cannot happen
+    // after a successful Attach: its ranks are consecutive, and ranges in rank order then
+    // always join up, wherever the load balancer moves their edges.
+    bool SetRange(unsigned int rangeStart, unsigned int rangeEnd);
+    // Collective over the node. Moves physics back onto private buffers and frees the window.
+    void Detach(Physics& physics);
+    // Collective over workersComm, after Detach
+    void Free();
+
+    bool IsAttached() const { return window != MPI_WIN_NULL; }
+    bool IsLeader() const { return nodeRank == 0; }
+
+    // The part of [0, numParticles) this rank handles when the node splits a whole-array loop
+    unsigned int NodeShareStart() const { return nodeShareStart; }
+    unsigned int NodeShareEnd() const { return nodeShareEnd; }
+
+    // Makes the writes of every rank of the node visible to the others
+    void NodeBarrier();
+
+    // Once every rank has written its own range of field: the leaders exchange the node blocks,
+    // after which every rank sees the whole field. With a codec the blocks travel encoded, the
+    // codec's references are only kept by the leaders.
+    void Share(ParticleBuffer<Float2>& field, MpiWireCodec* codec = nullptr);
+
+private:
+    MPI_Comm workersComm = MPI_COMM_NULL;
+    MPI_Comm nodeComm = MPI_COMM_NULL;    // workers sharing memory with this one
+    MPI_Comm leadersComm = MPI_COMM_NULL; // node rank 0 of every node (null elsewhere)
+    int workersRank = 0;
+    int nodeRank = 0;
+    int nodeCount = 0; // nodes, i.e. ranks of leadersComm
+    MPI_Win window = MPI_WIN_NULL;
+
+    unsigned int particleCount = 0;
+    unsigned int nodeShareStart = 0;
+    unsigned int nodeShareEnd = 0;
+    std::vector<int> leaderCounts; // Float2 layout of the node blocks on leadersComm
+    std::vector<int> leaderDisplacements;
+    std::unique_ptr<MpiTransport> leadersTransport; // for encoded exchanges
+    std::vector<int> leaderBlockCounts; // the same layout in Float2
+    std::vector<int> leaderBlockDisplacements;
+
+    void CreateCommunicators(MPI_Comm workersComm);
+    bool ComputeLayout(unsigned int rangeStart, unsigned int rangeEnd);
+};
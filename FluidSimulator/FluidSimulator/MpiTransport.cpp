@@ -0,0 +1,293 @@
+#include "MpiTransport.h"
+#include <algorithm>
+#include <limits>
+
+MpiTransport::MpiTransport(MPI_Comm comm) : comm(comm)
+{
+    if (comm != MPI_COMM_NULL) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+    }
+}
+
+MpiTransport::~MpiTransport()
+{
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (finalized) return;
+    for (PersistentExchange& exchange : persistentExchanges) {
+        for (MPI_Request& request : exchange.requests) {
+            MPI_Request_free(&request);
+        }
+    }
+}
+
+void MpiTransport::Send(const void* data, size_t bytes, int destination, int tag)
+{
+    if (destination == NoRank) return;
+    MPI_Send(data, bytes, MPI_BYTE, destination, tag, comm);
+    volume.bytesSent += bytes;
+    volume.messagesSent++;
+}
+
+void MpiTransport::Receive(void* data, size_t bytes, int source, int tag)
+{
+    if (source == NoRank) return;
+    MPI_Recv(data, bytes, MPI_BYTE, source, tag, comm, MPI_STATUS_IGNORE);
+    volume.bytesReceived += bytes;
+}
+
+void MpiTransport::SendReceive(const void* sendData, size_t sendBytes, int destination,
+    void* receiveData, size_t receiveBytes, int source, int tag)
+{
+    MPI_Sendrecv(sendData, sendBytes, MPI_BYTE, Peer(destination), tag,
+        receiveData, receiveBytes, MPI_BYTE, Peer(source), tag, comm, MPI_STATUS_IGNORE);
+    if (destination != NoRank) {
+        volume.bytesSent += sendBytes;
+        volume.messagesSent++;
+    }
+    if (source != NoRank) volume.bytesReceived += receiveBytes;
+}
+
+void MpiTransport::PostSend(const void* data, size_t bytes, int destination, int tag)
+{
+    if (destination == NoRank) return;
+    requests.emplace_back();
+    receiving.push_back(0);
+    MPI_Isend(data, bytes, MPI_BYTE, destination, tag, comm, &requests.back());
+    volume.bytesSent += bytes;
+    volume.messagesSent++;
+}
+
+void MpiTransport::PostReceive(void* data, size_t bytes, int source, int tag)
+{
+    if (source == NoRank) return;
+    requests.emplace_back();
+    receiving.push_back(1);
+    MPI_Irecv(data, bytes, MPI_BYTE, source, tag, comm, &requests.back());
+}
+
+void MpiTransport::WaitAll()
+{
+    // Posted receives may be larger than the message (encoded halos)
+    statuses.resize(requests.size());
+    MPI_Waitall(requests.size(), requests.data(), statuses.data());
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (!receiving[i]) continue;
+        int bytes;
+        MPI_Get_count(&statuses[i], MPI_BYTE, &bytes);
+        volume.bytesReceived += bytes;
+    }
+    requests.clear();
+    receiving.clear();
+}
+
+int MpiTransport::CreatePersistentExchange(const std::vector<PersistentMessage>& messages)
+{
+    PersistentExchange exchange;
+    for (const PersistentMessage& message : messages) {
+        if (message.peer == NoRank) continue;
+        exchange.messages.push_back(message);
+        exchange.requests.emplace_back();
+        if (message.send) {
+            MPI_Send_init(message.data, message.bytes, MPI_BYTE, message.peer, message.tag, comm, &exchange.requests.back());
+        }
+        else {
+            MPI_Recv_init(message.data, message.bytes, MPI_BYTE, message.peer, message.tag, comm, &exchange.requests.back());
+        }
+    }
+    persistentExchanges.push_back(std::move(exchange));
+    return persistentExchanges.size() - 1;
+}
+
+void MpiTransport::StartPersistentExchange(int exchange)
+{
+    PersistentExchange& persistent = persistentExchanges[exchange];
+    if (persistent.requests.empty()) return;
+    MPI_Startall(persistent.requests.size(), persistent.requests.data());
+    for (const PersistentMessage& message : persistent.messages) {
+        if (message.send) {
+            volume.bytesSent += message.bytes;
+            volume.messagesSent++;
+        }
+        else {
+            volume.bytesReceived += message.bytes;
+        }
+    }
+}
+
+void MpiTransport::WaitPersistentExchange(int exchange)
+{
+    PersistentExchange& persistent = persistentExchanges[exchange];
+    MPI_Waitall(persistent.requests.size(), persistent.requests.data(), MPI_STATUSES_IGNORE);
+}
+
+void MpiTransport::Broadcast(void* data, size_t bytes, int root)
+{
+    MPI_Bcast(data, bytes, MPI_BYTE, root, comm);
+    if (rank == root) {
+        volume.bytesSent += bytes * (size - 1);
+        volume.messagesSent += size - 1;
+    }
+    else {
+        volume.bytesReceived += bytes;
+    }
+}
+
+void MpiTransport::Gather(const void* sendData, size_t bytes, void* receiveData, int root)
+{
+    MPI_Gather(sendData, bytes, MPI_BYTE, receiveData, bytes, MPI_BYTE, root, comm);
+    if (rank == root) {
+        volume.bytesReceived += bytes * (size - 1);
+    }
+    else {
+        volume.bytesSent += bytes;
+        volume.messagesSent++;
+    }
+}
+
+void MpiTransport::ToBytes(const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize)
+{
+    byteCounts.resize(counts.size());
+    byteDisplacements.resize(displacements.size());
+    for (size_t r = 0; r < counts.size(); r++) {
+        byteCounts[r] = counts[r] * elementSize;
+        byteDisplacements[r] = displacements[r] * elementSize;
+    }
+}
+
+void MpiTransport::Gatherv(const void* sendData, int sendCount, void* receiveData,
+    const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize, int root)
+{
+    if (rank != root) {
+        MPI_Gatherv(sendData, sendCount * elementSize, MPI_BYTE, nullptr, nullptr, nullptr, MPI_BYTE, root, comm);
+        volume.bytesSent += sendCount * elementSize;
+        volume.messagesSent++;
+        return;
+    }
+
+    ToBytes(counts, displacements, elementSize);
+    MPI_Gatherv(MPI_IN_PLACE, 0, MPI_BYTE, receiveData, byteCounts.data(), byteDisplacements.data(), MPI_BYTE, root, comm);
+    for (int r = 0; r < size; r++) {
+        if (r != root) volume.bytesReceived += byteCounts[r];
+    }
+}
+
+void MpiTransport::AllgathervInPlace(void* data, const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize)
+{
+    ToBytes(counts, displacements, elementSize);
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, data, byteCounts.data(), byteDisplacements.data(), MPI_BYTE, comm);
+    for (int r = 0; r < size; r++) {
+        if (r != rank) volume.bytesReceived += byteCounts[r];
+    }
+    volume.bytesSent += (unsigned long long)byteCounts[rank] * (size - 1);
+    volume.messagesSent += size - 1;
+}
+
+void MpiTransport::Barrier()
+{
+    MPI_Barrier(comm);
+}
+
+void MpiTransport::Alltoall(const void* sendData, size_t bytes, void* receiveData)
+{
+    MPI_Alltoall(sendData, bytes, MPI_BYTE, receiveData, bytes, MPI_BYTE, comm);
+    volume.bytesSent += (unsigned long long)bytes * (size - 1);
+    volume.bytesReceived += (unsigned long long)bytes * (size - 1);
+    volume.messagesSent += size - 1;
+}
+
+bool MpiTransport::AllSucceeded(bool succeeded)
+{
+    int all = succeeded ? 1 : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &all, 1, MPI_INT, MPI_LAND, comm);
+    return all != 0;
+}
+
+// The blocks become one file view and one memory layout, so a rank moves all of them in a
+// single collective call and MPI-IO can merge the accesses of all ranks
+bool MpiTransport::TransferFileBlocks(MPI_File file, const std::vector<FileBlock>& blocks, bool write)
+{
+    // File views need increasing offsets
+    std::vector<const FileBlock*> sorted;
+    for (const FileBlock& block : blocks) {
+        if (block.bytes > 0) sorted.push_back(&block);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const FileBlock* a, const FileBlock* b) { return a->offset < b->offset; });
+
+    // Type block lengths are ints, larger blocks go in several pieces
+    const size_t maxPiece = (size_t)std::numeric_limits<int>::max();
+    std::vector<int> lengths;
+    std::vector<MPI_Aint> offsets;
+    std::vector<MPI_Aint> addresses;
+    for (const FileBlock* block : sorted) {
+        MPI_Aint address;
+        MPI_Get_address(block->data, &address);
+        for (size_t done = 0; done < block->bytes; done += maxPiece) {
+            lengths.push_back((int)std::min(maxPiece, block->bytes - done));
+            offsets.push_back((MPI_Aint)(block->offset + done));
+            addresses.push_back(MPI_Aint_add(address, (MPI_Aint)done));
+        }
+    }
+
+    MPI_Datatype fileType;
+    MPI_Datatype memoryType;
+    MPI_Type_create_hindexed((int)lengths.size(), lengths.data(), offsets.data(), MPI_BYTE, &fileType);
+    MPI_Type_create_hindexed((int)lengths.size(), lengths.data(), addresses.data(), MPI_BYTE, &memoryType);
+    MPI_Type_commit(&fileType);
+    MPI_Type_commit(&memoryType);
+
+    char native[] = "native";
+    MPI_Status status;
+    int error = MPI_File_set_view(file, 0, MPI_BYTE, fileType, native, MPI_INFO_NULL);
+    if (error == MPI_SUCCESS) {
+        if (write) error = MPI_File_write_all(file, MPI_BOTTOM, 1, memoryType, &status);
+        else error = MPI_File_read_all(file, MPI_BOTTOM, 1, memoryType, &status);
+    }
+
+    // A file shorter than the blocks reads fewer bytes without an error: the whole memory type
+    // must have been moved
+    int transferred = 0;
+    bool complete = error == MPI_SUCCESS && (lengths.empty() || (MPI_Get_count(&status, memoryType, &transferred) == MPI_SUCCESS && transferred == 1));
+
+    MPI_Type_free(&fileType);
+    MPI_Type_free(&memoryType);
+    return complete;
+}
+
+bool MpiTransport::WriteFileAll(const std::string& path, const std::vector<FileBlock>& blocks)
+{
+    MPI_File file;
+    int error = MPI_File_open(comm, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+    if (!AllSucceeded(error == MPI_SUCCESS)) {
+        if (error == MPI_SUCCESS) MPI_File_close(&file);
+        return false;
+    }
+    bool succeeded = MPI_File_set_size(file, 0) == MPI_SUCCESS && TransferFileBlocks(file, blocks, true);
+    MPI_File_close(&file);
+    return AllSucceeded(succeeded);
+}
+
+bool MpiTransport::ReadFileAll(const std::string& path, const std::vector<FileBlock>& blocks)
+{
+    MPI_File file;
+    int error = MPI_File_open(comm, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+    if (!AllSucceeded(error == MPI_SUCCESS)) {
+        if (error == MPI_SUCCESS) MPI_File_close(&file);
+        return false;
+    }
+    // Some MPI-IO implementations report a read past the end as complete, so a short file
+    // is caught by its size; all ranks skip the collective read together
+    MPI_Offset size = 0;
+    bool inside = MPI_File_get_size(file, &size) == MPI_SUCCESS;
+    for (const FileBlock& block : blocks) {
+        if (block.bytes > 0 && block.offset + block.bytes > (unsigned long long)size) inside = false;
+    }
+    if (!AllSucceeded(inside)) {
+        MPI_File_close(&file);
+        return false;
+    }
+    bool succeeded = TransferFileBlocks(file, blocks, false);
+    MPI_File_close(&file);
+    return AllSucceeded(succeeded);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Transport.h"
+#include <mpi.h>
+#include <vector>
+
+// Transport over an MPI communicator. Everything travels as MPI_BYTE, the counted volume is
+// the payload each rank contributes to or receives from an operation.
+class MpiTransport : public Transport
+{
+public:
+    MpiTransport(MPI_Comm comm);
+    // Frees the persistent requests unless MPI is finalized already
+    ~MpiTransport();
+
+    // For MPI-only features (shared memory windows, node topology)
+    MPI_Comm Communicator() const { return comm; }
+
+    int Rank() const override { return rank; }
+    int Size() const override { return size; }
+    const char* Name() const override { return "mpi"; }
+
+    void Send(const void* data, size_t bytes, int destination, int tag) override;
+    void Receive(void* data, size_t bytes, int source, int tag) override;
+    void SendReceive(const void* sendData, size_t sendBytes, int destination,
+        void* receiveData, size_t receiveBytes, int source, int tag) override;
+
+    void PostSend(const void* data, size_t bytes, int destination, int tag) override;
+    void PostReceive(void* data, size_t bytes, int source, int tag) override;
+    void WaitAll() override;
+
+    int CreatePersistentExchange(const std::vector<PersistentMessage>& messages) override;
+    void StartPersistentExchange(int exchange) override;
+    void WaitPersistentExchange(int exchange) override;
+
+    void Broadcast(void* data, size_t bytes, int root) override;
+    void Gather(const void* sendData, size_t bytes, void* receiveData, int root) override;
+    void Gatherv(const void* sendData, int sendCount, void* receiveData,
+        const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize, int root) override;
+    void AllgathervInPlace(void* data, const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize) override;
+    void Alltoall(const void* sendData, size_t bytes, void* receiveData) override;
+    void Barrier() override;
+
+    bool WriteFileAll(const std::string& path, const std::vector<FileBlock>& blocks) override;
+    bool ReadFileAll(const std::string& path, const std::vector<FileBlock>& blocks) override;
+
+private:
+    MPI_Comm comm;
+    int rank = 0;
+    int size = 1;
+    std::vector<MPI_Request> requests;
+    std::vector<char> receiving; // per request, counted once the received size is known
+    std::vector<MPI_Status> statuses;
+
+    struct PersistentExchange
+    {
+        std::vector<PersistentMessage> messages;
+        std::vector<MPI_Request> requests; // one per message
+    };
+    std::vector<PersistentExchange> persistentExchanges;
+    std::vector<int> byteCounts; // *v layouts converted to bytes
+    std::vector<int> byteDisplacements;
+
+    static int Peer(int rank) { return rank == NoRank ? MPI_PROC_NULL : rank; }
+    void ToBytes(const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize);
+    bool TransferFileBlocks(MPI_File file, const std::vector<FileBlock>& blocks, bool write);
+    bool AllSucceeded(bool succeeded);
+};
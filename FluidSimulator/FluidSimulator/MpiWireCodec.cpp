@@ -0,0 +1,289 @@
+#include "MpiWireCodec.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Grid points are clamped to this, so differences of two of them always fit an int32
+static const double MaxGridPoint = 1 << 30;
+
+static void WriteVarint(uint32_t value, std::vector<unsigned char>& out)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+}
+
+static uint32_t ReadVarint(const unsigned char*& in)
+{
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        unsigned char byte = *in++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) return value;
+    }
+}
+
+// Small differences of either sign become small unsigned numbers
+static uint32_t ZigZag(uint32_t difference)
+{
+    return (difference << 1) ^ (uint32_t)((int32_t)difference >> 31);
+}
+
+static uint32_t UnZigZag(uint32_t value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+
+MpiWireCodec::MpiWireCodec(Kind kind, bool slotReferences) : kind(kind), slotReferences(slotReferences)
+{
+}
+
+void MpiWireCodec::SetCellSize(float cellSize)
+{
+    float step = cellSize / (1 << PositionBits);
+    if (step != quantum)
+    {
+        quantum = step;
+        Reset();
+    }
+}
+
+void MpiWireCodec::Reset()
+{
+    slots.clear();
+}
+
+size_t MpiWireCodec::MaxBytes(unsigned int count)
+{
+    // Two varints of up to 5 bytes
+    return (size_t)count * 10;
+}
+
+void MpiWireCodec::SetMantissaBits(int bits)
+{
+    bits = std::max(0, std::min(FloatMantissaBits, bits));
+    if (bits != mantissaBits)
+    {
+        mantissaBits = bits;
+        Reset();
+    }
+}
+
+float MpiWireCodec::MaxError() const
+{
+    if (kind == Kind::Position) return quantum / 2;
+    return mantissaBits < FloatMantissaBits ? std::ldexp(1.0f, -mantissaBits - 1) : 0.0f;
+}
+
+uint32_t MpiWireCodec::ToOrdered(float value) const
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    // Round to the kept mantissa bits, infinities and NaNs stay as they are
+    int dropped = FloatMantissaBits - mantissaBits;
+    if (dropped > 0 && (bits & 0x7f800000) != 0x7f800000)
+    {
+        bits = (bits + (1u << (dropped - 1))) & ~((1u << dropped) - 1);
+    }
+
+    // Negative floats count down from -1, so nearby values are nearby integers
+    int32_t ordered = (int32_t)(bits ^ ((bits & 0x80000000) ? 0x7fffffffu : 0u));
+    return (uint32_t)(ordered >> dropped);
+}
+
+float MpiWireCodec::FromOrdered(uint32_t value) const
+{
+    int dropped = FloatMantissaBits - mantissaBits;
+    int32_t shifted = (int32_t)value;
+    uint32_t ordered = (uint32_t)shifted << dropped;
+    if (shifted < 0) ordered |= (1u << dropped) - 1;
+
+    uint32_t bits = ordered ^ ((ordered & 0x80000000) ? 0x7fffffffu : 0u);
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+uint32_t MpiWireCodec::Quantise(float value) const
+{
+    double point = std::round(value / (double)quantum);
+    if (!(point > -MaxGridPoint)) point = std::isnan(point) ? 0 : -MaxGridPoint;
+    if (point > MaxGridPoint) point = MaxGridPoint;
+    return (uint32_t)(int32_t)point;
+}
+
+MpiWireCodec::SlotHistory* MpiWireCodec::Slots(unsigned int first, unsigned int count)
+{
+    if (!slotReferences) return nullptr;
+    if (slots.size() < (size_t)first + count)
+    {
+        slots.resize((size_t)first + count, SlotHistory());
+    }
+    return slots.data() + first;
+}
+
+// With a slot history of two values the slot is extrapolated (its change since the last
+// message is sent), before that and without slots the last value is the prediction
+static void Predict(const MpiWireCodec::SlotHistory* slot, const uint32_t* previous, uint32_t* predicted)
+{
+    for (int c = 0; c < 2; c++)
+    {
+        if (!slot) predicted[c] = previous[c];
+        else if (slot->primed) predicted[c] = 2 * slot->last[c] - slot->beforeLast[c];
+        else predicted[c] = slot->last[c];
+    }
+}
+
+static void Remember(MpiWireCodec::SlotHistory* slot, uint32_t* previous, const uint32_t* value)
+{
+    for (int c = 0; c < 2; c++)
+    {
+        if (!slot)
+        {
+            previous[c] = value[c];
+            continue;
+        }
+        slot->beforeLast[c] = slot->primed ? slot->last[c] : value[c];
+        slot->last[c] = value[c];
+    }
+    if (slot) slot->primed = true;
+}
+
+void MpiWireCodec::Encode(const Float2* values, unsigned int first, unsigned int count, std::vector<unsigned char>& out)
+{
+    uint32_t previous[2] = { 0, 0 };
+    SlotHistory* history = Slots(first, count);
+    out.reserve(out.size() + MaxBytes(count));
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const Float2& value = values[first + i];
+        SlotHistory* slot = history ? history + i : nullptr;
+
+        uint32_t integers[2];
+        if (kind == Kind::Position)
+        {
+            integers[0] = Quantise(value.x);
+            integers[1] = Quantise(value.y);
+        }
+        else
+        {
+            integers[0] = ToOrdered(value.x);
+            integers[1] = ToOrdered(value.y);
+        }
+
+        uint32_t predicted[2];
+        Predict(slot, previous, predicted);
+        WriteVarint(ZigZag(integers[0] - predicted[0]), out);
+        WriteVarint(ZigZag(integers[1] - predicted[1]), out);
+        Remember(slot, previous, integers);
+    }
+}
+
+size_t MpiWireCodec::Decode(const unsigned char* in, Float2* values, unsigned int first, unsigned int count)
+{
+    const unsigned char* start = in;
+    uint32_t previous[2] = { 0, 0 };
+    SlotHistory* history = Slots(first, count);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        Float2& value = values[first + i];
+        SlotHistory* slot = history ? history + i : nullptr;
+
+        uint32_t integers[2];
+        Predict(slot, previous, integers);
+        integers[0] += UnZigZag(ReadVarint(in));
+        integers[1] += UnZigZag(ReadVarint(in));
+        Remember(slot, previous, integers);
+
+        if (kind == Kind::Position)
+        {
+            value.x = (float)((int32_t)integers[0] * (double)quantum);
+            value.y = (float)((int32_t)integers[1] * (double)quantum);
+        }
+        else
+        {
+            value.x = FromOrdered(integers[0]);
+            value.y = FromOrdered(integers[1]);
+        }
+    }
+    return in - start;
+}
+
+void MpiWireCodec::AllgathervInPlace(Transport& transport, Float2* data, const std::vector<int>& counts, const std::vector<int>& displacements)
+{
+    int rank = transport.Rank();
+    int size = transport.Size();
+
+    block.clear();
+    Encode(data, displacements[rank], counts[rank], block);
+
+    // Every rank needs the encoded size of every block
+    byteCounts.assign(size, 0);
+    byteCounts[rank] = (int)block.size();
+    unitCounts.assign(size, 1);
+    unitDisplacements.resize(size);
+    for (int r = 0; r < size; r++) unitDisplacements[r] = r;
+    transport.AllgathervInPlace(byteCounts.data(), unitCounts, unitDisplacements, sizeof(int));
+
+    int total = 0;
+    byteDisplacements.resize(size);
+    for (int r = 0; r < size; r++)
+    {
+        byteDisplacements[r] = total;
+        total += byteCounts[r];
+    }
+    encoded.resize(total);
+    memcpy(encoded.data() + byteDisplacements[rank], block.data(), block.size());
+    transport.AllgathervInPlace(encoded.data(), byteCounts, byteDisplacements, 1);
+
+    for (int r = 0; r < size; r++)
+    {
+        if (r == rank) continue;
+        Decode(encoded.data() + byteDisplacements[r], data, displacements[r], counts[r]);
+    }
+}
+
+void MpiWireCodec::Gatherv(Transport& transport, const Float2* data, unsigned int first, unsigned int count, Float2* receiveData,
+    const std::vector<int>& counts, const std::vector<int>& displacements, int root)
+{
+    int rank = transport.Rank();
+    int size = transport.Size();
+
+    if (rank != root)
+    {
+        block.clear();
+        Encode(data, first, count, block);
+        int bytes = (int)block.size();
+        transport.Gather(&bytes, sizeof(int), nullptr, root);
+        transport.Gatherv(block.data(), bytes, nullptr, byteCounts, byteDisplacements, 1, root);
+        return;
+    }
+
+    // Root sends nothing, its own block stays in place
+    int bytes = 0;
+    byteCounts.resize(size);
+    transport.Gather(&bytes, sizeof(int), byteCounts.data(), root);
+    int total = 0;
+    byteDisplacements.resize(size);
+    for (int r = 0; r < size; r++)
+    {
+        byteDisplacements[r] = total;
+        total += byteCounts[r];
+    }
+    encoded.resize(total);
+    transport.Gatherv(nullptr, 0, encoded.data(), byteCounts, byteDisplacements, 1, root);
+
+    for (int r = 0; r < size; r++)
+    {
+        if (r == root) continue;
+        Decode(encoded.data() + byteDisplacements[r], receiveData, displacements[r], counts[r]);
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "physics.h"
+#include "Transport.h"
+#include <cstdint>
+#include <vector>
+
+// Compact wire format for the Float2 particle fields the MPI code exchanges
+// (SimulationOptions::mpiWireEncoding). Every value becomes an integer, which goes out as the
+// zigzag varint of its difference to a prediction. Two kinds of fields:
+//
+// Position: quantised to 16 bits inside a cell of the spatial index, i.e. to a grid of
+// cellSize / 65536 (cellSize is the smoothing radius). Every coordinate arrives within
+// cellSize / 131072 of the sent value (plus the float rounding of the coordinate itself),
+// far below the kernel's resolution.
+//
+// Float (velocities, densities): lossless by default, the float bits are mapped to integers
+// that keep the order of the floats. Fewer mantissa bits round every value to a relative
+// error of at most 2^-(bits + 1) and drop the rounded bits from the wire.
+//
+// With slot references the prediction comes from what the same slot held in the previous two
+// messages of this codec, for streams that send the same particles every step: the slot moves
+// on as in the last step, so a position costs about its acceleration instead of its velocity.
+// Both ends keep the integers the receiver reconstructs, so the rounding error never builds
+// up. Without slot references the prediction is the previous value of the same message.
+//
+// References start at zero and must be reset by both ends together, whenever the particles
+// behind the slots change (restarts, moved range edges).
+class MpiWireCodec
+{
+public:
+    enum class Kind
+    {
+        Position,
+        Float
+    };
+
+    // Cell size of the position grid is the smoothing radius, 2^16 grid steps per cell
+    static constexpr int PositionBits = 16;
+    // Mantissa bits of a float, i.e. lossless
+    static constexpr int FloatMantissaBits = 23;
+
+    // The integers last sent for a slot
+    struct SlotHistory
+    {
+        uint32_t last[2] = { 0, 0 };
+        uint32_t beforeLast[2] = { 0, 0 };
+        bool primed = false; // beforeLast is set
+    };
+
+    MpiWireCodec(Kind kind, bool slotReferences);
+
+    // A different cell size also resets the slot references, so set it on both ends from the
+    // same broadcast parameters
+    void SetCellSize(float cellSize);
+    // Mantissa bits kept by Float fields, both ends must use the same
+    void SetMantissaBits(int bits);
+    void Reset();
+
+    // Largest encoding of count values
+    static size_t MaxBytes(unsigned int count);
+    // Largest error of a decoded position coordinate before float rounding, or relative error of a Float field
+    float MaxError() const;
+
+    // Appends the encoding of values[first, first + count) to out, slots are the indices into values
+    void Encode(const Float2* values, unsigned int first, unsigned int count, std::vector<unsigned char>& out);
+    // Reads count values written by Encode into values[first, first + count), returns the bytes read
+    size_t Decode(const unsigned char* in, Float2* values, unsigned int first, unsigned int count);
+
+    // Collective. Transport::AllgathervInPlace of a Float2 field (counts in Float2) with every
+    // block encoded. The own block stays exact, the others arrive decoded.
+    void AllgathervInPlace(Transport& transport, Float2* data, const std::vector<int>& counts, const std::vector<int>& displacements);
+    // Collective. Transport::Gatherv of a Float2 field to root with every block encoded, a rank
+    // sends data[first, first + count). Root decodes the blocks into receiveData by counts and
+    // displacements, its own block stays in place.
+    void Gatherv(Transport& transport, const Float2* data, unsigned int first, unsigned int count, Float2* receiveData,
+        const std::vector<int>& counts, const std::vector<int>& displacements, int root);
+
+private:
+    Kind kind;
+    bool slotReferences;
+    float quantum = 0; // position grid step
+    int mantissaBits = FloatMantissaBits;
+    std::vector<SlotHistory> slots;
+
+    // Buffers of the collectives
+    std::vector<unsigned char> block; // own encoded block
+    std::vector<unsigned char> encoded; // all blocks
+    std::vector<int> byteCounts;
+    std::vector<int> byteDisplacements;
+    std::vector<int> unitCounts;
+    std::vector<int> unitDisplacements;
+
+    uint32_t Quantise(float value) const;
+    uint32_t ToOrdered(float value) const;
+    float FromOrdered(uint32_t value) const;
+    SlotHistory* Slots(unsigned int first, unsigned int count);
+};
@@ -1,52 +1,377 @@
 #include "MpiWorker2.h"
-#include <mpi.h>
+#include <algorithm>
+#include <iostream>
+#include <thread>
 
-void MpiWorker::Run()
+void MpiCommunicators::Create()
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_dup(MPI_COMM_WORLD, &simulation);
+    MPI_Comm_split(simulation, rank == 0 ? MPI_UNDEFINED : 0, rank, &workers);
+    MPI_Comm_split_type(simulation, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+}
+
+void MpiCommunicators::Free()
+{
+    if (node != MPI_COMM_NULL) MPI_Comm_free(&node);
+    if (workers != MPI_COMM_NULL) MPI_Comm_free(&workers);
+    if (simulation != MPI_COMM_NULL) MPI_Comm_free(&simulation);
+}
+
+MpiWorkerRange MpiRangeOfRank(int rank, int rankCount, unsigned int particleCount)
 {
-    MPI_Status status;
-    unsigned int particle_count;
-    MPI_Recv(&particle_count, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+    int workersCount = rankCount - 1;
+    if (rank == 0 || workersCount <= 0) {
+        return { 0, 0 };
+    }
+
+    unsigned int per_worker_count = particleCount / workersCount;
+    MpiWorkerRange range;
+    range.start = (rank - 1) * per_worker_count;
+    range.end = rank == workersCount ? particleCount : rank * per_worker_count;
+    return range;
+}
+
+void MpiEvenRangeEdges(int rankCount, unsigned int particleCount, std::vector<unsigned int>& edges)
+{
+    edges.resize(rankCount + 1);
+    for (int rank = 0; rank < rankCount; rank++) {
+        edges[rank] = MpiRangeOfRank(rank, rankCount, particleCount).start;
+    }
+    edges[rankCount] = particleCount;
+}
 
-    physics.numParticles = particle_count;
-    physics.ResizeBuffers();
+void MpiRangeLayout(const std::vector<unsigned int>& edges, int elementsPerParticle, std::vector<int>& counts, std::vector<int>& displacements, int firstRank)
+{
+    int rankCount = edges.size() - 1;
+    counts.resize(rankCount - firstRank);
+    displacements.resize(rankCount - firstRank);
+    for (int rank = firstRank; rank < rankCount; rank++) {
+        counts[rank - firstRank] = (edges[rank + 1] - edges[rank]) * elementsPerParticle;
+        displacements[rank - firstRank] = edges[rank] * elementsPerParticle;
+    }
+}
+
+int MpiWorker::ThreadsPerRank(MPI_Comm nodeComm, int requested)
+{
+    if (requested >= 0) return requested;
+
+    int nodeRanks = 1;
+    if (nodeComm != MPI_COMM_NULL) MPI_Comm_size(nodeComm, &nodeRanks);
+    int threads = (int)std::thread::hardware_concurrency() / nodeRanks - 1;
+    return std::max(0, threads);
+}
+
+MpiWorker::MpiWorker(const MpiCommunicators& communicators, const SimulationOptions& options)
+    : options(options),
+    ownedSimulation(new MpiTransport(communicators.simulation)),
+    ownedWorkers(new MpiTransport(communicators.workers)),
+    transport(ownedSimulation.get()), workersTransport(ownedWorkers.get())
+{
+    Init(ThreadsPerRank(communicators.node, options.mpiWorkerThreads));
+}
+
+MpiWorker::MpiWorker(Transport& simulation, Transport& workers, const SimulationOptions& options, int poolThreads)
+    : options(options), transport(&simulation), workersTransport(&workers)
+{
+    Init(poolThreads);
+}
 
+void MpiWorker::Init(int poolThreads)
+{
+    rank = transport->Rank();
+    rankCount = transport->Size();
+
+    pool.~ThreadPool(); // reset thread pool
+    new(&pool) ThreadPool(poolThreads, options.pinWorkerThreads);
+    executor = CreateExecutor(options.executorBackend, pool);
+
+    domain.SetTransport(transport);
+    domain.SetOverlap(options.mpiOverlap);
+    domain.SetExecutor(executor.get());
+    domain.SetWireEncoding(options.mpiWireEncoding, options.mpiWireMantissaBits);
+    domain.SetMotionMeasurement(options.adaptiveTimeStep);
+    velocityCodec.SetMantissaBits(options.mpiWireMantissaBits);
+    densityCodec.SetMantissaBits(options.mpiWireMantissaBits);
+    gatherVelocityCodec.SetMantissaBits(options.mpiWireMantissaBits);
+}
+
+void MpiWorker::Run()
+{
     while (true) {
-        size_t parameter_size = offsetof(Physics, Positions);
+        int command[3];
+        transport->Broadcast(command, sizeof(command), 0);
 
-        MPI_Recv(this, parameter_size / sizeof(int), MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+        if (command[0] == MpiCommandQuit) {
+            shared.Detach(physics);
+            shared.Free();
+            return;
+        }
+
+        ReceiveParameters(command[2]);
 
-        MpiWorkerRange range;
-        MPI_Recv(&range, 2, MPI_UINT32_T, 0, 0, MPI_COMM_WORLD, &status);
+        if (command[0] == MpiCommandResize) {
+            physics.numParticles = command[1];
+            if (options.mpiMode == MpiMode::Domain) {
+                domain.Distribute();
+            }
+            else {
+                ReceiveInitialState();
+            }
+            continue;
+        }
 
-        MPI_Recv(physics.Velocities.data(), particle_count * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, &status);
-        MPI_Recv(physics.PredictedPositions.data(), particle_count * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, &status);
-        MPI_Recv(physics.SpatialIndices.data(), particle_count * 3, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-        MPI_Recv(physics.SpatialOffsets.data(), particle_count, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+        if (command[0] == MpiCommandRestart) {
+            // Rank 0 gets the restored particles right away, to show them
+            physics.numParticles = command[1];
+            if (options.mpiMode == MpiMode::Domain) {
+                if (domain.Restore(options.restartFile)) domain.Gather(0);
+            }
+            else if (RestoreCheckpoint()) {
+                SetWireCellSize();
+                Gather();
+            }
+            continue;
+        }
 
-        // Calculate density
-        for (unsigned int index = range.start; index < range.end; index++) {
-            physics.CalculateDensity(index);
+        if (command[0] == MpiCommandCheckpoint) {
+            WriteCheckpoint(command[1]);
+            continue;
         }
 
-        // Send back the densities
-        MPI_Ssend(physics.Densities.data() + range.start, (range.end - range.start) * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+        if (options.mpiMode == MpiMode::Domain) {
+            domain.BroadcastSlabEdges();
+        }
+        else {
+            SetWireCellSize();
+            ReceiveRangeEdges();
+        }
 
-        MPI_Recv(physics.Densities.data(), particle_count * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, &status);
+        for (int step = 0; step < command[1]; step++) {
+            if (options.mpiMode == MpiMode::Domain) {
+                domain.Step();
+            }
+            else {
+                Step();
+            }
+        }
 
-        for (unsigned int index = range.start; index < range.end; index++) {
-            physics.CalculatePressureForce(index);
+        // Rank 0 only needs the particles once per frame, to render them
+        if (options.mpiMode == MpiMode::Domain) {
+            domain.Gather(command[1]);
+        }
+        else {
+            Gather();
         }
+    }
+}
+
+void MpiWorker::ReceiveParameters(int version)
+{
+    if (version == parameterVersion) return;
+
+    PhysicsParameters parameters;
+    transport->Broadcast(&parameters, sizeof(parameters), 0);
+    parameters.Apply(physics);
+    parameterVersion = version;
+}
+
+// Even range edges for a new particle state. True if the node shares its particle buffers,
+// then the ranks of the node write the same arrays.
+bool MpiWorker::StartEvenRanges()
+{
+    MpiEvenRangeEdges(rankCount, physics.numParticles, rangeEdges);
+    range = { rangeEdges[rank], rangeEdges[rank + 1] };
+    MpiRangeLayout(rangeEdges, 1, counts, displacements, 1);
+    ResetWireCodecs();
+
+    // Shared memory windows need MPI
+    MpiTransport* mpiWorkers = dynamic_cast<MpiTransport*>(workersTransport);
+    shared.Detach(physics);
+    if (!options.mpiSharedMemory || mpiWorkers == nullptr || !shared.Attach(mpiWorkers->Communicator(), physics, range.start, range.end)) {
+        physics.ResizeBuffers();
+        return false;
+    }
+    return true;
+}
 
-        // Send back the velocities
-        MPI_Ssend(physics.Velocities.data() + range.start, (range.end - range.start) * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+void MpiWorker::ReceiveInitialState()
+{
+    if (!StartEvenRanges()) {
+        transport->Broadcast(physics.Positions.data(), physics.numParticles * sizeof(Float2), 0);
+        transport->Broadcast(physics.Velocities.data(), physics.numParticles * sizeof(Float2), 0);
+        return;
+    }
+
+    // The ranks of a node write the same arrays, so every rank only keeps its own range
+    std::vector<Float2> positions(physics.numParticles);
+    std::vector<Float2> velocities(physics.numParticles);
+    transport->Broadcast(positions.data(), physics.numParticles * sizeof(Float2), 0);
+    transport->Broadcast(velocities.data(), physics.numParticles * sizeof(Float2), 0);
+    std::copy(positions.begin() + range.start, positions.begin() + range.end, physics.Positions.begin() + range.start);
+    std::copy(velocities.begin() + range.start, velocities.begin() + range.end, physics.Velocities.begin() + range.start);
+}
+
+// A step only starts from the positions and velocities of the own range, so that is all a
+// rank reads, the others arrive with the exchanges of the first step
+bool MpiWorker::RestoreCheckpoint()
+{
+    StartEvenRanges();
+    return MpiCheckpoint::Read(*transport, options.restartFile, physics.numParticles,
+        physics.Positions.data() + range.start, physics.Velocities.data() + range.start, range.start, range.end - range.start);
+}
 
-        MPI_Recv(physics.Velocities.data(), particle_count * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, &status);
+void MpiWorker::WriteCheckpoint(int step)
+{
+    std::string path = MpiCheckpoint::PathOf(options.checkpointPrefix, step);
+    if (options.mpiMode == MpiMode::Domain) {
+        domain.WriteCheckpoint(path, step);
+        return;
+    }
+    MpiCheckpoint::Write(*transport, path, MpiCheckpoint::MakeHeader(physics, step),
+        physics.Positions.data() + range.start, physics.Velocities.data() + range.start, range.start, range.end - range.start);
+}
+
+void MpiWorker::ReceiveRangeEdges()
+{
+    std::vector<unsigned int> edges(rankCount + 1);
+    transport->Broadcast(edges.data(), (rankCount + 1) * sizeof(unsigned int), 0);
+    if (edges != rangeEdges) {
+        SetRangeEdges(edges);
+    }
+}
 
-        for (unsigned int index = range.start; index < range.end; index++) {
-            physics.CalculateViscosity(index);
+void MpiWorker::SetRangeEdges(const std::vector<unsigned int>& edges)
+{
+    // Positions and velocities are only current in the range that updated them,
+    // the new owners need them first
+    ShareField(physics.Positions, positionCodec);
+    ShareField(physics.Velocities, velocityCodec);
+
+    rangeEdges = edges;
+    range = { rangeEdges[rank], rangeEdges[rank + 1] };
+    MpiRangeLayout(rangeEdges, 1, counts, displacements, 1);
+    if (shared.IsAttached() && !shared.SetRange(range.start, range.end)) {
+        // The gathers would use the layout of the old ranges (see MpiSharedBuffers::SetRange)
+        std::cerr << "Rank " << rank << ": range edges out of rank order for the shared buffers" << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Rank 0 only holds references of the slots each rank sent it, which changed
+    gatherPositionCodec.Reset();
+    gatherVelocityCodec.Reset();
+}
+
+void MpiWorker::SetWireCellSize()
+{
+    predictedPositionCodec.SetCellSize(physics.smoothingRadius);
+    positionCodec.SetCellSize(physics.smoothingRadius);
+    gatherPositionCodec.SetCellSize(physics.smoothingRadius);
+}
+
+void MpiWorker::ResetWireCodecs()
+{
+    predictedPositionCodec.Reset();
+    positionCodec.Reset();
+    velocityCodec.Reset();
+    densityCodec.Reset();
+    gatherPositionCodec.Reset();
+    gatherVelocityCodec.Reset();
+}
+
+void MpiWorker::RunRange(void (Physics::*stage)(int))
+{
+    double start = Transport::Seconds();
+    ParallelForRange(executor.get(), range.start, range.end, TileSize, [this, stage](unsigned int start, unsigned int end) {
+        for (unsigned int index = start; index < end; index++) {
+            (physics.*stage)(index);
         }
+    });
+    computeSeconds += Transport::Seconds() - start;
+}
+
+void MpiWorker::Step()
+{
+    if (options.adaptiveTimeStep) {
+        stepStartVelocities.resize(physics.numParticles);
+        std::copy(physics.Velocities.begin() + range.start, physics.Velocities.begin() + range.end, stepStartVelocities.begin() + range.start);
+    }
+
+    RunRange(&Physics::ExternalForces);
+
+    // Every worker gets the predicted positions of all the others. Without shared buffers every
+    // worker builds the spatial index itself, with them the ranks of a node build one together.
+    ShareField(physics.PredictedPositions, predictedPositionCodec);
+    double indexStart = Transport::Seconds();
+    unsigned int hashStart = shared.IsAttached() ? shared.NodeShareStart() : 0;
+    unsigned int hashEnd = shared.IsAttached() ? shared.NodeShareEnd() : physics.numParticles;
+    ParallelForRange(executor.get(), hashStart, hashEnd, TileSize, [this](unsigned int start, unsigned int end) {
+        physics.HashForSpatialIndex(start, end);
+    });
+    if (shared.IsAttached()) {
+        shared.NodeBarrier();
+        if (shared.IsLeader()) physics.SortSpatialIndex();
+        shared.NodeBarrier();
+    }
+    else {
+        physics.SortSpatialIndex();
+    }
+    computeSeconds += Transport::Seconds() - indexStart;
+
+    RunRange(&Physics::CalculateDensity);
+
+    ShareField(physics.Densities, densityCodec);
+
+    RunRange(&Physics::CalculatePressureForce);
+
+    ShareField(physics.Velocities, velocityCodec);
+
+    RunRange(&Physics::CalculateViscosity);
+
+    // The other ranks of the node may still read these velocities
+    if (shared.IsAttached()) shared.NodeBarrier();
+
+    if (options.adaptiveTimeStep) {
+        double start = Transport::Seconds();
+        motion.Add(MeasureParticleMotion(executor.get(), physics.Velocities.data(), stepStartVelocities.data(),
+            range.start, range.end, TileSize, physics.deltaTime));
+        computeSeconds += Transport::Seconds() - start;
+    }
+
+    // Positions and velocities of the own range stay here from step to step
+    RunRange(&Physics::UpdatePositions);
+}
+
+void MpiWorker::ShareField(ParticleBuffer<Float2>& field, MpiWireCodec& codec)
+{
+    MpiWireCodec* wireCodec = options.mpiWireEncoding ? &codec : nullptr;
+    if (shared.IsAttached()) {
+        shared.Share(field, wireCodec);
+        return;
+    }
+    if (wireCodec) {
+        wireCodec->AllgathervInPlace(*workersTransport, field.data(), counts, displacements);
+        return;
+    }
+    workersTransport->AllgathervInPlace(field.data(), counts, displacements, sizeof(Float2));
+}
+
+void MpiWorker::Gather()
+{
+    transport->Gather(&computeSeconds, sizeof(double), nullptr, 0);
+    computeSeconds = 0;
+    if (options.adaptiveTimeStep) {
+        transport->Gather(&motion, sizeof(ParticleMotion), nullptr, 0);
+        motion = ParticleMotion();
+    }
 
-        // Send back again the velocities
-        MPI_Ssend(physics.Velocities.data() + range.start, (range.end - range.start) * 2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+    int count = range.end - range.start;
+    if (options.mpiWireEncoding) {
+        gatherPositionCodec.Gatherv(*transport, physics.Positions.data(), range.start, count, nullptr, counts, displacements, 0);
+        gatherVelocityCodec.Gatherv(*transport, physics.Velocities.data(), range.start, count, nullptr, counts, displacements, 0);
+        return;
     }
+    transport->Gatherv(physics.Positions.data() + range.start, count, nullptr, counts, displacements, sizeof(Float2), 0);
+    transport->Gatherv(physics.Velocities.data() + range.start, count, nullptr, counts, displacements, sizeof(Float2), 0);
 }
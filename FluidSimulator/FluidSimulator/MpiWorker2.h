@@ -1,15 +1,140 @@
 #pragma once
 #include "physics.h"
+#include "Executor.h"
+#include "MpiCheckpoint.h"
+#include "MpiDomain.h"
+#include "MpiSharedBuffers.h"
+#include "MpiTransport.h"
+#include "MpiWireCodec.h"
+#include "SimulationOptions.h"
+#include "ThreadPool.h"
+#include "TimeStepController.h"
+#include <memory>
+#include <mpi.h>
+#include <vector>
+
+// First message of every exchange, broadcast by rank 0 to all workers as
+// { command, argument, parameter version }. Unless the command is a quit, the PhysicsParameters
+// follow when their version differs from the one the workers got last.
+enum MpiCommand : int
+{
+    MpiCommandStep,   // run argument steps, then gather once
+    MpiCommandResize, // start or restart with argument particles, the initial state follows
+    MpiCommandCheckpoint, // all ranks write their particles to the checkpoint of step argument
+    MpiCommandRestart,    // restart with argument particles read from SimulationOptions::restartFile
+    MpiCommandQuit    // leave Run, the worker may finalize
+};
+
+// Communicators used for the whole run, created once in main by all ranks
+struct MpiCommunicators
+{
+    MPI_Comm simulation = MPI_COMM_NULL; // duplicate of MPI_COMM_WORLD for all simulation traffic
+    MPI_Comm workers = MPI_COMM_NULL;    // simulation without rank 0 (null on rank 0)
+    MPI_Comm node = MPI_COMM_NULL;       // ranks that share memory with this one
+
+    // Collective over MPI_COMM_WORLD
+    void Create();
+    void Free();
+};
 
 struct MpiWorkerRange {
     unsigned int start;
     unsigned int end;
 };
 
+// Particles updated by a rank. Rank 0 only coordinates and owns an empty range.
+MpiWorkerRange MpiRangeOfRank(int rank, int rankCount, unsigned int particleCount);
+
+// Range edges of all ranks, rank r updates [edges[r], edges[r + 1]). Starts from the even split
+// of MpiRangeOfRank, the load balancer moves the edges of the workers from there.
+void MpiEvenRangeEdges(int rankCount, unsigned int particleCount, std::vector<unsigned int>& edges);
+
+// Receive counts and displacements of the ranges of ranks firstRank..rankCount-1 for the *v
+// collectives, with elementsPerParticle elements per particle
+void MpiRangeLayout(const std::vector<unsigned int>& edges, int elementsPerParticle, std::vector<int>& counts, std::vector<int>& displacements, int firstRank = 0);
+
+// Runs the whole simulation step for the particles of one rank, so rank 0 only sends the
+// parameters once per frame and collects the particles it renders. In the replicated mode the
+// workers exchange their results among themselves on the workers transport, without rank 0.
+// All messages go through a Transport, so the workers may also be threads of one process
+// (see InProcessRanks).
+//
+// Over MPI, ranks on the same node share their particle buffers (see MpiSharedBuffers), so the
+// exchanges after each pass only go over the network between node leaders.
+//
+// Checkpoints are written and read by all ranks together, each one moving its own particles
+// (see MpiCheckpoint).
+//
+// With adaptive time steps every rank also measures the largest speed and acceleration of its
+// particles, rank 0 gets them with the particles to choose the next step.
+//
+// Every rank times its particle loops, rank 0 collects the times with the particles and moves
+// the range edges (or slab edges) when the ranks are out of balance, see MpiLoadBalancer. The
+// edges come with every step command.
+//
+// With SimulationOptions::mpiWireEncoding the field exchanges and the gathers go through
+// MpiWireCodec, coded against the values of the previous step. The exchanges keep their
+// references while the range edges move, the gathers to rank 0 start over.
+//
+// Inside a rank the particle loops run on a thread pool, so one rank per node or socket is
+// enough. Only the thread calling Run talks to MPI (MPI_THREAD_FUNNELED).
 class MpiWorker {
 public:
+    // Over MPI, with the communicators created in main
+    MpiWorker(const MpiCommunicators& communicators, const SimulationOptions& options);
+    // Over any transport, workers holds the ranks 1..n-1 of simulation
+    MpiWorker(Transport& simulation, Transport& workers, const SimulationOptions& options, int poolThreads);
+
     void Run();
 
+    // Pool threads for a rank: the logical cpus of the node shared by its ranks, minus the calling thread
+    static int ThreadsPerRank(MPI_Comm nodeComm, int requested);
+
 private:
+    static const unsigned int TileSize = 256;
+
     Physics physics;
+    MpiDomain domain{ physics };
+    MpiSharedBuffers shared;
+    SimulationOptions options;
+    std::unique_ptr<MpiTransport> ownedSimulation;
+    std::unique_ptr<MpiTransport> ownedWorkers;
+    Transport* transport;
+    Transport* workersTransport; // transport without rank 0
+    int rank;
+    int rankCount;
+    ThreadPool pool;
+    std::unique_ptr<Executor> executor;
+
+    MpiWorkerRange range = { 0, 0 };
+    std::vector<unsigned int> rangeEdges;
+    double computeSeconds = 0; // in the particle loops since the last gather
+    ParticleMotion motion;     // since the last gather, with options.adaptiveTimeStep
+    std::vector<Float2> stepStartVelocities;
+    std::vector<int> counts; // Float2 layout of the worker ranges on workersTransport
+    std::vector<int> displacements;
+
+    MpiWireCodec predictedPositionCodec{ MpiWireCodec::Kind::Position, true };
+    MpiWireCodec positionCodec{ MpiWireCodec::Kind::Position, true };
+    MpiWireCodec velocityCodec{ MpiWireCodec::Kind::Float, true };
+    MpiWireCodec densityCodec{ MpiWireCodec::Kind::Float, true };
+    MpiWireCodec gatherPositionCodec{ MpiWireCodec::Kind::Position, true };
+    MpiWireCodec gatherVelocityCodec{ MpiWireCodec::Kind::Float, true };
+
+    int parameterVersion = 0; // of the PhysicsParameters last received
+
+    void Init(int poolThreads);
+    void ReceiveParameters(int version);
+    void ReceiveInitialState();
+    bool StartEvenRanges();
+    bool RestoreCheckpoint();
+    void WriteCheckpoint(int step);
+    void ReceiveRangeEdges();
+    void SetRangeEdges(const std::vector<unsigned int>& edges);
+    void RunRange(void (Physics::*stage)(int));
+    void Step();
+    void SetWireCellSize();
+    void ResetWireCodecs();
+    void ShareField(ParticleBuffer<Float2>& field, MpiWireCodec& codec);
+    void Gather();
 };
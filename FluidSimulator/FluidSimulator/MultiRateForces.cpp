@@ -0,0 +1,142 @@
+#include "MultiRateForces.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+static const char* forceNames[MultiRateForces::ForceCount] = { "viscosity", "external forces" };
+
+void MultiRateForces::Configure(Force force, int interval)
+{
+    tracks[force].interval = std::max(1, interval);
+}
+
+void MultiRateForces::Resize(unsigned int particleCount)
+{
+    for (Track& track : tracks)
+    {
+        track.currentInterval = track.interval;
+        track.stepsSinceEvaluation = 0;
+        track.spacing = 1;
+        track.evaluations = 0;
+        track.evaluate = true;
+        track.error = 0;
+        track.evaluatedSteps = 0;
+        track.skippedSteps = 0;
+        if (track.interval == 1) continue;
+
+        track.last.assign(particleCount, Float2(0, 0));
+        track.previous.assign(particleCount, Float2(0, 0));
+        track.squaredErrors.assign(particleCount, 0.0f);
+        track.squaredMagnitudes.assign(particleCount, 0.0f);
+    }
+}
+
+void MultiRateForces::BeginStep()
+{
+    for (Track& track : tracks)
+    {
+        if (track.interval == 1) continue;
+
+        track.stepsSinceEvaluation++;
+        track.evaluate = track.evaluations == 0 || track.stepsSinceEvaluation >= track.currentInterval;
+        if (track.evaluate)
+        {
+            // Particles skipped in this step (sleeping) keep no error of an older one
+            std::fill(track.squaredErrors.begin(), track.squaredErrors.end(), 0.0f);
+            std::fill(track.squaredMagnitudes.begin(), track.squaredMagnitudes.end(), 0.0f);
+            track.evaluatedSteps++;
+        }
+        else
+        {
+            track.skippedSteps++;
+        }
+    }
+}
+
+void MultiRateForces::EndStep(unsigned int particleCount)
+{
+    for (Track& track : tracks)
+    {
+        if (track.interval == 1 || !track.evaluate) continue;
+
+        if (track.evaluations > 0)
+        {
+            double errors = 0;
+            double magnitudes = 0;
+            for (unsigned int i = 0; i < particleCount; i++)
+            {
+                errors += track.squaredErrors[i];
+                magnitudes += track.squaredMagnitudes[i];
+            }
+            track.error = magnitudes > 0 ? (float)std::sqrt(errors / magnitudes) : 0.0f;
+
+            if (tolerance > 0 && track.error > tolerance)
+            {
+                track.currentInterval = std::max(1, track.currentInterval / 2);
+            }
+            else if (tolerance > 0 && track.error < tolerance / 4)
+            {
+                track.currentInterval = std::min(track.interval, track.currentInterval * 2);
+            }
+        }
+
+        track.spacing = track.stepsSinceEvaluation;
+        track.stepsSinceEvaluation = 0;
+        track.evaluations = std::min(2, track.evaluations + 1);
+    }
+}
+
+Float2 MultiRateForces::Estimate(const Track& track, unsigned int index) const
+{
+    if (!extrapolate || track.evaluations < 2) return track.last[index];
+
+    float t = (float)track.stepsSinceEvaluation / track.spacing;
+    return track.last[index] + (track.last[index] - track.previous[index]) * t;
+}
+
+Float2 MultiRateForces::Record(Track& track, unsigned int index, Float2 value)
+{
+    if (track.evaluations > 0)
+    {
+        Float2 difference = value - Estimate(track, index);
+        track.squaredErrors[index] = Dot(difference, difference);
+        track.squaredMagnitudes[index] = Dot(value, value);
+    }
+    track.previous[index] = track.last[index];
+    track.last[index] = value;
+    return value;
+}
+
+void MultiRateForces::ApplyExternalForces(Physics& physics, unsigned int index)
+{
+    Track& track = tracks[External];
+    Float2 acceleration = track.evaluate
+        ? Record(track, index, physics.ExternalForces(physics.Positions[index], physics.Velocities[index]))
+        : Estimate(track, index);
+    physics.Velocities[index] += acceleration * physics.deltaTime;
+    physics.PredictPosition((int)index);
+}
+
+void MultiRateForces::ApplyViscosity(Physics& physics, unsigned int index)
+{
+    Track& track = tracks[Viscosity];
+    Float2 force = track.evaluate ? Record(track, index, physics.ViscosityForce(index)) : Estimate(track, index);
+    physics.Velocities[index] -= force * physics.viscosityStrength * physics.deltaTime;
+}
+
+std::string MultiRateForces::Report() const
+{
+    std::ostringstream report;
+    report << "Multi-rate forces (" << (extrapolate ? "extrapolated" : "held") << "):";
+    for (int force = 0; force < ForceCount; force++)
+    {
+        const Track& track = tracks[force];
+        if (track.interval == 1) continue;
+
+        report << " " << forceNames[force] << " every " << track.currentInterval << "/" << track.interval
+            << " steps, " << track.evaluatedSteps << " evaluated " << track.skippedSteps << " skipped, error "
+            << track.error * 100 << "%;";
+    }
+    report << "\n";
+    return report.str();
+}
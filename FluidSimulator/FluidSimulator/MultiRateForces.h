@@ -0,0 +1,73 @@
+#pragma once
+
+#include "physics.h"
+#include <string>
+#include <vector>
+
+// Multiple time stepping for the forces that change slowly compared to the pressure
+// (SimulationOptions::viscosityInterval and externalForceInterval). A force with an interval of
+// k is only evaluated every k-th step; the steps in between reuse its last value per particle,
+// or extrapolate it linearly from the last two evaluations. The pressure runs every step.
+//
+// Error monitor: every evaluation also measures how far off the estimate of that step would
+// have been, as the RMS of the differences relative to the RMS of the fresh values. With a
+// tolerance, a force whose error exceeds it halves its interval, and doubles it again, up to
+// the configured one, while the error stays below a quarter of the tolerance.
+//
+// Viscosity is kept without its strength, so the slider still acts on every step.
+class MultiRateForces
+{
+public:
+    enum Force
+    {
+        Viscosity,
+        External,
+        ForceCount
+    };
+
+    bool extrapolate = false;
+    float tolerance = 0; // 0 keeps the intervals fixed
+
+    void Configure(Force force, int interval);
+    // Forgets every evaluation, the next step evaluates all forces
+    void Resize(unsigned int particleCount);
+
+    // Interval above 1
+    bool Enabled(Force force) const { return tracks[force].interval > 1; }
+    bool Enabled() const { return Enabled(Viscosity) || Enabled(External); }
+
+    // Serial, before the step: decides which forces the step evaluates
+    void BeginStep();
+    // Serial, after the step: error of the forces the step evaluated, adapts the intervals
+    void EndStep(unsigned int particleCount);
+
+    // The velocity passes of a particle, in place of Physics::ExternalForces and CalculateViscosity
+    void ApplyExternalForces(Physics& physics, unsigned int index);
+    void ApplyViscosity(Physics& physics, unsigned int index);
+
+    std::string Report() const;
+
+private:
+    struct Track
+    {
+        int interval = 1;         // configured
+        int currentInterval = 1;  // after the error monitor
+        int stepsSinceEvaluation = 0;
+        int spacing = 1;          // steps between the last two evaluations
+        int evaluations = 0;      // since Resize, capped at 2
+        bool evaluate = true;     // in this step
+        std::vector<Float2> last;
+        std::vector<Float2> previous;
+        std::vector<float> squaredErrors;     // of the last evaluation, per particle
+        std::vector<float> squaredMagnitudes;
+        float error = 0;          // relative RMS of the last measured evaluation
+        long long evaluatedSteps = 0;
+        long long skippedSteps = 0;
+    };
+
+    Track tracks[ForceCount];
+
+    Float2 Estimate(const Track& track, unsigned int index) const;
+    // Keeps a fresh value of the force, and its difference to the estimate
+    Float2 Record(Track& track, unsigned int index, Float2 value);
+};
@@ -0,0 +1,75 @@
+#include "ParticleSleep.h"
+#include <algorithm>
+#include <cmath>
+
+void ParticleSleep::Resize(unsigned int particleCount)
+{
+    // Everything starts awake and not calm
+    calmSteps.assign(particleCount, 0);
+    asleep.assign(particleCount, 0);
+    densitySettled.assign(particleCount, 0);
+    activeCells.assign(particleCount, 1);
+    sleeping = 0;
+}
+
+void ParticleSleep::MarkActiveCells(const Physics& physics)
+{
+    sleeping = 0;
+    unsigned int previousKey = physics.numParticles;
+    for (unsigned int entry = 0; entry < physics.numParticles; entry++)
+    {
+        const SpatialEntry& spatialEntry = physics.SpatialIndices[entry];
+        if (spatialEntry.key != previousKey)
+        {
+            activeCells[spatialEntry.key] = 0;
+            previousKey = spatialEntry.key;
+        }
+        if (calmSteps[spatialEntry.index] < calmStepsToSleep)
+        {
+            activeCells[spatialEntry.key] = 1;
+        }
+        sleeping += asleep[spatialEntry.index];
+    }
+}
+
+bool ParticleSleep::UpdateAsleep(Physics& physics, unsigned int index)
+{
+    Float2 position = physics.PredictedPositions[index];
+    bool awake = false;
+
+    if (physics.currentInteractionInputStrength != 0)
+    {
+        Float2 offset = physics.interactionInputPoint - position;
+        float reach = physics.interactionInputRadius + physics.smoothingRadius;
+        if (Dot(offset, offset) < reach * reach)
+        {
+            calmSteps[index] = 0;
+            awake = true;
+        }
+    }
+
+    // Keys without entries have a stale flag, they hold no particle to wake anyone
+    physics.ForEachNeighbourCell(position, [&](ImU32, ImU32 key) {
+        awake = awake || (physics.SpatialOffsets[key] < physics.numParticles && activeCells[key]);
+    });
+
+    if (!awake && !asleep[index])
+    {
+        physics.Velocities[index] = Float2(0, 0);
+    }
+    asleep[index] = !awake;
+    return awake;
+}
+
+void ParticleSleep::RecordDensity(const Physics& physics, unsigned int index, float previousDensity)
+{
+    float change = std::abs(physics.Densities[index][0] - previousDensity);
+    densitySettled[index] = change < densityTolerance * physics.targetDensity;
+}
+
+void ParticleSleep::RecordMotion(const Physics& physics, unsigned int index)
+{
+    Float2 velocity = physics.Velocities[index];
+    bool calm = densitySettled[index] && Dot(velocity, velocity) < sleepSpeed * sleepSpeed;
+    calmSteps[index] = calm ? (unsigned short)std::min<int>(calmSteps[index] + 1, calmStepsToSleep) : 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "physics.h"
+#include <vector>
+
+// Sleeping particles for settled fluid (SimulationOptions::particleSleep). A particle is calm
+// while it moves slower than sleepSpeed and its density changes by less than densityTolerance
+// of the target density; a grid cell is active while any of its particles has been calm for
+// fewer than calmStepsToSleep steps. A particle with no active cell around it, and out of reach
+// of the mouse interaction, sleeps: it stops, and the force passes and the integration skip it.
+// Its neighbours still see it, as a particle at rest with its last density. sleepSpeed must
+// stay below what gravity adds over calmStepsToSleep steps, or fluid falling from rest counts
+// as calm and stops in mid-air.
+//
+// An active cell wakes the particles of the cells next to it in the following step. The woken
+// particles start moving again, and the wake spreads as far as the motion does.
+//
+// Cells are the keys of the spatial hash, so two grid cells that share a key also share
+// their activity, which can only keep particles awake.
+class ParticleSleep
+{
+public:
+    float sleepSpeed = 2.0f;
+    float densityTolerance = 0.01f;
+    int calmStepsToSleep = 30;
+
+    void Resize(unsigned int particleCount);
+
+    bool IsAsleep(unsigned int index) const { return asleep[index] != 0; }
+    // Sleeping particles as of the last MarkActiveCells
+    unsigned int SleepingCount() const { return sleeping; }
+
+    // After the sort, serial: marks the spatial keys holding a particle that is not calm enough
+    void MarkActiveCells(const Physics& physics);
+    // Start of the density pass of a particle: decides whether it sleeps this step, a particle
+    // falling asleep is stopped. Needs the cells of MarkActiveCells.
+    bool UpdateAsleep(Physics& physics, unsigned int index);
+    // Density pass of an awake particle, with its density before the pass
+    void RecordDensity(const Physics& physics, unsigned int index, float previousDensity);
+    // After the integration of an awake particle
+    void RecordMotion(const Physics& physics, unsigned int index);
+
+private:
+    std::vector<unsigned short> calmSteps; // capped at calmStepsToSleep
+    std::vector<unsigned char> asleep;
+    std::vector<unsigned char> densitySettled; // of the current step
+    std::vector<unsigned char> activeCells;    // by spatial key
+    unsigned int sleeping = 0;
+};
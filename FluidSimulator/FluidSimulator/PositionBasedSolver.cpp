@@ -0,0 +1,177 @@
+#include "PositionBasedSolver.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+// Same bounds as Physics::HandleCollisions
+static Float2 ClampToBounds(const Physics& physics, Float2 position)
+{
+    const float margin = Physics::SpriteSize;
+    position.x = std::max(margin, std::min(physics.boundsSize.x - margin, position.x));
+    position.y = std::max(margin, std::min(physics.boundsSize.y - margin, position.y));
+    return position;
+}
+
+void PositionBasedSolver::Resize(unsigned int particleCount)
+{
+    lambdas.assign(particleCount, 0.0f);
+    densities.assign(particleCount, 0.0f);
+    compressions.assign(particleCount, 0.0f);
+    correctedPositions.resize(particleCount);
+    neighbours.assign(particleCount, std::vector<unsigned int>());
+}
+
+void PositionBasedSolver::SetParticleSpacing(float spacing)
+{
+    particleSpacing = spacing;
+    restDensityRadius = 0;
+}
+
+void PositionBasedSolver::BeginStep(Physics& physics)
+{
+    if (physics.smoothingRadius == restDensityRadius || particleSpacing <= 0) return;
+
+    // A particle inside the spawn lattice: its density, and the squared constraint gradients
+    // of its neighbours (its own vanishes by symmetry)
+    int reach = (int)(physics.smoothingRadius / particleSpacing);
+    restDensity = 0;
+    float squaredGradients = 0;
+    for (int y = -reach; y <= reach; y++)
+    {
+        for (int x = -reach; x <= reach; x++)
+        {
+            float dst = std::sqrt((float)(x * x + y * y)) * particleSpacing;
+            restDensity += physics.DensityKernel(dst, physics.smoothingRadius);
+            if (dst > 0)
+            {
+                float derivative = physics.DensityDerivative(dst, physics.smoothingRadius);
+                squaredGradients += derivative * derivative;
+            }
+        }
+    }
+    epsilon = relaxation * squaredGradients / (restDensity * restDensity);
+    restDensityRadius = physics.smoothingRadius;
+}
+
+Float2* PositionBasedSolver::PositionsAfter(Physics& physics, int corrections)
+{
+    return corrections % 2 == 0 ? physics.PredictedPositions.data() : correctedPositions.data();
+}
+
+void PositionBasedSolver::Predict(Physics& physics, unsigned int index, int)
+{
+    Float2 velocity = physics.Velocities[index];
+    velocity += physics.ExternalForces(physics.Positions[index], velocity) * physics.deltaTime;
+    physics.Velocities[index] = velocity;
+    physics.PredictedPositions[index] = ClampToBounds(physics, physics.Positions[index] + velocity * physics.deltaTime);
+}
+
+void PositionBasedSolver::ComputeLambda(Physics& physics, unsigned int index, int iteration)
+{
+    const Float2* positions = PositionsAfter(physics, iteration);
+    Float2 pos = positions[index];
+    float radius = physics.smoothingRadius;
+    float sqrRadius = radius * radius;
+    std::vector<unsigned int>& ownNeighbours = neighbours[index];
+
+    if (iteration == 0)
+    {
+        // Neighbours stay fixed over the iterations: the ones within the smoothing radius of the
+        // predicted positions. Particles that only come within it during the iterations are missed.
+        ownNeighbours.clear();
+        physics.ForEachNeighbour(pos, index, [&](unsigned int neighbour, Float2, float) {
+            ownNeighbours.push_back(neighbour);
+        });
+    }
+
+    float density = physics.DensityKernel(0, radius);
+    Float2 gradientSum = 0;
+    float squaredGradientSum = 0;
+    for (unsigned int neighbour : ownNeighbours)
+    {
+        Float2 offset = pos - positions[neighbour];
+        float sqrDst = Dot(offset, offset);
+        if (sqrDst > sqrRadius || sqrDst == 0) continue;
+
+        float dst = std::sqrt(sqrDst);
+        Float2 gradient = offset * (physics.DensityDerivative(dst, radius) / dst);
+        density += physics.DensityKernel(dst, radius);
+        gradientSum += gradient;
+        squaredGradientSum += Dot(gradient, gradient);
+    }
+
+    float constraint = std::max(0.0f, density / restDensity - 1);
+    float denominator = (Dot(gradientSum, gradientSum) + squaredGradientSum) / (restDensity * restDensity) + epsilon;
+    lambdas[index] = -constraint / denominator;
+    densities[index] = density;
+    compressions[index] = constraint;
+}
+
+void PositionBasedSolver::ApplyCorrection(Physics& physics, unsigned int index, int iteration)
+{
+    const Float2* positions = PositionsAfter(physics, iteration);
+    Float2 pos = positions[index];
+    float radius = physics.smoothingRadius;
+    float sqrRadius = radius * radius;
+    float lambda = lambdas[index];
+
+    Float2 correction = 0;
+    for (unsigned int neighbour : neighbours[index])
+    {
+        Float2 offset = pos - positions[neighbour];
+        float sqrDst = Dot(offset, offset);
+        if (sqrDst > sqrRadius || sqrDst == 0) continue;
+
+        float dst = std::sqrt(sqrDst);
+        correction += offset * ((lambda + lambdas[neighbour]) * physics.DensityDerivative(dst, radius) / dst);
+    }
+
+    PositionsAfter(physics, iteration + 1)[index] = ClampToBounds(physics, pos + correction / restDensity);
+}
+
+void PositionBasedSolver::UpdateVelocity(Physics& physics, unsigned int index, int iterations)
+{
+    const Float2* positions = PositionsAfter(physics, iterations);
+    Float2 pos = positions[index];
+    float radius = physics.smoothingRadius;
+    float sqrRadius = radius * radius;
+    float inverseStep = 1 / physics.deltaTime;
+    Float2 velocity = (pos - physics.Positions[index]) * inverseStep;
+
+    Float2 difference = 0;
+    for (unsigned int neighbour : neighbours[index])
+    {
+        Float2 offset = pos - positions[neighbour];
+        float sqrDst = Dot(offset, offset);
+        if (sqrDst > sqrRadius) continue;
+
+        Float2 neighbourVelocity = (positions[neighbour] - physics.Positions[neighbour]) * inverseStep;
+        difference += (neighbourVelocity - velocity) * physics.DensityKernel(std::sqrt(sqrDst), radius);
+    }
+
+    physics.Velocities[index] = velocity + difference * (xsphViscosity / densities[index]);
+}
+
+void PositionBasedSolver::Finish(Physics& physics, unsigned int index, int iterations)
+{
+    Float2 pos = PositionsAfter(physics, iterations)[index];
+    physics.Positions[index] = pos;
+    physics.PredictedPositions[index] = pos;
+}
+
+std::string PositionBasedSolver::Report(const Physics& physics, int iterations) const
+{
+    double sum = 0;
+    float largest = 0;
+    for (unsigned int i = 0; i < physics.numParticles; i++)
+    {
+        sum += compressions[i];
+        largest = std::max(largest, compressions[i]);
+    }
+
+    std::ostringstream report;
+    report << "Position based, " << iterations << " iterations: rest density " << restDensity
+        << ", compression mean " << sum / std::max(1u, physics.numParticles) * 100
+        << "% max " << largest * 100 << "%\n";
+    return report.str();
+}
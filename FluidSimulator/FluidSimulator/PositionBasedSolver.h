@@ -0,0 +1,66 @@
+#pragma once
+
+#include "physics.h"
+#include <string>
+#include <vector>
+
+// Position Based Fluids (Macklin and Mueller 2013), the scheme of SimulationOptions::pressureSolver
+// == PressureSolver::PositionBased. Particles are moved to predicted positions by the external
+// forces and a whole step (not the 1/120 s look-ahead of the other schemes), then a fixed number
+// of Jacobi iterations project these positions onto the density constraints
+//
+//   C_i = density_i / restDensity - 1 <= 0
+//
+// each a lambda pass and a correction pass over the neighbours found at the predicted positions.
+// The velocity is what the particle moved over the step, smoothed by XSPH viscosity. Since the
+// corrections only move positions, no step size can make the velocities blow up, which is what
+// lets interactive scenes run a single step per frame.
+//
+// The constraints only push, so particles never clump at a free surface and need no tensile
+// correction. The walls are projected on every correction. The rest density is that of the
+// spawn lattice, as for ImplicitPressureSolver, and all particles have mass 1.
+//
+// The corrections alternate between PredictedPositions and a second buffer, so a pass never
+// writes the positions its neighbours read.
+class PositionBasedSolver
+{
+public:
+    // Softness of the constraints, relative to the constraint gradient of a particle at rest
+    float relaxation = 0.1f;
+    // XSPH viscosity, as a fraction of the difference to the neighbours' mean velocity
+    float xsphViscosity = 0.05f;
+
+    void Resize(unsigned int particleCount);
+    void SetParticleSpacing(float spacing);
+    // Before every step, serial: follows changes of the smoothing radius
+    void BeginStep(Physics& physics);
+    float RestDensity() const { return restDensity; }
+
+    // Per particle, in this order with neighbour dependencies between the passes
+    void Predict(Physics& physics, unsigned int index, int);
+    // Iteration 0 also collects the neighbours from the spatial index
+    void ComputeLambda(Physics& physics, unsigned int index, int iteration);
+    void ApplyCorrection(Physics& physics, unsigned int index, int iteration);
+    // After iterations corrections: the new velocity, with XSPH viscosity
+    void UpdateVelocity(Physics& physics, unsigned int index, int iterations);
+    // Then moves the particle to its corrected position
+    void Finish(Physics& physics, unsigned int index, int iterations);
+
+    // Density above rest left at the last iteration, relative to the rest density. Serial pass.
+    std::string Report(const Physics& physics, int iterations) const;
+
+private:
+    float particleSpacing = 0;
+    float restDensity = 0;
+    float restDensityRadius = 0;
+    float epsilon = 0; // constraint softness in gradient units
+
+    std::vector<float> lambdas;
+    std::vector<float> densities;
+    std::vector<float> compressions; // max(C, 0) at the last lambda pass
+    ParticleBuffer<Float2> correctedPositions;
+    std::vector<std::vector<unsigned int>> neighbours; // keep their capacity from step to step
+
+    // Positions after the given number of corrections
+    Float2* PositionsAfter(Physics& physics, int corrections);
+};
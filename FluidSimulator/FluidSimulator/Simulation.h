@@ -2,25 +2,115 @@
 #include "Vec2.h"
 #include "physics.h"
 #include "ParticleSpawner.h"
+#include "SimulationOptions.h"
+#include "TimeStepController.h"
+#include "FixedStepClock.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
-#include <GLFW\glfw3.h>
-#include <imgui_impl_glfw.h>
 #include <thread>
+#include <cstring>
 
 #define SIMULATION_PARAM_FACTOR 4.0f
 #define SCREEN_WIDTH 2500
 #define SCREEN_HEIGHT 1400
+#ifndef RUN_MPI
 #define RUN_MPI 1
+#endif
 
 #if RUN_MPI
 #include <mpi.h>
 #include "MpiWorker2.h"
 #else
 #include "ThreadPool.h"
+#include "Executor.h"
+#include "TaskGraph.h"
+#include "ThreadCountTuner.h"
+#include "ParticleSleep.h"
+#include "ImplicitPressureSolver.h"
+#include "PositionBasedSolver.h"
+#include "MultiRateForces.h"
+#include "BlockTimeSteps.h"
 #endif
 
+// Parameters exposed in the settings window. The UI edits its own copy and forwards it with
+// every input, so the sliders never write into the physics while a step is running.
+struct SimulationSettings
+{
+    float interactionInputRadius;
+    float interactionInputStrength;
+    float gravity;
+    float collisionDamping;
+    float smoothingRadius;
+    float targetDensity;
+    float pressureMultiplier;
+    float nearPressureMultiplier;
+    float viscosityStrength;
+
+    SimulationSettings()
+    {
+        SetDefaults();
+    }
+
+    void SetDefaults()
+    {
+        interactionInputRadius = 50.0f;
+        interactionInputStrength = 1000.0f;
+        gravity = 40.0f * SIMULATION_PARAM_FACTOR;
+        collisionDamping = 0.25f;
+        smoothingRadius = 2.75f * SIMULATION_PARAM_FACTOR;
+        targetDensity = 6.f * SIMULATION_PARAM_FACTOR;
+        pressureMultiplier = 30.0f * SIMULATION_PARAM_FACTOR;
+        nearPressureMultiplier = 1.75f * SIMULATION_PARAM_FACTOR;
+        viscosityStrength = 0.075f * SIMULATION_PARAM_FACTOR;
+    }
+
+    void Apply(Physics& physics) const
+    {
+        physics.interactionInputRadius = interactionInputRadius;
+        physics.interactionInputStrength = interactionInputStrength;
+        physics.gravity = gravity;
+        physics.collisionDamping = collisionDamping;
+        physics.smoothingRadius = smoothingRadius;
+        physics.targetDensity = targetDensity;
+        physics.pressureMultiplier = pressureMultiplier;
+        physics.nearPressureMultiplier = nearPressureMultiplier;
+        physics.viscosityStrength = viscosityStrength;
+    }
+
+    // The settings physics runs with, e.g. after a restart from a checkpoint
+    void Read(const Physics& physics)
+    {
+        interactionInputRadius = physics.interactionInputRadius;
+        interactionInputStrength = physics.interactionInputStrength;
+        gravity = physics.gravity;
+        collisionDamping = physics.collisionDamping;
+        smoothingRadius = physics.smoothingRadius;
+        targetDensity = physics.targetDensity;
+        pressureMultiplier = physics.pressureMultiplier;
+        nearPressureMultiplier = physics.nearPressureMultiplier;
+        viscosityStrength = physics.viscosityStrength;
+    }
+
+    bool operator==(const SimulationSettings& other) const
+    {
+        return memcmp((const void*)this, (const void*)&other, sizeof(SimulationSettings)) == 0;
+    }
+    bool operator!=(const SimulationSettings& other) const { return !(*this == other); }
+};
+
+// Everything the simulation needs from the window for one frame, captured on the UI thread
+struct SimulationInput
+{
+    Float2 mousePosition;
+    bool isPullInteraction = false;
+    bool isPushInteraction = false;
+    bool restart = false;
+    // Only applied when they changed, so they never undo the parameters of a restored checkpoint
+    SimulationSettings settings;
+    bool settingsChanged = false;
+};
+
 struct Simulation
 {
     Simulation()
@@ -30,37 +120,100 @@ struct Simulation
 
     void SetDefaultParams() {
         physics.interactionInputPoint = 0.0f;
-        physics.interactionInputRadius = 50.0f;
-        physics.interactionInputStrength = 1000.0f;
-        physics.gravity = 40.0f * SIMULATION_PARAM_FACTOR;
-        physics.collisionDamping = 0.25f;
-        physics.smoothingRadius = 2.75f * SIMULATION_PARAM_FACTOR;
-        physics.targetDensity = 6.f * SIMULATION_PARAM_FACTOR;
-        physics.pressureMultiplier = 30.0f * SIMULATION_PARAM_FACTOR;
-        physics.nearPressureMultiplier = 1.75f * SIMULATION_PARAM_FACTOR;
-        physics.viscosityStrength = 0.075f * SIMULATION_PARAM_FACTOR;
+        input.settings.SetDefaults();
+        input.settings.Apply(physics);
     }
 
     void Start()
     {
 #if !RUN_MPI
         pool.~ThreadPool(); // reset thread pool
-        const auto available_thread_count = (std::thread::hardware_concurrency() - 1); // minus current main thread
-        new(&pool) ThreadPool(available_thread_count); // c++...
+        auto available_thread_count = (std::thread::hardware_concurrency() - 1); // minus current main thread
+        if (options.adaptiveThreads)
+        {
+            // The main thread only waits during the step, so the tuner may also use its cpu
+            available_thread_count = std::thread::hardware_concurrency();
+        }
+        new(&pool) ThreadPool(available_thread_count, options.pinWorkerThreads); // c++...
+        if (options.pinWorkerThreads && !topologyReported)
+        {
+            // Where the pinned workers ended up, once per run (restarts pin the same way)
+            std::cout << pool.topologyReport();
+            topologyReported = true;
+        }
+        executor = CreateExecutor(options.executorBackend, pool);
 #endif
         //Debug.Log("Controls: Space = Play/Pause, R = Reset, LMB = Attract, RMB = Repel");
         frameIndex = 0;
         isPaused = false;
         pauseNextFrame = false;
 
+        timeStepController.cflNumber = options.cflNumber;
+        timeStepController.minStep = options.minTimeStep;
+        timeStepController.maxStep = options.maxTimeStep;
+        timeStepController.maxSubsteps = options.maxSubsteps;
+        timeStepController.Reset();
+        if (options.fixedTimeStep > 0)
+        {
+            fixedStepClock.Configure(options.fixedTimeStep, options.maxCatchUpSteps);
+        }
+        previousPositions.clear();
+
+#if RUN_MPI
+        mpiStepIndex = 0;
+        if (!options.restartFile.empty() && RestoreMpiCheckpoint())
+        {
+            return;
+        }
+#endif
+
         auto spawnData = spawner.GetSpawnData();
 
         physics.numParticles = spawnData.positions.size();
+#if !RUN_MPI
+        if (options.adaptiveThreads)
+        {
+            // Calibrations are shared by scenes of similar size: particle count rounded up to a power
+            // of two. The pressure solvers run different stages of different cost.
+            unsigned int sizeClass = 1;
+            while (sizeClass < physics.numParticles) sizeClass *= 2;
+            tuner.Reset(executor->MaxWorkers(), std::string(executor->Name()) + "/" + PressureSolverName(options.pressureSolver) + "/"
+                + std::to_string(sizeClass) + "/" + std::to_string(pool.size()));
+            if (tuner.Load(options.calibrationFile))
+            {
+                std::cout << tuner.Report();
+            }
+        }
+#endif
         // Create buffers
+#if !RUN_MPI
+        if (options.numaFirstTouch)
+        {
+            physics.FreeBuffers();
+        }
+#endif
         physics.ResizeBuffers();
 
         // Set buffer data
-        SetInitialBufferData(spawnData);
+#if !RUN_MPI
+        if (options.numaFirstTouch)
+        {
+            // The buffers are still untouched, every worker writes the tiles it owns first
+            int tileCount = StepTileCount();
+            pool.runOnEachThread([this, &spawnData, tileCount](int worker, int workerCount) {
+                for (int tile = 0; tile < tileCount; tile++)
+                {
+                    if (TaskGraph::OwnerOfTile(tile, tileCount, workerCount) != worker) continue;
+                    int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+                    SetInitialBufferData(spawnData, tile * taskTileSize, end);
+                }
+            });
+        }
+        else
+#endif
+        {
+            SetInitialBufferData(spawnData, 0, physics.numParticles);
+        }
 
         /*physics.interactionInputPoint = physicsParameters.interactionInputPoint;
         physics.interactionInputRadius = physicsParameters.interactionInputRadius;
@@ -76,39 +229,109 @@ struct Simulation
         // Init display
         // display.Init(this);
 
+#if !RUN_MPI
+        if (options.adaptiveTimeStep)
+        {
+            stepStartVelocities.resize(physics.numParticles);
+            tileMotions.assign(StepTileCount(), ParticleMotion());
+        }
+        if (options.particleSleep && options.pressureSolver == PressureSolver::PositionBased)
+        {
+            std::cerr << "Particle sleep does not work with the position based solver, ignored" << std::endl;
+            options.particleSleep = false;
+        }
+        if (options.particleSleep)
+        {
+            particleSleep.sleepSpeed = options.sleepSpeed;
+            particleSleep.calmStepsToSleep = options.sleepSteps;
+            particleSleep.Resize(physics.numParticles);
+        }
+        if (options.pressureSolver == PressureSolver::Implicit)
+        {
+            implicitSolver.Resize(physics.numParticles);
+            implicitSolver.SetParticleSpacing(SpawnSpacing());
+        }
+        if (options.pressureSolver == PressureSolver::PositionBased)
+        {
+            positionBasedSolver.Resize(physics.numParticles);
+            positionBasedSolver.SetParticleSpacing(SpawnSpacing());
+        }
+        multiRateForces.Configure(MultiRateForces::Viscosity, options.viscosityInterval);
+        multiRateForces.Configure(MultiRateForces::External, options.externalForceInterval);
+        if (multiRateForces.Enabled() && options.pressureSolver == PressureSolver::PositionBased)
+        {
+            std::cerr << "Multi-rate forces do not work with the position based solver, ignored" << std::endl;
+            multiRateForces.Configure(MultiRateForces::Viscosity, 1);
+            multiRateForces.Configure(MultiRateForces::External, 1);
+        }
+        multiRateForces.extrapolate = options.multiRateExtrapolate;
+        multiRateForces.tolerance = options.multiRateTolerance;
+        multiRateForces.Resize(physics.numParticles);
+        if (options.blockTimeSteps && (options.pressureSolver != PressureSolver::WeaklyCompressible || options.particleSleep || multiRateForces.Enabled()))
+        {
+            std::cerr << "Block time steps need the weakly compressible solver, without particle sleep and multi-rate forces, ignored" << std::endl;
+            options.blockTimeSteps = false;
+        }
+        if (options.blockTimeSteps)
+        {
+            blockTimeSteps.cflNumber = options.cflNumber;
+            blockTimeSteps.forceNumber = timeStepController.forceNumber;
+            blockTimeSteps.Resize(physics.numParticles);
+        }
+        multiRateStepsSinceReport = 0;
+        pressureStepsSinceReport = 0;
+        BuildStepGraph();
+#else
+        if (options.particleSleep)
+        {
+            std::cerr << "Particle sleep needs the threaded build, ignored" << std::endl;
+        }
+        if (options.pressureSolver != PressureSolver::WeaklyCompressible)
+        {
+            std::cerr << "The " << PressureSolverName(options.pressureSolver) << " pressure solver needs the threaded build, ignored" << std::endl;
+        }
+        if (options.viscosityInterval > 1 || options.externalForceInterval > 1)
+        {
+            std::cerr << "Multi-rate forces need the threaded build, ignored" << std::endl;
+        }
+        if (options.blockTimeSteps)
+        {
+            std::cerr << "Block time steps need the threaded build, only the adaptive time step is used" << std::endl;
+        }
+#endif
+
 #if RUN_MPI
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Ssend(&physics.numParticles, 1, MPI_INT, index + 1, 0, MPI_COMM_WORLD);
+        BroadcastMpiCommand(MpiCommandResize, physics.numParticles);
+        ResetMpiDistribution();
+        if (options.mpiMode == MpiMode::Domain)
+        {
+            mpiDomain.Distribute();
+        }
+        else
+        {
+            mpiTransport->Broadcast(physics.Positions.data(), physics.numParticles * sizeof(Float2), 0);
+            mpiTransport->Broadcast(physics.Velocities.data(), physics.numParticles * sizeof(Float2), 0);
         }
 #endif
     }
 
-    void Update(GLFWwindow* window, float currentDeltaTime)
+    // Returns false if the particles did not move: while paused, and in the fixed time step
+    // mode when no step was due yet
+    bool Update(float currentDeltaTime)
     {
+        if (isPaused) return false;
+        if (options.fixedTimeStep > 0)
+        {
+            return RunFixedSteps(currentDeltaTime);
+        }
+
         currentDeltaTime = std::min(0.02f, currentDeltaTime);
         physics.deltaTime = currentDeltaTime;
 
         // Run simulation if not in fixed timestep mode
         // (skip running for first few frames as deltaTime can be disproportionaly large)
         //MoveParticles();
-        // if (frameIndex > 10)
-        // {
-
-        static bool was_w_pressed = false;
-        bool is_w = glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS;
-        bool is_a = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
-        bool is_s = glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS;
-        bool is_d = glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS;
-
-        //if (!was_w_pressed && is_w) {
-            RunSimulationFrame(window, physics.deltaTime);
-            was_w_pressed = true;
-        //}
-
-        if (!is_w) {
-            was_w_pressed = false;
-        }
-        // }
+        RunSimulationFrame(physics.deltaTime);
 
         // if (pauseNextFrame)
         // {
@@ -117,276 +340,738 @@ struct Simulation
         // }
 
         // HandleInput();
+        return true;
+    }
+
+    // Fixed time step mode: the steps the elapsed wall time pays for (see FixedStepClock).
+    // previousPositions keeps the state before the last of them for the blended drawing;
+    // under MPI a frame that catches up gathers the particles twice for it.
+    bool RunFixedSteps(float elapsed)
+    {
+        if (isPaused) return false;
+
+        int steps = fixedStepClock.Advance(elapsed * timeScale);
+        if (steps == 0) return false;
+
+        if (steps > 1)
+        {
+            RunSteps(steps - 1, fixedStepClock.Step());
+        }
+        previousPositions.assign(physics.Positions.begin(), physics.Positions.end());
+        RunSteps(1, fixedStepClock.Step());
+        if (!options.adaptiveTimeStep)
+        {
+            frameSubsteps = steps;
+        }
+        return true;
     }
 
-    void RunSimulationFrame(GLFWwindow* window, float frameTime)
+    // Wall time until the next fixed step is due, 0 outside the fixed time step mode
+    float TimeToNextFixedStep() const
+    {
+        if (options.fixedTimeStep <= 0 || isPaused || timeScale <= 0) return 0;
+        return fixedStepClock.TimeToNextStep() / timeScale;
+    }
+
+    void RunSimulationFrame(float frameTime)
     {
         if (!isPaused)
         {
-            float timeStep = frameTime / iterationsPerFrame * timeScale;
+            if (options.adaptiveTimeStep)
+            {
+                RunAdaptiveFrame(frameTime * timeScale);
+                return;
+            }
 
-            UpdateSettings(window, timeStep);
+            // The position based solver takes the whole frame in one step, its iterations
+            // stand in for the substeps
+            int substeps = options.pressureSolver == PressureSolver::PositionBased ? 1 : iterationsPerFrame;
+            float timeStep = frameTime / substeps * timeScale;
+            physics.deltaTime = timeStep;
+            UpdateSettings(timeStep);
+            RunSubsteps(substeps);
+        }
+    }
 
-            for (int i = 0; i < iterationsPerFrame; i++)
+    // Runs the given number of steps with a fixed time step and no frame input (headless runs).
+    // Under MPI rank 0 only receives the particles after the last one. With adaptive time
+    // steps every step is a frame of timeStep instead, split into the substeps it needs.
+    void RunSteps(int steps, float timeStep)
+    {
+        if (options.adaptiveTimeStep)
+        {
+            for (int i = 0; i < steps; i++)
             {
-                RunSimulationStep();
+                RunAdaptiveFrame(timeStep);
             }
+            return;
         }
+
+        physics.deltaTime = timeStep;
+        UpdateSettings(timeStep);
+        RunSubsteps(steps);
     }
 
-    void RunSimulationStep()
+    // Steps of physics.deltaTime, the frame settings must be current
+    void RunSubsteps(int steps)
     {
-        //run tasks
+        frameTimeStep = physics.deltaTime;
+        frameSubsteps = steps;
 #if RUN_MPI
-        RunSimulationStepMPI();
+        // The workers run all steps of the frame, rank 0 only collects the result once
+        RunSimulationStepsMPI(steps);
 #else
-        RunSimulationStepMultithreaded();
+        for (int i = 0; i < steps; i++)
+        {
+            RunSimulationStep();
+        }
 #endif
     }
 
-#if !RUN_MPI
-    void RunThreadPoolBatch(std::function<void(int)> fun)
+    // Splits the frame into as many substeps as the particle motion of the last frame needs,
+    // the steps measure the motion for the next one (see TimeStepController)
+    void RunAdaptiveFrame(float frameTime)
     {
+        float timeStep;
+        int substeps = timeStepController.PlanFrame(frameTime, physics.smoothingRadius, timeStep);
+#if !RUN_MPI
+        if (options.blockTimeSteps)
+        {
+            // The levels halve the frame, the planned step is the finest one needed. Past the
+            // largest power of two within maxSubsteps the planned step is kept, and the frame
+            // runs slower, as at the bound of TimeStepController.
+            int largestSubsteps = 1;
+            while (largestSubsteps * 2 <= timeStepController.maxSubsteps) largestSubsteps *= 2;
+            int blockSubsteps = 1;
+            while (blockSubsteps < substeps && blockSubsteps < largestSubsteps) blockSubsteps *= 2;
+            if (blockSubsteps >= substeps) timeStep *= (float)substeps / blockSubsteps;
+            substeps = blockSubsteps;
+            blockTimeSteps.BeginFrame(substeps);
+        }
+#endif
+        physics.deltaTime = timeStep;
+        UpdateSettings(timeStep);
+        RunSubsteps(substeps);
 
-        int batchSize = physics.numParticles / pool.size();
-
-        for (int i = 0; i < physics.numParticles; i += batchSize)
+        timeStepController.Record(TakeFrameMotion());
+        if (timeStepController.FramesSinceReport() >= timeStepReportInterval)
         {
-            pool.enqueueFunction([this, i, batchSize, fun]() {
-                for (int index = i; index < i + batchSize && index < physics.numParticles; index++)
-                {
-                    fun(index);
-                }
-            });
+            std::cout << timeStepController.Report();
+#if !RUN_MPI
+            if (options.blockTimeSteps) std::cout << blockTimeSteps.Report();
+#endif
         }
-        pool.waitUntilAllThreadsWait();
     }
 
-    void RunSimulationStepMultithreaded()
+    // Largest particle speed and acceleration of the steps since the last call
+    ParticleMotion TakeFrameMotion()
     {
-        RunThreadPoolBatch([this](int i) { physics.ExternalForces(i); });
-        // RunThreadPoolBatch([this](int i) { physics.UpdateSpatialHash(i); }); // concurrency issues because of the spatial hash...
-        for (int i = 0; i < physics.numParticles; i++)
+        ParticleMotion motion;
+#if RUN_MPI
+        if (options.mpiMode == MpiMode::Domain)
         {
-            physics.UpdateSpatialHash(i);
+            return mpiDomain.TakeMotion();
         }
+        motion = mpiMotion;
+        mpiMotion = ParticleMotion();
+#else
+        for (ParticleMotion& tileMotion : tileMotions)
+        {
+            motion.Add(tileMotion);
+            tileMotion = ParticleMotion();
+        }
+#endif
+        return motion;
+    }
 
-        physics.GpuSortAndCalculateOffsets();
+    unsigned int SleepingParticles()
+    {
+#if RUN_MPI
+        return 0;
+#else
+        return options.particleSleep ? particleSleep.SleepingCount() : 0;
+#endif
+    }
 
-        RunThreadPoolBatch([this](int i) { physics.CalculateDensity(i); });
-        RunThreadPoolBatch([this](int i) { physics.CalculatePressureForce(i); });
-        RunThreadPoolBatch([this](int i) { physics.CalculateViscosity(i); });
-        RunThreadPoolBatch([this](int i) { physics.UpdatePositions(i); });
+    const char* BackendName()
+    {
+#if RUN_MPI
+        return options.mpiMode == MpiMode::Domain ? "mpi domain" : "mpi";
+#else
+        return executor ? executor->Name() : "";
+#endif
     }
+
+    void RunSimulationStep()
+    {
+        //run tasks
+#if RUN_MPI
+        RunSimulationStepsMPI(1);
 #else
-    void RunSimulationStepMPI()
-    {
-        unsigned int particle_count = physics.numParticles;
-        MPI_Status status;
-
-        MpiWorkerRange* ranges = new MpiWorkerRange[mpiWorkersCount];
-        unsigned int* ranges_size = new unsigned int[mpiWorkersCount];
-
-        // Send the physics params
-        size_t parameter_size = offsetof(Physics, Positions);
-        int per_worker_count = particle_count / mpiWorkersCount;
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Ssend(&physics, parameter_size / sizeof(int), MPI_INT, index + 1, 0, MPI_COMM_WORLD);
-            ranges[index].start = index * per_worker_count;
-            ranges[index].end = (index + 1) * per_worker_count;
-            if (index == mpiWorkersCount - 1) {
-                ranges[index].end = particle_count;
-            }
-            ranges_size[index] = ranges[index].end - ranges[index].start;
-            MPI_Ssend(&ranges[index], 2, MPI_INT, index + 1, 0, MPI_COMM_WORLD);
-        }
+        RunSimulationStepMultithreaded();
+#endif
+    }
 
-        for (int index = 0; index < particle_count; index++) {
-            physics.ExternalForces(index);
-            physics.UpdateSpatialHash(index);
+#if !RUN_MPI
+    void RunTile(int tile, void (Physics::*stage)(int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int index = tile * taskTileSize; index < end; index++)
+        {
+            (physics.*stage)(index);
         }
+    }
 
-        physics.GpuSortAndCalculateOffsets();
+    void SaveStepStartVelocities(int tile)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        std::copy(physics.Velocities.begin() + tile * taskTileSize, physics.Velocities.begin() + end, stepStartVelocities.begin() + tile * taskTileSize);
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Ssend(physics.Velocities.data(), particle_count * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD);
-            MPI_Ssend(physics.PredictedPositions.data(), particle_count * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD);
-            MPI_Ssend(physics.SpatialIndices.data(), particle_count * 3, MPI_UINT32_T, index + 1, 0, MPI_COMM_WORLD);
-            MPI_Ssend(physics.SpatialOffsets.data(), particle_count, MPI_UINT32_T, index + 1, 0, MPI_COMM_WORLD);
+    // The particles of the Integrate tile, whose velocities are final once it runs
+    void MeasureTileMotion(int tile)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            unsigned int index = physics.SpatialIndices[entry].index;
+            tileMotions[tile].Measure(physics.Velocities[index], stepStartVelocities[index], physics.deltaTime);
         }
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Recv(physics.Densities.data() + ranges[index].start, ranges_size[index] * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD, &status);
+    // Same as RunTile, but the tile is a range of the sorted spatial entries, so its particles
+    // only come from a handful of grid cells
+    void RunSortedTile(int tile, void (Physics::*stage)(int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            (physics.*stage)(physics.SpatialIndices[entry].index);
         }
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Ssend(physics.Densities.data(), particle_count * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD);
+    // RunTile and RunSortedTile without the sleeping particles (options.particleSleep)
+    void RunAwakeTile(int tile, void (Physics::*stage)(int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int index = tile * taskTileSize; index < end; index++)
+        {
+            if (!particleSleep.IsAsleep(index)) (physics.*stage)(index);
         }
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Recv(physics.Velocities.data() + ranges[index].start, ranges_size[index] * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD, &status);
+    void RunAwakeSortedTile(int tile, void (Physics::*stage)(int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            unsigned int index = physics.SpatialIndices[entry].index;
+            if (!particleSleep.IsAsleep(index)) (physics.*stage)(index);
         }
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Ssend(physics.Velocities.data(), particle_count * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD);
-        }
+    // Distance of the particles in the spawned block, the rest state of the incompressible solvers
+    float SpawnSpacing()
+    {
+        return std::sqrt(spawner.spawnSize.x * spawner.spawnSize.y / spawner.particleCount);
+    }
 
-        for (int index = 0; index < mpiWorkersCount; index++) {
-            MPI_Recv(physics.Velocities.data() + ranges[index].start, ranges_size[index] * 2, MPI_FLOAT, index + 1, 0, MPI_COMM_WORLD, &status);
+    // A pass of the position based solver over a tile, in index or sorted order
+    void RunPositionBasedTile(int tile, bool sorted, void (PositionBasedSolver::*stage)(Physics&, unsigned int, int), int iteration)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            unsigned int index = sorted ? physics.SpatialIndices[entry].index : entry;
+            (positionBasedSolver.*stage)(physics, index, iteration);
         }
+    }
 
-        for (int index = 0; index < particle_count; index++) {
-            physics.UpdatePositions(index);
+    // The block time step passes over a tile: the start of the particles in index order, the
+    // force passes of the active particles and the integration in sorted order
+    void RunBlockStartTile(int tile)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int index = tile * taskTileSize; index < end; index++)
+        {
+            blockTimeSteps.StartParticle(physics, index);
         }
+    }
 
-        /*CalculateDensityMPI();
-        CalculatePressureForceMPI();
-        CalculateViscosityMPI();*/
-        //UpdatePositionsMPI();
+    void RunActiveSortedTile(int tile, void (Physics::*stage)(int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            unsigned int index = physics.SpatialIndices[entry].index;
+            if (blockTimeSteps.IsActive(index)) (physics.*stage)(index);
+        }
+    }
 
-        delete[] ranges;
-        delete[] ranges_size;
+    void IntegrateBlockTile(int tile)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            blockTimeSteps.Integrate(physics, physics.SpatialIndices[entry].index, tileMotions[tile]);
+        }
     }
 
-    void ExternalForcesMPI()
+    // A multi-rate force pass over a tile, in index or sorted order, without the sleeping particles
+    void RunMultiRateTile(int tile, bool sorted, void (MultiRateForces::*stage)(Physics&, unsigned int))
     {
-        int chunk_size = physics.numParticles / mpiWorkersCount;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            unsigned int index = sorted ? physics.SpatialIndices[entry].index : entry;
+            if (options.particleSleep && particleSleep.IsAsleep(index)) continue;
+            (multiRateForces.*stage)(physics, index);
+        }
+    }
 
-            MPI_Ssend(&actualChunkSize, 1, MPI_INT, i + 1, 1, MPI_COMM_WORLD);
-            MPI_Ssend(physics.Velocities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 2, MPI_COMM_WORLD);
-            MPI_Ssend(physics.Positions.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 3, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.deltaTime, 1, MPI_FLOAT, i + 1, 4, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.gravity, 1, MPI_FLOAT, i + 1, 5, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.currentInteractionInputStrength, 1, MPI_FLOAT, i + 1, 6, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.interactionInputPoint, 2, MPI_FLOAT, i + 1, 7, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.interactionInputRadius, 1, MPI_FLOAT, i + 1, 8, MPI_COMM_WORLD);
+    // A pass of the implicit pressure solver over a sorted tile
+    void RunSolverTile(int tile, void (ImplicitPressureSolver::*stage)(Physics&, unsigned int))
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
+        {
+            unsigned int index = physics.SpatialIndices[entry].index;
+            if (options.particleSleep && particleSleep.IsAsleep(index)) continue;
+            (implicitSolver.*stage)(physics, index);
         }
+    }
 
-        MPI_Status status;
-        for (int i = 0; i < mpiWorkersCount; i++)
+    // The density pass decides which particles of the tile sleep for the rest of the step
+    void RunDensityTileWithSleep(int tile)
+    {
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            unsigned int index = physics.SpatialIndices[entry].index;
+            if (!particleSleep.UpdateAsleep(physics, index)) continue;
 
-            MPI_Recv(physics.Velocities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 9, MPI_COMM_WORLD, &status);
-            MPI_Recv(physics.PredictedPositions.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 10, MPI_COMM_WORLD, &status);
+            float previousDensity = physics.Densities[index][0];
+            physics.CalculateDensity(index);
+            particleSleep.RecordDensity(physics, index, previousDensity);
         }
     }
 
-    void CalculateDensityMPI()
+    void IntegrateTileWithSleep(int tile)
     {
-        int chunk_size = physics.numParticles / mpiWorkersCount;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        int end = std::min((tile + 1) * taskTileSize, (int)physics.numParticles);
+        for (int entry = tile * taskTileSize; entry < end; entry++)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            unsigned int index = physics.SpatialIndices[entry].index;
+            if (particleSleep.IsAsleep(index)) continue;
 
-            MPI_Ssend(&physics.smoothingRadius, 1, MPI_FLOAT, i + 1, 11, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.numParticles, 1, MPI_UINT32_T, i + 1, 12, MPI_COMM_WORLD);
-            MPI_Ssend(physics.SpatialOffsets.data(), physics.numParticles, MPI_UINT32_T, i + 1, 13, MPI_COMM_WORLD);
-            MPI_Ssend(physics.SpatialIndices.data(), physics.numParticles * 3, MPI_UINT32_T, i + 1, 14, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.SpikyPow2ScalingFactor, 1, MPI_FLOAT, i + 1, 15, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.SpikyPow3ScalingFactor, 1, MPI_FLOAT, i + 1, 16, MPI_COMM_WORLD);
+            physics.UpdatePositions(index);
+            particleSleep.RecordMotion(physics, index);
         }
+    }
 
-        MPI_Status status;
-        for (int i = 0; i < mpiWorkersCount; i++)
-        {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+    // Declares the simulation step as a graph of tiled stages and the data each stage reads:
+    // - hashing only needs the predicted positions of its own tile
+    // - the sort (and everything derived from the sorted entries) needs all the hashes
+    // - pressure reads the densities of the neighbours, viscosity the velocities written by
+    //   the neighbours' pressure pass, and integration must not overwrite a velocity before
+    //   every tile reading it in the viscosity pass is done
+    // - the implicit pressure solver runs viscosity first, then its setup and every Jacobi
+    //   iteration as neighbourhood passes; integration then only needs its own tile, since
+    //   every reader of the velocities is behind it already
+    // - the position based solver has no density pass: every constraint iteration reads the
+    //   positions its neighbours' last correction wrote, and the velocity pass the old and
+    //   the corrected positions of the neighbours
+    int StepTileCount()
+    {
+        return std::max(1, ((int)physics.numParticles + taskTileSize - 1) / taskTileSize);
+    }
+
+    void BuildStepGraph()
+    {
+        stepGraph.Clear();
+        int tileCount = StepTileCount();
+        tileNeighbours.assign(tileCount, std::vector<int>());
+
+        int externalForces = stepGraph.AddStage("External Forces", tileCount,
+            [this](int tile) {
+                if (options.blockTimeSteps)
+                {
+                    RunBlockStartTile(tile);
+                    return;
+                }
+                if (options.adaptiveTimeStep) SaveStepStartVelocities(tile);
+                if (options.pressureSolver == PressureSolver::PositionBased) RunPositionBasedTile(tile, false, &PositionBasedSolver::Predict, 0);
+                else if (multiRateForces.Enabled(MultiRateForces::External)) RunMultiRateTile(tile, false, &MultiRateForces::ApplyExternalForces);
+                else if (options.particleSleep) RunAwakeTile(tile, &Physics::ExternalForces);
+                else RunTile(tile, &Physics::ExternalForces);
+            }, {});
+        int spatialHash = stepGraph.AddStage("Spatial Hash", tileCount,
+            [this](int tile) { RunTile(tile, &Physics::UpdateSpatialHash); },
+            { { externalForces, TaskDependencyKind::SameTile } });
+        int sort = stepGraph.AddStage("Sort", 1,
+            [this](int) {
+                physics.GpuSortAndCalculateOffsets();
+                if (options.particleSleep) particleSleep.MarkActiveCells(physics);
+                if (options.blockTimeSteps) blockTimeSteps.MarkCellLevels(physics);
+            },
+            { { spatialHash, TaskDependencyKind::AllTiles } });
+        int neighbourhood = stepGraph.AddStage("Tile Neighbourhood", tileCount,
+            [this](int tile) { physics.CalculateTileNeighbours(taskTileSize, tile, tileNeighbours[tile]); },
+            { { sort, TaskDependencyKind::AllTiles } });
+        auto runDensity = [this](int tile) {
+            if (options.blockTimeSteps) RunActiveSortedTile(tile, &Physics::CalculateDensity);
+            else if (options.particleSleep) RunDensityTileWithSleep(tile);
+            else RunSortedTile(tile, &Physics::CalculateDensity);
+        };
+        auto runViscosity = [this](int tile) {
+            if (multiRateForces.Enabled(MultiRateForces::Viscosity)) RunMultiRateTile(tile, true, &MultiRateForces::ApplyViscosity);
+            else if (options.blockTimeSteps) RunActiveSortedTile(tile, &Physics::CalculateViscosity);
+            else if (options.particleSleep) RunAwakeSortedTile(tile, &Physics::CalculateViscosity);
+            else RunSortedTile(tile, &Physics::CalculateViscosity);
+        };
+        auto runIntegrate = [this](int tile) {
+            if (options.pressureSolver == PressureSolver::Implicit) RunSolverTile(tile, &ImplicitPressureSolver::ApplyPressureAcceleration);
+            if (options.blockTimeSteps)
+            {
+                IntegrateBlockTile(tile);
+                return;
+            }
+            if (options.adaptiveTimeStep) MeasureTileMotion(tile);
+            if (options.particleSleep) IntegrateTileWithSleep(tile);
+            else RunSortedTile(tile, &Physics::UpdatePositions);
+        };
 
-            MPI_Recv(physics.Densities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 17, MPI_COMM_WORLD, &status);
+        if (options.pressureSolver == PressureSolver::PositionBased)
+        {
+            int iterations = std::max(1, options.pressureIterations);
+            int previous = sort;
+            for (int iteration = 0; iteration < iterations; iteration++)
+            {
+                // The first iteration collects the neighbours, all it needs is the sorted index
+                TaskDependency positions = { previous, iteration == 0 ? TaskDependencyKind::AllTiles : TaskDependencyKind::Neighbourhood };
+                // Numbered, so every pass is tuned on its own
+                std::string number = " " + std::to_string(iteration + 1);
+                int lambda = stepGraph.AddStage("Constraint Lambda" + number, tileCount,
+                    [this, iteration](int tile) { RunPositionBasedTile(tile, true, &PositionBasedSolver::ComputeLambda, iteration); },
+                    { positions });
+                previous = stepGraph.AddStage("Constraint Correction" + number, tileCount,
+                    [this, iteration](int tile) { RunPositionBasedTile(tile, true, &PositionBasedSolver::ApplyCorrection, iteration); },
+                    { { lambda, TaskDependencyKind::Neighbourhood } });
+            }
+            int velocity = stepGraph.AddStage("XSPH Viscosity", tileCount,
+                [this, iterations](int tile) { RunPositionBasedTile(tile, true, &PositionBasedSolver::UpdateVelocity, iterations); },
+                { { previous, TaskDependencyKind::Neighbourhood } });
+            // Every tile whose velocity pass reads the old position of this tile must be done
+            stepGraph.AddStage("Integrate", tileCount,
+                [this, iterations](int tile) {
+                    if (options.adaptiveTimeStep) MeasureTileMotion(tile);
+                    RunPositionBasedTile(tile, true, &PositionBasedSolver::Finish, iterations);
+                },
+                { { velocity, TaskDependencyKind::ReverseNeighbourhood } });
+        }
+        else if (options.pressureSolver == PressureSolver::Implicit)
+        {
+            int density = stepGraph.AddStage("Density", tileCount, runDensity,
+                { { sort, TaskDependencyKind::AllTiles } });
+            int viscosity = stepGraph.AddStage("Viscosity", tileCount, runViscosity,
+                { { density, TaskDependencyKind::SameTile } });
+            int previous = stepGraph.AddStage("Pressure Setup", tileCount,
+                [this](int tile) { RunSolverTile(tile, &ImplicitPressureSolver::Prepare); },
+                { { viscosity, TaskDependencyKind::Neighbourhood } });
+            int iterations = std::max(1, options.pressureIterations);
+            for (int iteration = 0; iteration < iterations; iteration++)
+            {
+                // Numbered, so every pass is tuned on its own
+                std::string number = " " + std::to_string(iteration + 1);
+                int acceleration = stepGraph.AddStage("Pressure Acceleration" + number, tileCount,
+                    [this](int tile) { RunSolverTile(tile, &ImplicitPressureSolver::ComputePressureAcceleration); },
+                    { { previous, TaskDependencyKind::Neighbourhood } });
+                previous = stepGraph.AddStage("Pressure Update" + number, tileCount,
+                    [this](int tile) { RunSolverTile(tile, &ImplicitPressureSolver::UpdatePressure); },
+                    { { acceleration, TaskDependencyKind::Neighbourhood } });
+            }
+            int acceleration = stepGraph.AddStage("Pressure Acceleration " + std::to_string(iterations + 1), tileCount,
+                [this](int tile) { RunSolverTile(tile, &ImplicitPressureSolver::ComputePressureAcceleration); },
+                { { previous, TaskDependencyKind::Neighbourhood } });
+            stepGraph.AddStage("Integrate", tileCount, runIntegrate,
+                { { acceleration, TaskDependencyKind::SameTile } });
+        }
+        else
+        {
+            int density = stepGraph.AddStage("Density", tileCount, runDensity,
+                { { sort, TaskDependencyKind::AllTiles } });
+            int pressure = stepGraph.AddStage("Pressure", tileCount,
+                [this](int tile) {
+                    if (options.blockTimeSteps) RunActiveSortedTile(tile, &Physics::CalculatePressureForce);
+                    else if (options.particleSleep) RunAwakeSortedTile(tile, &Physics::CalculatePressureForce);
+                    else RunSortedTile(tile, &Physics::CalculatePressureForce);
+                },
+                { { density, TaskDependencyKind::Neighbourhood } });
+            int viscosity = stepGraph.AddStage("Viscosity", tileCount, runViscosity,
+                { { pressure, TaskDependencyKind::Neighbourhood } });
+            stepGraph.AddStage("Integrate", tileCount, runIntegrate,
+                { { viscosity, TaskDependencyKind::ReverseNeighbourhood } });
         }
+
+        stepGraph.SetNeighbourhoodProvider(neighbourhood, &tileNeighbours);
+
+        // Index tiled stages stay on the worker that first touched their memory
+        stepGraph.SetStageAffinity(externalForces, options.numaFirstTouch);
+        stepGraph.SetStageAffinity(spatialHash, options.numaFirstTouch);
     }
 
-    void CalculatePressureForceMPI()
+    void RunSimulationStepMultithreaded()
     {
-        int chunk_size = physics.numParticles / mpiWorkersCount;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        // Backends that size themselves (parallel STL) have nothing to tune
+        bool tuned = options.adaptiveThreads && executor->MaxWorkers() > 1;
+        int iterations = std::max(1, options.pressureIterations);
+        bool implicit = options.pressureSolver == PressureSolver::Implicit;
+        bool positionBased = options.pressureSolver == PressureSolver::PositionBased;
+        if (implicit) implicitSolver.BeginStep(physics);
+        if (positionBased) positionBasedSolver.BeginStep(physics);
+        bool multiRate = multiRateForces.Enabled();
+        if (multiRate) multiRateForces.BeginStep();
+        stepGraph.Run(*executor, tuned ? &tuner : nullptr);
+        if (options.blockTimeSteps) blockTimeSteps.EndSubstep();
+        if (multiRate)
+        {
+            multiRateForces.EndStep(physics.numParticles);
+            if (++multiRateStepsSinceReport >= multiRateReportInterval)
+            {
+                std::cout << multiRateForces.Report();
+                multiRateStepsSinceReport = 0;
+            }
+        }
+        if ((implicit || positionBased) && ++pressureStepsSinceReport >= pressureReportInterval)
+        {
+            std::cout << (implicit ? implicitSolver.Report(physics, iterations) : positionBasedSolver.Report(physics, iterations));
+            pressureStepsSinceReport = 0;
+        }
+        if (tuned && tuner.TakeJustCalibrated())
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            tuner.Save(options.calibrationFile);
+            std::cout << tuner.Report();
+        }
+    }
+#else
+    // Rank 0 only coordinates: the workers run the whole step, rank 0 sends the parameters and
+    // receives the particles back once for the given number of steps
+    void RunSimulationStepsMPI(int steps)
+    {
+        BroadcastMpiCommand(MpiCommandStep, steps);
+        mpiStepIndex += steps;
 
-            MPI_Ssend(&physics.targetDensity, 1, MPI_FLOAT, i + 1, 18, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.pressureMultiplier, 1, MPI_FLOAT, i + 1, 19, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.nearPressureMultiplier, 1, MPI_FLOAT, i + 1, 20, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.SpikyPow2DerivativeScalingFactor, 1, MPI_FLOAT, i + 1, 21, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.SpikyPow3DerivativeScalingFactor, 1, MPI_FLOAT, i + 1, 22, MPI_COMM_WORLD);
+        if (options.mpiMode == MpiMode::Domain)
+        {
+            mpiDomain.BroadcastSlabEdges();
+            mpiDomain.Gather(steps);
+            if (mpiDomain.StepsSinceReport() >= mpiReportInterval)
+            {
+                std::cout << mpiDomain.WaitReport();
+            }
+            return;
         }
 
-        MPI_Status status;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        mpiTransport->Broadcast(mpiRangeEdges.data(), mpiRangeEdges.size() * sizeof(unsigned int), 0);
+        GatherMpiRanges(steps);
+    }
+
+    // Replicated mode: the particles of all worker ranges, with the compute time of the steps
+    // run since the last gather
+    void GatherMpiRanges(int steps)
+    {
+        double noComputeSeconds = 0;
+        mpiComputeSeconds.resize(mpiWorkersCount + 1);
+        mpiTransport->Gather(&noComputeSeconds, sizeof(double), mpiComputeSeconds.data(), 0);
+        if (options.adaptiveTimeStep)
+        {
+            ParticleMotion noMotion;
+            std::vector<ParticleMotion> motions(mpiWorkersCount + 1);
+            mpiTransport->Gather(&noMotion, sizeof(ParticleMotion), motions.data(), 0);
+            for (const ParticleMotion& motion : motions) mpiMotion.Add(motion);
+        }
+        if (options.mpiWireEncoding)
+        {
+            mpiGatherPositionCodec.SetCellSize(physics.smoothingRadius);
+            mpiGatherPositionCodec.Gatherv(*mpiTransport, nullptr, 0, 0, physics.Positions.data(), mpiCounts, mpiDisplacements, 0);
+            mpiGatherVelocityCodec.Gatherv(*mpiTransport, nullptr, 0, 0, physics.Velocities.data(), mpiCounts, mpiDisplacements, 0);
+        }
+        else
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            mpiTransport->Gatherv(nullptr, 0, physics.Positions.data(), mpiCounts, mpiDisplacements, sizeof(Float2), 0);
+            mpiTransport->Gatherv(nullptr, 0, physics.Velocities.data(), mpiCounts, mpiDisplacements, sizeof(Float2), 0);
+        }
 
-            MPI_Recv(physics.Velocities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 23, MPI_COMM_WORLD, &status);
+        if (options.mpiLoadBalancing)
+        {
+            RebalanceMpiRanges();
+        }
+        mpiStepsSinceReport += steps;
+        if (mpiStepsSinceReport >= mpiReportInterval)
+        {
+            // The report is about the balancing, as in the domain mode
+            if (options.mpiLoadBalancing) std::cout << mpiBalancer.Report();
+            mpiStepsSinceReport = 0;
         }
     }
 
-    void CalculateViscosityMPI()
+    // Domain settings, even range edges and fresh gather references for a new particle state
+    void ResetMpiDistribution()
     {
-        int chunk_size = physics.numParticles / mpiWorkersCount;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        if (options.mpiMode == MpiMode::Domain)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            mpiDomain.SetTransport(mpiTransport);
+            mpiDomain.SetOverlap(options.mpiOverlap);
+            mpiDomain.SetLoadBalancing(options.mpiLoadBalancing);
+            mpiDomain.SetWireEncoding(options.mpiWireEncoding, options.mpiWireMantissaBits);
+            mpiDomain.SetMotionMeasurement(options.adaptiveTimeStep);
+        }
+        MpiEvenRangeEdges(mpiWorkersCount + 1, physics.numParticles, mpiRangeEdges);
+        MpiRangeLayout(mpiRangeEdges, 1, mpiCounts, mpiDisplacements);
+        mpiGatherPositionCodec.Reset();
+        mpiGatherVelocityCodec.SetMantissaBits(options.mpiWireMantissaBits);
+        mpiGatherVelocityCodec.Reset();
+    }
 
-            MPI_Ssend(&physics.Poly6ScalingFactor, 1, MPI_FLOAT, i + 1, 24, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.viscosityStrength, 1, MPI_FLOAT, i + 1, 25, MPI_COMM_WORLD);
+    // All ranks write their own particles into one checkpoint file, named after the steps run
+    // since the start (see MpiCheckpoint). Rank 0 only writes the header.
+    bool WriteMpiCheckpoint()
+    {
+        BroadcastMpiCommand(MpiCommandCheckpoint, mpiStepIndex);
+        std::string path = MpiCheckpoint::PathOf(options.checkpointPrefix, mpiStepIndex);
+        bool written;
+        if (options.mpiMode == MpiMode::Domain)
+        {
+            written = mpiDomain.WriteCheckpoint(path, mpiStepIndex);
         }
+        else
+        {
+            written = MpiCheckpoint::Write(*mpiTransport, path, MpiCheckpoint::MakeHeader(physics, mpiStepIndex), nullptr, nullptr, 0, 0);
+        }
+        if (!written)
+        {
+            std::cerr << "Could not write checkpoint " << path << std::endl;
+        }
+        return written;
+    }
 
-        MPI_Status status;
-        for (int i = 0; i < mpiWorkersCount; i++)
+    // Starts from options.restartFile: rank 0 only reads the header, the workers read the
+    // particles themselves and rank 0 gathers them once to show them. False if the checkpoint
+    // could not be read, the caller starts from the spawner then.
+    bool RestoreMpiCheckpoint()
+    {
+        MpiCheckpoint::Header header;
+        if (!MpiCheckpoint::ReadHeader(options.restartFile, header))
+        {
+            std::cerr << "Not a checkpoint: " << options.restartFile << std::endl;
+            return false;
+        }
+
+        header.parameters.Apply(physics);
+        physics.numParticles = header.particleCount;
+        physics.ResizeBuffers();
+        BroadcastMpiCommand(MpiCommandRestart, physics.numParticles);
+        ResetMpiDistribution();
+
+        bool restored;
+        if (options.mpiMode == MpiMode::Domain)
+        {
+            restored = mpiDomain.Restore(options.restartFile);
+        }
+        else
+        {
+            restored = MpiCheckpoint::Read(*mpiTransport, options.restartFile, physics.numParticles, nullptr, nullptr, 0, 0);
+        }
+        if (!restored)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            std::cerr << "Could not read checkpoint " << options.restartFile << std::endl;
+            return false;
+        }
 
-            MPI_Recv(physics.Velocities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 26, MPI_COMM_WORLD, &status);
+        if (options.mpiMode == MpiMode::Domain)
+        {
+            mpiDomain.Gather(0);
+        }
+        else
+        {
+            GatherMpiRanges(0);
         }
+        mpiStepIndex = (int)header.step;
+        std::cout << "Restarted " << physics.numParticles << " particles at step " << mpiStepIndex << " from " << options.restartFile << std::endl;
+        return true;
     }
 
-    void UpdatePositionsMPI()
+    // New range edges for the workers, sent with the next step command
+    void RebalanceMpiRanges()
     {
-        int chunk_size = physics.numParticles / mpiWorkersCount;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        std::vector<double> workerSeconds(mpiComputeSeconds.begin() + 1, mpiComputeSeconds.end());
+        if (!mpiBalancer.Measure(workerSeconds)) return;
+
+        std::vector<std::pair<float, int>> elements(physics.numParticles);
+        for (int worker = 0; worker < mpiWorkersCount; worker++)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            for (unsigned int index = mpiRangeEdges[worker + 1]; index < mpiRangeEdges[worker + 2]; index++)
+            {
+                elements[index] = { (float)index, worker };
+            }
+        }
 
-            MPI_Ssend(&physics.boundsSize, 2, MPI_FLOAT, i + 1, 27, MPI_COMM_WORLD);
-            MPI_Ssend(&physics.collisionDamping, 1, MPI_FLOAT, i + 1, 28, MPI_COMM_WORLD);
+        std::vector<double> cuts(mpiRangeEdges.begin() + 1, mpiRangeEdges.end());
+        mpiBalancer.Rebalance(cuts, elements, 1);
+        std::vector<unsigned int> previousEdges = mpiRangeEdges;
+        for (int edge = 1; edge < mpiWorkersCount; edge++)
+        {
+            mpiRangeEdges[edge + 1] = (unsigned int)std::lround(cuts[edge]);
         }
+        MpiRangeLayout(mpiRangeEdges, 1, mpiCounts, mpiDisplacements);
 
-        MPI_Status status;
-        for (int i = 0; i < mpiWorkersCount; i++)
+        // The workers drop their gather references when they get the new edges
+        if (mpiRangeEdges != previousEdges)
         {
-            int start = i * chunk_size;
-            int end = (i == mpiWorkersCount - 1) ? physics.numParticles : (i + 1) * chunk_size;
-            int actualChunkSize = end - start;
+            mpiGatherPositionCodec.Reset();
+            mpiGatherVelocityCodec.Reset();
+        }
+    }
+
+    // Rank 0 of transport, the other ranks run MpiWorker. Call before Start.
+    void SetTransport(Transport* transport)
+    {
+        mpiTransport = transport;
+        mpiWorkersCount = transport->Size() - 1;
+    }
+
+    // Lets the workers leave MpiWorker::Run, call before MPI_Finalize
+    void StopMpiWorkers()
+    {
+        int command[3] = { MpiCommandQuit, 0, mpiParameterVersion };
+        mpiTransport->Broadcast(command, sizeof(command), 0);
+    }
 
-            MPI_Recv(physics.Positions.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 29, MPI_COMM_WORLD, &status);
-            MPI_Recv(physics.Velocities.data() + start, actualChunkSize * 2, MPI_FLOAT, i + 1, 30, MPI_COMM_WORLD, &status);
+    // Sends a command to the workers, followed by the parameters if any of them changed since
+    // the last command (the sliders moved, a new time step or interaction input)
+    void BroadcastMpiCommand(MpiCommand command, int argument)
+    {
+        PhysicsParameters parameters;
+        parameters.Read(physics);
+        bool changed = mpiParameterVersion == 0 || parameters != mpiParameters;
+        if (changed)
+        {
+            mpiParameters = parameters;
+            mpiParameterVersion++;
+        }
+
+        int message[3] = { command, argument, mpiParameterVersion };
+        mpiTransport->Broadcast(message, sizeof(message), 0);
+        if (changed)
+        {
+            mpiTransport->Broadcast(&mpiParameters, sizeof(mpiParameters), 0);
         }
     }
 #endif
 
-    void UpdateSettings(GLFWwindow* window, float deltaTime)
+    void UpdateSettings(float deltaTime)
     {
-        
+
         physics.Poly6ScalingFactor = 4 / (M_PI * pow(physics.smoothingRadius, 8));
         physics.SpikyPow3ScalingFactor = 10 / (M_PI * pow(physics.smoothingRadius, 5));
         physics.SpikyPow2ScalingFactor = 6 / (M_PI * pow(physics.smoothingRadius, 4));
@@ -394,24 +1079,28 @@ struct Simulation
         physics.SpikyPow2DerivativeScalingFactor = 12 / (pow(physics.smoothingRadius, 4) * M_PI);
 
         // Mouse interaction settings:
-        Float2 mousePos = { ImGui::GetMousePos().x, ImGui::GetMousePos().y };
-        bool isPullInteraction = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
-        bool isPushInteraction = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
         float currInteractStrength = 0;
-        if (isPushInteraction || isPullInteraction)
+        if (input.isPushInteraction || input.isPullInteraction)
         {
-            currInteractStrength = isPushInteraction ? -physics.interactionInputStrength : physics.interactionInputStrength;
+            currInteractStrength = input.isPushInteraction ? -physics.interactionInputStrength : physics.interactionInputStrength;
         }
 
-        physics.interactionInputPoint = mousePos;
+        physics.interactionInputPoint = input.mousePosition;
         physics.currentInteractionInputStrength = currInteractStrength;
     }
 
-    void SetInitialBufferData(ParticleSpawnData spawnData)
+    // Writes every buffer in [start, end), the buffers are left uninitialised by ResizeBuffers
+    void SetInitialBufferData(const ParticleSpawnData& spawnData, int start, int end)
     {
-        physics.Positions = spawnData.positions;
-        physics.PredictedPositions = spawnData.positions;
-        physics.Velocities = spawnData.velocities;
+        for (int i = start; i < end; i++)
+        {
+            physics.Positions[i] = spawnData.positions[i];
+            physics.PredictedPositions[i] = spawnData.positions[i];
+            physics.Velocities[i] = spawnData.velocities[i];
+            physics.Densities[i] = 0;
+            physics.SpatialIndices[i] = { 0, 0, 0 };
+            physics.SpatialOffsets[i] = physics.numParticles;
+        }
     }
 
     void HandleInput()
@@ -471,14 +1160,54 @@ struct Simulation
 
     Physics physics;
     ParticleSpawner spawner;
+    SimulationInput input;
+    SimulationOptions options;
 #if !RUN_MPI
     ThreadPool pool;
+    bool topologyReported = false; // with options.pinWorkerThreads
+    std::unique_ptr<Executor> executor;
+    ThreadCountTuner tuner;
+    TaskGraph stepGraph;
+    std::vector<std::vector<int>> tileNeighbours;
+    int taskTileSize = 256;
+    ParticleBuffer<Float2> stepStartVelocities; // with options.adaptiveTimeStep
+    std::vector<ParticleMotion> tileMotions;    // since the last frame
+    ParticleSleep particleSleep;                // with options.particleSleep
+    ImplicitPressureSolver implicitSolver;      // with PressureSolver::Implicit
+    PositionBasedSolver positionBasedSolver;    // with PressureSolver::PositionBased
+    int pressureReportInterval = 600;           // steps between two solver reports
+    MultiRateForces multiRateForces;            // with options.viscosityInterval or externalForceInterval
+    BlockTimeSteps blockTimeSteps;              // with options.blockTimeSteps
+    int multiRateReportInterval = 600;          // steps between two multi-rate error reports
+    int multiRateStepsSinceReport = 0;
+    int pressureStepsSinceReport = 0;
 #else
+    Transport* mpiTransport = nullptr; // to the workers, over MPI or in-process (see SetTransport)
     int mpiWorkersCount = 0;
+    MpiDomain mpiDomain{ physics };
+    int mpiReportInterval = 600; // steps between two wait time reports
+    std::vector<unsigned int> mpiRangeEdges; // replicated mode, moved by the load balancer
+    std::vector<double> mpiComputeSeconds;
+    MpiLoadBalancer mpiBalancer;
+    int mpiStepsSinceReport = 0;
+    int mpiStepIndex = 0; // steps run since the start, or since the start of the restored run
+    std::vector<int> mpiCounts; // Float2 range layout of all ranks for the *v collectives
+    std::vector<int> mpiDisplacements;
+    PhysicsParameters mpiParameters; // as last sent to the workers
+    int mpiParameterVersion = 0;     // 0 before the first send
+    ParticleMotion mpiMotion; // of the workers since the last frame, with options.adaptiveTimeStep
+    MpiWireCodec mpiGatherPositionCodec{ MpiWireCodec::Kind::Position, true }; // with options.mpiWireEncoding
+    MpiWireCodec mpiGatherVelocityCodec{ MpiWireCodec::Kind::Float, true };
 #endif
 
     float timeScale = 1;
     int iterationsPerFrame = 1;
+    TimeStepController timeStepController; // with options.adaptiveTimeStep
+    int timeStepReportInterval = 600;      // frames between two time step reports
+    float frameTimeStep = 0;               // step and substeps of the last frame
+    int frameSubsteps = 0;
+    FixedStepClock fixedStepClock;         // with options.fixedTimeStep
+    std::vector<Float2> previousPositions; // before the last fixed step
 
      //ParticleDisplay2D display; ????
 
@@ -0,0 +1,241 @@
+#include "SimulationOptions.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static const char* mpiModeNames[] = { "replicated", "domain" };
+static const char* pressureSolverNames[] = { "wcsph", "iisph", "pbf" };
+
+const char* MpiModeName(MpiMode mode)
+{
+    return mpiModeNames[(int)mode];
+}
+
+bool ParseMpiMode(const char* name, MpiMode& mode)
+{
+    for (int i = 0; i < (int)(sizeof(mpiModeNames) / sizeof(mpiModeNames[0])); i++)
+    {
+        if (strcmp(name, mpiModeNames[i]) == 0)
+        {
+            mode = (MpiMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* PressureSolverName(PressureSolver solver)
+{
+    return pressureSolverNames[(int)solver];
+}
+
+bool ParsePressureSolver(const char* name, PressureSolver& solver)
+{
+    for (int i = 0; i < (int)(sizeof(pressureSolverNames) / sizeof(pressureSolverNames[0])); i++)
+    {
+        if (strcmp(name, pressureSolverNames[i]) == 0)
+        {
+            solver = (PressureSolver)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SimulationOptions::Parse(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* argument = argv[i];
+        if (strcmp(argument, "--pin-threads") == 0)
+        {
+            pinWorkerThreads = true;
+        }
+        else if (strcmp(argument, "--numa-first-touch") == 0)
+        {
+            pinWorkerThreads = true;
+            numaFirstTouch = true;
+        }
+        else if (strcmp(argument, "--executor") == 0 && i + 1 < argc)
+        {
+            if (!ParseExecutorBackend(argv[++i], executorBackend))
+            {
+                std::cerr << "Unknown executor: " << argv[i] << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--no-thread-tuning") == 0)
+        {
+            adaptiveThreads = false;
+        }
+        else if (strcmp(argument, "--thread-calibration") == 0 && i + 1 < argc)
+        {
+            calibrationFile = argv[++i];
+        }
+        else if (strcmp(argument, "--mpi-mode") == 0 && i + 1 < argc)
+        {
+            if (!ParseMpiMode(argv[++i], mpiMode))
+            {
+                std::cerr << "Unknown MPI mode: " << argv[i] << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--worker-threads") == 0 && i + 1 < argc)
+        {
+            mpiWorkerThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--no-mpi-overlap") == 0)
+        {
+            mpiOverlap = false;
+        }
+        else if (strcmp(argument, "--no-mpi-shared-memory") == 0)
+        {
+            mpiSharedMemory = false;
+        }
+        else if (strcmp(argument, "--no-load-balancing") == 0)
+        {
+            mpiLoadBalancing = false;
+        }
+        else if (strcmp(argument, "--mpi-wire-encoding") == 0)
+        {
+            mpiWireEncoding = true;
+        }
+        else if (strcmp(argument, "--mpi-wire-mantissa-bits") == 0 && i + 1 < argc)
+        {
+            mpiWireMantissaBits = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--adaptive-time-step") == 0)
+        {
+            adaptiveTimeStep = true;
+        }
+        else if (strcmp(argument, "--block-time-steps") == 0)
+        {
+            blockTimeSteps = true;
+            adaptiveTimeStep = true;
+        }
+        else if (strcmp(argument, "--cfl") == 0 && i + 1 < argc)
+        {
+            float cfl = (float)atof(argv[++i]);
+            if (cfl > 0)
+            {
+                cflNumber = cfl;
+            }
+            else
+            {
+                std::cerr << "--cfl must be positive, keeping " << cflNumber << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--time-step-range") == 0 && i + 2 < argc)
+        {
+            float minStep = (float)atof(argv[++i]);
+            float maxStep = (float)atof(argv[++i]);
+            if (minStep > 0 && minStep <= maxStep)
+            {
+                minTimeStep = minStep;
+                maxTimeStep = maxStep;
+            }
+            else
+            {
+                std::cerr << "--time-step-range needs 0 < min <= max, keeping " << minTimeStep << " " << maxTimeStep << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--max-substeps") == 0 && i + 1 < argc)
+        {
+            int substeps = atoi(argv[++i]);
+            if (substeps >= 1)
+            {
+                maxSubsteps = substeps;
+            }
+            else
+            {
+                std::cerr << "--max-substeps must be at least 1, keeping " << maxSubsteps << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--fixed-time-step") == 0 && i + 1 < argc)
+        {
+            fixedTimeStep = (float)atof(argv[++i]);
+            if (!(fixedTimeStep >= 0))
+            {
+                std::cerr << "--fixed-time-step must not be negative, fixed time steps are off" << std::endl;
+                fixedTimeStep = 0;
+            }
+        }
+        else if (strcmp(argument, "--max-catch-up-steps") == 0 && i + 1 < argc)
+        {
+            maxCatchUpSteps = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--pressure-solver") == 0 && i + 1 < argc)
+        {
+            if (!ParsePressureSolver(argv[++i], pressureSolver))
+            {
+                std::cerr << "Unknown pressure solver: " << argv[i] << std::endl;
+            }
+        }
+        else if (strcmp(argument, "--pressure-iterations") == 0 && i + 1 < argc)
+        {
+            pressureIterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--particle-sleep") == 0)
+        {
+            particleSleep = true;
+        }
+        else if (strcmp(argument, "--sleep-speed") == 0 && i + 1 < argc)
+        {
+            sleepSpeed = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argument, "--sleep-steps") == 0 && i + 1 < argc)
+        {
+            sleepSteps = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--viscosity-interval") == 0 && i + 1 < argc)
+        {
+            viscosityInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--external-force-interval") == 0 && i + 1 < argc)
+        {
+            externalForceInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--multi-rate-extrapolate") == 0)
+        {
+            multiRateExtrapolate = true;
+        }
+        else if (strcmp(argument, "--multi-rate-tolerance") == 0 && i + 1 < argc)
+        {
+            multiRateTolerance = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argument, "--in-process-ranks") == 0 && i + 1 < argc)
+        {
+            inProcessRanks = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--headless") == 0 && i + 1 < argc)
+        {
+            headlessSteps = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--time-step") == 0 && i + 1 < argc)
+        {
+            headlessTimeStep = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argument, "--snapshot-every") == 0 && i + 1 < argc)
+        {
+            snapshotInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--snapshot-prefix") == 0 && i + 1 < argc)
+        {
+            snapshotPrefix = argv[++i];
+        }
+        else if (strcmp(argument, "--checkpoint-every") == 0 && i + 1 < argc)
+        {
+            checkpointInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argument, "--checkpoint-prefix") == 0 && i + 1 < argc)
+        {
+            checkpointPrefix = argv[++i];
+        }
+        else if (strcmp(argument, "--restart") == 0 && i + 1 < argc)
+        {
+            restartFile = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << argument << std::endl;
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include "Executor.h"
+
+enum class MpiMode
+{
+    Replicated, // every worker gets all particles and updates an index range of them
+    Domain      // every worker owns the particles of a spatial slab (see MpiDomain)
+};
+
+const char* MpiModeName(MpiMode mode);
+bool ParseMpiMode(const char* name, MpiMode& mode);
+
+enum class PressureSolver
+{
+    WeaklyCompressible, // pressure from the density by an equation of state
+    Implicit,           // pressures solved for a divergence-free step (see ImplicitPressureSolver)
+    PositionBased       // density constraints on the positions (see PositionBasedSolver)
+};
+
+const char* PressureSolverName(PressureSolver solver);
+bool ParsePressureSolver(const char* name, PressureSolver& solver);
+
+// Start-up options of the simulation, set from the command line
+struct SimulationOptions
+{
+    // Pin every thread pool worker to its own logical cpu and print the placement at start-up
+    // (--pin-threads)
+    bool pinWorkerThreads = false;
+    // Let every worker initialise the particle buffer tiles it owns, so their pages are
+    // allocated on that worker's NUMA node (implies pinned workers)
+    bool numaFirstTouch = false;
+    // Runtime used for the CPU-parallel simulation step (--executor taskgraph|pool|openmp|parallel-stl)
+    ExecutorBackend executorBackend = ExecutorBackend::TaskGraph;
+    // Time every stage with different worker counts during the first steps and keep the fastest
+    // (--no-thread-tuning uses all workers everywhere)
+    bool adaptiveThreads = true;
+    // Where the chosen worker counts are kept between runs (--thread-calibration <file>)
+    std::string calibrationFile = "thread_calibration.txt";
+    // How the MPI build splits the work between the ranks (--mpi-mode replicated|domain)
+    MpiMode mpiMode = MpiMode::Replicated;
+    // Compute the interior of a slab while its halo is in flight (--no-mpi-overlap to compare)
+    bool mpiOverlap = true;
+    // Ranks on one node share their particle buffers in the replicated mode (--no-mpi-shared-memory to compare)
+    bool mpiSharedMemory = true;
+    // Move the work between the MPI workers by their measured compute time (--no-load-balancing to compare)
+    bool mpiLoadBalancing = true;
+    // Send the particle fields between MPI ranks quantised and delta coded instead of as raw
+    // floats, positions within 1/131072 of the smoothing radius (--mpi-wire-encoding, see MpiWireCodec)
+    bool mpiWireEncoding = false;
+    // Mantissa bits the wire encoding keeps of velocities and densities, 23 is lossless, fewer
+    // round them to a relative error of 2^-(bits + 1) (--mpi-wire-mantissa-bits <n>)
+    int mpiWireMantissaBits = 23;
+    // Pool threads of every MPI worker, -1 shares the node's cpus between its ranks (--worker-threads <n>)
+    int mpiWorkerThreads = -1;
+
+    // Run the MPI workers as this many ranks in one process instead of MPI processes, for
+    // testing without mpirun, 0 for MPI (--in-process-ranks <n>, including rank 0)
+    int inProcessRanks = 0;
+    // Split every frame into as many steps as the particle speeds and accelerations need,
+    // instead of a fixed number (--adaptive-time-step, see TimeStepController)
+    bool adaptiveTimeStep = false;
+    // Smoothing radii a particle may travel per adaptive step (--cfl <number>)
+    float cflNumber = 0.4f;
+    // Hard bounds of the adaptive step in seconds (--time-step-range <min> <max>)
+    float minTimeStep = 0.0005f;
+    float maxTimeStep = 1.0f / 60.0f;
+    // Most adaptive steps per frame (--max-substeps <n>)
+    int maxSubsteps = 8;
+    // Threaded build, with the weakly compressible solver: let every particle take its own power
+    // of two multiple of the adaptive step, only the particles starting a step run the force
+    // passes (--block-time-steps, implies --adaptive-time-step, see BlockTimeSteps)
+    bool blockTimeSteps = false;
+    // Step the window mode with this many seconds per step, as many steps as the elapsed time
+    // needs, and draw the particles blended between the last two steps; 0 steps once per frame
+    // with the frame time (--fixed-time-step <seconds>, see FixedStepClock)
+    float fixedTimeStep = 0;
+    // Most fixed steps per frame, the time beyond is dropped (--max-catch-up-steps <n>)
+    int maxCatchUpSteps = 5;
+    // Threaded build: how the pressure is computed (--pressure-solver wcsph|iisph|pbf)
+    PressureSolver pressureSolver = PressureSolver::WeaklyCompressible;
+    // Jacobi iterations of the implicit and position based solvers per step (--pressure-iterations <n>)
+    int pressureIterations = 4;
+    // Threaded build: stop the particles of settled regions and skip them in the force passes
+    // until motion nearby wakes them, not with the position based solver (--particle-sleep,
+    // see ParticleSleep)
+    bool particleSleep = false;
+    // Particles slower than this count as calm (--sleep-speed <speed>)
+    float sleepSpeed = 2.0f;
+    // Steps a cell must stay calm before the particles around it sleep (--sleep-steps <n>)
+    int sleepSteps = 30;
+    // Threaded build: evaluate the viscosity and the external forces only every this many steps
+    // and reuse them in between, not with the position based solver (--viscosity-interval <n>,
+    // --external-force-interval <n>, see MultiRateForces)
+    int viscosityInterval = 1;
+    int externalForceInterval = 1;
+    // Extrapolate the skipped forces from their last two evaluations instead of holding the last
+    // (--multi-rate-extrapolate)
+    bool multiRateExtrapolate = false;
+    // Relative error of a skipped force above which its interval is halved, 0 keeps the
+    // intervals (--multi-rate-tolerance <fraction>)
+    float multiRateTolerance = 0;
+
+    // Run this many steps without a window and exit, 0 opens the window (--headless <steps>)
+    int headlessSteps = 0;
+    // Fixed time step of a headless run in seconds (--time-step <seconds>)
+    float headlessTimeStep = 1.0f / 60.0f;
+    // Write the particles every this many headless steps, 0 for none (--snapshot-every <steps>)
+    int snapshotInterval = 0;
+    // Snapshots go to <prefix>_<step>.csv (--snapshot-prefix <prefix>)
+    std::string snapshotPrefix = "snapshot";
+    // MPI build: every rank writes its particles into a shared checkpoint file every this many
+    // headless steps, 0 for none (--checkpoint-every <steps>, see MpiCheckpoint)
+    int checkpointInterval = 0;
+    // Checkpoints go to <prefix>_<step>.chk (--checkpoint-prefix <prefix>)
+    std::string checkpointPrefix = "checkpoint";
+    // MPI build: start from this checkpoint instead of the spawner, with any number of ranks
+    // (--restart <file>)
+    std::string restartFile;
+
+    void Parse(int argc, char** argv);
+};
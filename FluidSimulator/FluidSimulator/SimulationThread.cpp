@@ -0,0 +1,170 @@
+#include "SimulationThread.h"
+#include <algorithm>
+#include <chrono>
+
+SimulationThread::SimulationThread(Simulation& simulation) : simulation(simulation)
+{
+}
+
+SimulationThread::~SimulationThread()
+{
+    Stop();
+}
+
+void SimulationThread::Start()
+{
+    if (running) return;
+    running = true;
+    thread = std::thread([this]() { Run(); });
+}
+
+void SimulationThread::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(inputMutex);
+        running = false;
+    }
+    inputArrived.notify_one();
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void SimulationThread::PushInput(const SimulationInput& input)
+{
+    {
+        std::unique_lock<std::mutex> lock(inputMutex);
+        inputs.push(input);
+    }
+    inputArrived.notify_one();
+}
+
+void SimulationThread::ApplyInputs()
+{
+    bool restart = false;
+    bool settingsChanged = false;
+    bool hasInput = false;
+    SimulationInput latest;
+    {
+        std::unique_lock<std::mutex> lock(inputMutex);
+        while (!inputs.empty())
+        {
+            // Only the latest mouse state and settings matter, but no restart may be lost
+            latest = inputs.front();
+            restart = restart || latest.restart;
+            settingsChanged = settingsChanged || latest.settingsChanged;
+            hasInput = true;
+            inputs.pop();
+        }
+    }
+
+    if (!hasInput) return;
+
+    simulation.input = latest;
+    if (settingsChanged)
+    {
+        simulation.input.settings.Apply(simulation.physics);
+    }
+    if (restart)
+    {
+        simulation.Start();
+    }
+}
+
+bool SimulationThread::StepFrame(float deltaTime)
+{
+    ApplyInputs();
+
+    auto start = std::chrono::steady_clock::now();
+    bool moved = simulation.Update(deltaTime);
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Without a new step the renderer keeps blending the last snapshot by its own clock
+    if (moved)
+    {
+        PublishSnapshot(elapsed.count());
+    }
+    return moved;
+}
+
+void SimulationThread::StepInline(float deltaTime)
+{
+    StepFrame(deltaTime);
+}
+
+void SimulationThread::Run()
+{
+    auto previous = std::chrono::steady_clock::now();
+    while (running)
+    {
+        // The simulation advances by its own wall clock, independent of the render frame rate
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<float> deltaTime = now - previous;
+        previous = now;
+
+        bool moved = StepFrame(deltaTime.count());
+
+        // In the fixed time step mode there is nothing to do before the next step is due, and
+        // nothing at all while nothing moves, until the window sends new input
+        float wait = simulation.TimeToNextFixedStep();
+        if (!moved && wait <= 0)
+        {
+            wait = IdleWait;
+        }
+        if (wait > 0)
+        {
+            std::unique_lock<std::mutex> lock(inputMutex);
+            inputArrived.wait_for(lock, std::chrono::duration<float>(wait), [this]() { return !inputs.empty() || !running; });
+        }
+    }
+}
+
+void SimulationThread::PublishSnapshot(float frameMilliseconds)
+{
+    SimulationSnapshot& snapshot = snapshots[backSnapshot];
+    snapshot.positions.assign(simulation.physics.Positions.begin(), simulation.physics.Positions.end());
+    snapshot.velocities.assign(simulation.physics.Velocities.begin(), simulation.physics.Velocities.end());
+    snapshot.interactionInputPoint = simulation.physics.interactionInputPoint;
+    snapshot.interactionInputRadius = simulation.physics.interactionInputRadius;
+    snapshot.frameMilliseconds = frameMilliseconds;
+    snapshot.timeStep = simulation.frameTimeStep;
+    snapshot.substeps = simulation.frameSubsteps;
+    snapshot.sleepingParticles = simulation.SleepingParticles();
+    snapshot.backendName = simulation.BackendName();
+    snapshot.frameIndex = ++publishedFrames;
+
+    const FixedStepClock& clock = simulation.fixedStepClock;
+    bool blended = simulation.options.fixedTimeStep > 0 && simulation.previousPositions.size() == simulation.physics.Positions.size();
+    if (blended)
+    {
+        snapshot.previousPositions.assign(simulation.previousPositions.begin(), simulation.previousPositions.end());
+    }
+    snapshot.fixedTimeStep = blended ? clock.Step() : 0;
+    snapshot.accumulatedTime = clock.Accumulated();
+    snapshot.timeScale = simulation.timeScale;
+    snapshot.droppedTime = clock.DroppedTime();
+    snapshot.publishTime = std::chrono::steady_clock::now();
+
+    backSnapshot = middleSnapshot.exchange(backSnapshot | SnapshotFreshBit, std::memory_order_acq_rel) & ~SnapshotFreshBit;
+}
+
+const SimulationSnapshot& SimulationThread::AcquireLatestSnapshot()
+{
+    if (middleSnapshot.load(std::memory_order_acquire) & SnapshotFreshBit)
+    {
+        frontSnapshot = middleSnapshot.exchange(frontSnapshot, std::memory_order_acq_rel) & ~SnapshotFreshBit;
+    }
+    return snapshots[frontSnapshot];
+}
+
+float SimulationSnapshot::InterpolationWeight(std::chrono::steady_clock::time_point now) const
+{
+    if (fixedTimeStep <= 0) return 1;
+
+    // The drawing runs one step behind the simulation: the time collected towards the next
+    // step is how far it is past previousPositions
+    std::chrono::duration<float> sincePublish = now - publishTime;
+    float weight = (accumulatedTime + sincePublish.count() * timeScale) / fixedTimeStep;
+    return std::max(0.0f, std::min(1.0f, weight));
+}
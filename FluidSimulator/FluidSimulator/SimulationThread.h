@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "Simulation.h"
+
+// Copy of the particle state taken after a finished frame, used for rendering
+struct SimulationSnapshot
+{
+    std::vector<Float2> positions;
+    std::vector<Float2> velocities;
+    Float2 interactionInputPoint;
+    float interactionInputRadius = 0;
+    float frameMilliseconds = 0;
+    float timeStep = 0;
+    int substeps = 0;
+    unsigned int sleepingParticles = 0;
+    const char* backendName = "";
+    unsigned int frameIndex = 0;
+
+    // Fixed time step mode: the positions one step before, and what it takes to tell how far
+    // the drawing is between them (fixedTimeStep is 0 otherwise)
+    std::vector<Float2> previousPositions;
+    float fixedTimeStep = 0;
+    float accumulatedTime = 0; // towards the next step when published
+    float timeScale = 1;
+    double droppedTime = 0; // by the catch-up budget since the start
+    std::chrono::steady_clock::time_point publishTime;
+
+    // Blend weight of positions against previousPositions at the given time, 1 draws positions
+    float InterpolationWeight(std::chrono::steady_clock::time_point now) const;
+};
+
+// Runs the simulation on its own thread so rendering and physics overlap.
+// Input goes to the simulation through a queue, finished frames come back through a
+// triple buffer: the simulation fills the back snapshot and swaps it with the middle one,
+// the renderer swaps the middle one with its front snapshot whenever a new frame is ready.
+// Neither side ever waits for the other. When a frame moved nothing (paused, or no fixed step
+// due) the thread waits for the next fixed step, new input, or IdleWait seconds otherwise.
+class SimulationThread
+{
+public:
+    SimulationThread(Simulation& simulation);
+    ~SimulationThread();
+
+    void Start();
+    void Stop();
+    bool IsRunning() const { return running; }
+
+    void PushInput(const SimulationInput& input);
+
+    // Runs one frame on the calling thread (used when the simulation thread is not running)
+    void StepInline(float deltaTime);
+
+    // Latest complete snapshot, valid until the next call
+    const SimulationSnapshot& AcquireLatestSnapshot();
+
+private:
+    static const int SnapshotFreshBit = 4;
+    static constexpr float IdleWait = 0.001f;
+
+    Simulation& simulation;
+    std::thread thread;
+    std::atomic<bool> running{ false };
+
+    std::mutex inputMutex;
+    std::condition_variable inputArrived; // also signalled by Stop
+    std::queue<SimulationInput> inputs;
+
+    SimulationSnapshot snapshots[3];
+    std::atomic<int> middleSnapshot{ 1 }; // index, plus SnapshotFreshBit if not yet acquired
+    int backSnapshot = 0;
+    int frontSnapshot = 2;
+    unsigned int publishedFrames = 0;
+
+    void Run();
+    void ApplyInputs();
+    // Returns false if the particles did not move
+    bool StepFrame(float deltaTime);
+    void PublishSnapshot(float frameMilliseconds);
+};
@@ -0,0 +1,266 @@
+#include "TaskGraph.h"
+#include <chrono>
+
+int TaskGraph::AddStage(const std::string& name, int tileCount, std::function<void(int)> run, std::vector<TaskDependency> dependencies)
+{
+    stages.push_back({ name, tileCount, std::move(run), std::move(dependencies), false });
+    return (int)stages.size() - 1;
+}
+
+void TaskGraph::SetNeighbourhoodProvider(int stage, std::vector<std::vector<int>>* tileNeighbours)
+{
+    neighbourhoodStage = stage;
+    this->tileNeighbours = tileNeighbours;
+}
+
+void TaskGraph::SetStageAffinity(int stage, bool ownerAffinity)
+{
+    stages[stage].ownerAffinity = ownerAffinity;
+}
+
+void TaskGraph::Clear()
+{
+    stages.clear();
+    neighbourhoodStage = -1;
+    tileNeighbours = nullptr;
+}
+
+void TaskGraph::Prepare()
+{
+    nodes.clear();
+    stageFirstNode.resize(stages.size());
+    stageRemaining.resize(stages.size());
+    barrierDependents.assign(stages.size(), std::vector<int>());
+    completedNodes = 0;
+
+    for (int s = 0; s < (int)stages.size(); s++)
+    {
+        stageFirstNode[s] = (int)nodes.size();
+        stageRemaining[s] = stages[s].tileCount;
+        for (int t = 0; t < stages[s].tileCount; t++)
+        {
+            nodes.push_back({ s, t, 0, false, {} });
+        }
+    }
+
+    for (int s = 0; s < (int)stages.size(); s++)
+    {
+        for (const TaskDependency& dependency : stages[s].dependencies)
+        {
+            if (dependency.kind == TaskDependencyKind::AllTiles)
+            {
+                barrierDependents[dependency.stage].push_back(s);
+            }
+
+            for (int t = 0; t < stages[s].tileCount; t++)
+            {
+                int node = stageFirstNode[s] + t;
+                if (dependency.kind == TaskDependencyKind::SameTile)
+                {
+                    if (t >= stages[dependency.stage].tileCount) continue;
+                    nodes[stageFirstNode[dependency.stage] + t].successors.push_back(node);
+                }
+                // AllTiles waits for the stage counter, (Reverse)Neighbourhood waits for the
+                // neighbour table to be published - both hold one pending token until then
+                nodes[node].pending++;
+            }
+        }
+    }
+}
+
+// Called with the lock held once every tile of the neighbourhood provider has finished
+void TaskGraph::PublishNeighbourhood(std::vector<int>& ready)
+{
+    const std::vector<std::vector<int>>& forward = *tileNeighbours;
+    std::vector<std::vector<int>> reverse;
+
+    for (int s = 0; s < (int)stages.size(); s++)
+    {
+        for (const TaskDependency& dependency : stages[s].dependencies)
+        {
+            if (dependency.kind != TaskDependencyKind::Neighbourhood && dependency.kind != TaskDependencyKind::ReverseNeighbourhood) continue;
+
+            if (dependency.kind == TaskDependencyKind::ReverseNeighbourhood && reverse.empty())
+            {
+                reverse.resize(forward.size());
+                for (int t = 0; t < (int)forward.size(); t++)
+                {
+                    for (int u : forward[t])
+                    {
+                        if (u < (int)reverse.size()) reverse[u].push_back(t);
+                    }
+                }
+            }
+            const std::vector<std::vector<int>>& table = dependency.kind == TaskDependencyKind::Neighbourhood ? forward : reverse;
+
+            for (int t = 0; t < stages[s].tileCount; t++)
+            {
+                int node = stageFirstNode[s] + t;
+                if (t < (int)table.size())
+                {
+                    for (int u : table[t])
+                    {
+                        if (u >= stages[dependency.stage].tileCount) continue;
+                        int producer = stageFirstNode[dependency.stage] + u;
+                        // Producers that already finished have nothing left to signal
+                        if (nodes[producer].done) continue;
+                        nodes[producer].successors.push_back(node);
+                        nodes[node].pending++;
+                    }
+                }
+
+                if (--nodes[node].pending == 0)
+                {
+                    ready.push_back(node);
+                }
+            }
+        }
+    }
+}
+
+void TaskGraph::Dispatch(const std::vector<int>& ready)
+{
+    std::vector<int> launch;
+    {
+        std::unique_lock<std::mutex> lock(m);
+        readyQueue.insert(readyQueue.end(), ready.begin(), ready.end());
+        while (!readyQueue.empty() && (concurrencyLimit <= 0 || inFlight < concurrencyLimit))
+        {
+            launch.push_back(readyQueue.front());
+            readyQueue.pop_front();
+            inFlight++;
+        }
+    }
+
+    for (int node : launch)
+    {
+        const TaskStage& stage = stages[nodes[node].stage];
+        if (pool->size() > 0 && stage.ownerAffinity)
+        {
+            int owner = OwnerOfTile(nodes[node].tile, stage.tileCount, pool->size());
+            pool->enqueueFunctionOn(owner, [this, node]() { Execute(node); });
+        }
+        else if (pool->size() > 0)
+        {
+            pool->enqueueFunction([this, node]() { Execute(node); });
+        }
+        else
+        {
+            inlineQueue.push_back(node);
+        }
+    }
+}
+
+void TaskGraph::Execute(int node)
+{
+    int stage = nodes[node].stage;
+    stages[stage].run(nodes[node].tile);
+
+    std::vector<int> ready;
+    {
+        std::unique_lock<std::mutex> lock(m);
+        nodes[node].done = true;
+        completedNodes++;
+        inFlight--;
+
+        for (int successor : nodes[node].successors)
+        {
+            if (--nodes[successor].pending == 0)
+            {
+                ready.push_back(successor);
+            }
+        }
+
+        if (--stageRemaining[stage] == 0)
+        {
+            for (int dependent : barrierDependents[stage])
+            {
+                for (int t = 0; t < stages[dependent].tileCount; t++)
+                {
+                    if (--nodes[stageFirstNode[dependent] + t].pending == 0)
+                    {
+                        ready.push_back(stageFirstNode[dependent] + t);
+                    }
+                }
+            }
+
+            if (stage == neighbourhoodStage && tileNeighbours != nullptr)
+            {
+                PublishNeighbourhood(ready);
+            }
+        }
+
+        if (completedNodes == (int)nodes.size())
+        {
+            finished.notify_all();
+        }
+    }
+
+    Dispatch(ready);
+}
+
+void TaskGraph::Run(ThreadPool& pool, int concurrencyLimit)
+{
+    this->pool = &pool;
+    this->concurrencyLimit = concurrencyLimit;
+    inFlight = 0;
+    readyQueue.clear();
+    Prepare();
+    if (nodes.empty()) return;
+
+    std::vector<int> ready;
+    for (int node = 0; node < (int)nodes.size(); node++)
+    {
+        if (nodes[node].pending == 0)
+        {
+            ready.push_back(node);
+        }
+    }
+    Dispatch(ready);
+
+    if (pool.size() == 0)
+    {
+        while (!inlineQueue.empty())
+        {
+            int node = inlineQueue.front();
+            inlineQueue.pop_front();
+            Execute(node);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m);
+    finished.wait(lock, [this]() { return completedNodes == (int)nodes.size(); });
+}
+
+void TaskGraph::Run(Executor& executor, ThreadCountTuner* tuner)
+{
+    ThreadPool* dataflowPool = executor.DataflowPool();
+    if (dataflowPool != nullptr)
+    {
+        int workers = tuner != nullptr ? tuner->WorkersFor("Task Graph") : 0;
+        auto start = std::chrono::steady_clock::now();
+        Run(*dataflowPool, workers);
+        if (tuner != nullptr)
+        {
+            std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            tuner->Record("Task Graph", workers, elapsed.count());
+        }
+        return;
+    }
+
+    for (int s = 0; s < (int)stages.size(); s++)
+    {
+        // Behind barriers every stage already sees all the data it reads
+        if (s == neighbourhoodStage) continue;
+
+        int workers = tuner != nullptr ? tuner->WorkersFor(stages[s].name.c_str()) : 0;
+        auto start = std::chrono::steady_clock::now();
+        executor.ParallelFor(stages[s].tileCount, workers, stages[s].run);
+        if (tuner != nullptr)
+        {
+            std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            tuner->Record(stages[s].name.c_str(), workers, elapsed.count());
+        }
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Executor.h"
+#include "ThreadCountTuner.h"
+#include "ThreadPool.h"
+
+// How the tiles of a stage wait on the tiles of a stage they read from
+enum class TaskDependencyKind
+{
+    SameTile,             // tile t waits for tile t (element-wise data, same tiling)
+    AllTiles,             // every tile waits for the whole stage (global barrier)
+    Neighbourhood,        // tile t waits for the tiles holding the neighbours of its particles
+    ReverseNeighbourhood  // tile t waits for every tile that has t in its neighbourhood
+};
+
+struct TaskDependency
+{
+    int stage;
+    TaskDependencyKind kind;
+};
+
+struct TaskStage
+{
+    std::string name; // unique, the tuner keeps one worker count per name
+    int tileCount;
+    std::function<void(int)> run;
+    std::vector<TaskDependency> dependencies;
+    bool ownerAffinity = false; // run every tile on the worker that owns it (see OwnerOfTile)
+};
+
+// Runs a set of tiled stages on the thread pool. Instead of a full barrier between two
+// stages, every tile only waits for the tiles it actually reads from, so the tail of one
+// pass overlaps with the head of the next.
+//
+// Neighbourhood dependencies are only known once the spatial hash has been sorted, so one
+// stage is registered as the neighbourhood provider: every tile of that stage fills its own
+// entry of the tile neighbour table, and the edges are created when the whole stage is done.
+//
+// Executors without a dataflow pool run the stages one after another in the order they were
+// added (which must therefore be a valid order), with a barrier after each stage.
+//
+// With a tuner, every barrier stage runs on the worker count the tuner picks for it; as
+// dataflow, the tuner picks how many tiles may run at the same time for the whole graph.
+class TaskGraph
+{
+public:
+    int AddStage(const std::string& name, int tileCount, std::function<void(int)> run, std::vector<TaskDependency> dependencies);
+    void SetNeighbourhoodProvider(int stage, std::vector<std::vector<int>>* tileNeighbours);
+    void SetStageAffinity(int stage, bool ownerAffinity);
+    void Clear();
+    void Run(Executor& executor, ThreadCountTuner* tuner = nullptr);
+    void Run(ThreadPool& pool, int concurrencyLimit = 0);
+
+    int StageCount() const { return (int)stages.size(); }
+    const TaskStage& GetStage(int stage) const { return stages[stage]; }
+
+    // Static tile -> worker mapping, used to initialise buffers on the worker that later uses them
+    static int OwnerOfTile(int tile, int tileCount, int workerCount)
+    {
+        return (int)((long long)tile * workerCount / tileCount);
+    }
+
+private:
+    struct TaskNode
+    {
+        int stage;
+        int tile;
+        int pending;
+        bool done;
+        std::vector<int> successors;
+    };
+
+    std::vector<TaskStage> stages;
+    std::vector<int> stageFirstNode;
+    int neighbourhoodStage = -1;
+    std::vector<std::vector<int>>* tileNeighbours = nullptr;
+
+    std::vector<TaskNode> nodes;
+    std::vector<int> stageRemaining;
+    std::vector<std::vector<int>> barrierDependents; // stage -> stages waiting on all of its tiles
+    int completedNodes = 0;
+
+    ThreadPool* pool = nullptr;
+    int concurrencyLimit = 0; // tiles allowed in flight at once, 0 = no limit
+    int inFlight = 0;
+    std::deque<int> readyQueue;  // ready tiles waiting for a free slot
+    std::deque<int> inlineQueue; // used when the pool has no worker threads
+    std::mutex m;
+    std::condition_variable finished;
+
+    void Prepare();
+    void PublishNeighbourhood(std::vector<int>& ready);
+    void Dispatch(const std::vector<int>& ready);
+    void Execute(int node);
+};
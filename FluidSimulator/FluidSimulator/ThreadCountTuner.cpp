@@ -0,0 +1,142 @@
+#include "ThreadCountTuner.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+void ThreadCountTuner::Reset(int maxWorkers, const std::string& configurationKey)
+{
+    this->maxWorkers = maxWorkers;
+    this->configurationKey = configurationKey;
+    stages.clear();
+    justCalibrated = false;
+}
+
+ThreadCountTuner::StageTuning& ThreadCountTuner::GetStage(const char* stage)
+{
+    auto it = stages.find(stage);
+    if (it != stages.end()) return it->second;
+
+    StageTuning& tuning = stages[stage];
+    for (int workers = 1; workers < maxWorkers; workers *= 2)
+    {
+        tuning.candidates.push_back(workers);
+    }
+    tuning.candidates.push_back(maxWorkers > 0 ? maxWorkers : 1);
+    tuning.bestMilliseconds.assign(tuning.candidates.size(), 0.0f);
+    tuning.samples.assign(tuning.candidates.size(), 0);
+    return tuning;
+}
+
+int ThreadCountTuner::WorkersFor(const char* stage)
+{
+    StageTuning& tuning = GetStage(stage);
+    if (tuning.chosen > 0) return tuning.chosen;
+    return tuning.candidates[tuning.current];
+}
+
+void ThreadCountTuner::Record(const char* stage, int workers, float milliseconds)
+{
+    StageTuning& tuning = GetStage(stage);
+    if (tuning.chosen > 0 || tuning.candidates[tuning.current] != workers) return;
+
+    // Keep the best sample, the others are mostly disturbed by the rest of the system
+    int current = tuning.current;
+    if (tuning.samples[current] == 0 || milliseconds < tuning.bestMilliseconds[current])
+    {
+        tuning.bestMilliseconds[current] = milliseconds;
+    }
+    if (++tuning.samples[current] < SamplesPerCandidate) return;
+
+    if (++tuning.current < (int)tuning.candidates.size()) return;
+
+    int best = 0;
+    for (int i = 1; i < (int)tuning.candidates.size(); i++)
+    {
+        if (tuning.bestMilliseconds[i] < tuning.bestMilliseconds[best]) best = i;
+    }
+    tuning.chosen = tuning.candidates[best];
+    justCalibrated = IsCalibrated();
+}
+
+bool ThreadCountTuner::IsCalibrated() const
+{
+    if (stages.empty()) return false;
+    for (const auto& stage : stages)
+    {
+        if (stage.second.chosen == 0) return false;
+    }
+    return true;
+}
+
+bool ThreadCountTuner::TakeJustCalibrated()
+{
+    bool value = justCalibrated;
+    justCalibrated = false;
+    return value;
+}
+
+// One line per stage: configuration key, stage name and worker count, separated by '|'
+bool ThreadCountTuner::Load(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) return false;
+
+    bool found = false;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key, stage, workers;
+        if (!std::getline(fields, key, '|') || !std::getline(fields, stage, '|') || !std::getline(fields, workers)) continue;
+        if (key != configurationKey) continue;
+
+        // Hand-edited or damaged lines are skipped, the stage is then tuned again
+        char* end = nullptr;
+        long count = std::strtol(workers.c_str(), &end, 10);
+        while (*end == ' ' || *end == '\r') end++; // files saved with Windows line ends
+        if (end == workers.c_str() || *end != '\0' || count < 1) continue;
+
+        StageTuning& tuning = GetStage(stage.c_str());
+        tuning.chosen = (int)std::min<long>(count, std::max(1, maxWorkers));
+        found = true;
+    }
+    return found;
+}
+
+void ThreadCountTuner::Save(const std::string& path) const
+{
+    // Keep the calibrations of other configurations
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.compare(0, configurationKey.size() + 1, configurationKey + "|") != 0) lines.push_back(line);
+        }
+    }
+
+    std::ofstream file(path, std::ios::trunc);
+    for (const std::string& line : lines)
+    {
+        file << line << std::endl;
+    }
+    for (const auto& stage : stages)
+    {
+        file << configurationKey << "|" << stage.first << "|" << stage.second.chosen << std::endl;
+    }
+}
+
+std::string ThreadCountTuner::Report() const
+{
+    std::ostringstream report;
+    report << "Thread counts for " << configurationKey << ":" << std::endl;
+    for (const auto& stage : stages)
+    {
+        report << "  " << stage.first << ": ";
+        if (stage.second.chosen > 0) report << stage.second.chosen << " workers"; else report << "calibrating";
+        report << std::endl;
+    }
+    return report.str();
+}
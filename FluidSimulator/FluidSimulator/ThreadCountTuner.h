@@ -0,0 +1,46 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Picks how many workers each stage of the step runs on. During the first steps every
+// stage is timed with 1, 2, 4, ... workers up to the pool size, and the fastest count is
+// kept from then on; workers that are not used stay parked in the pool. The choice is
+// persisted per configuration (executor, pressure solver, particle count, pool size), so
+// later runs of the same configuration skip the calibration. Stages are told apart by name.
+class ThreadCountTuner
+{
+public:
+    static const int SamplesPerCandidate = 3;
+
+    void Reset(int maxWorkers, const std::string& configurationKey);
+    // Worker count to use for the next run of the stage (0 = all workers)
+    int WorkersFor(const char* stage);
+    void Record(const char* stage, int workers, float milliseconds);
+
+    bool IsCalibrated() const;
+    // True once, on the step that finished the calibration
+    bool TakeJustCalibrated();
+
+    bool Load(const std::string& path);
+    void Save(const std::string& path) const;
+    std::string Report() const;
+
+private:
+    struct StageTuning
+    {
+        std::vector<int> candidates;
+        std::vector<float> bestMilliseconds;
+        std::vector<int> samples;
+        int current = 0;
+        int chosen = 0;
+    };
+
+    int maxWorkers = 0;
+    std::string configurationKey;
+    std::map<std::string, StageTuning> stages;
+    bool justCalibrated = false;
+
+    StageTuning& GetStage(const char* stage);
+};
@@ -1,13 +1,103 @@
-#include "threadPool.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <sstream>
 
-ThreadPool::ThreadPool(int tasks)
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+static int getNumaNodeOfCpu(int cpu)
 {
+#ifdef _WIN32
+    UCHAR node;
+    if (cpu < 256 && GetNumaProcessorNode((UCHAR)cpu, &node))
+    {
+        return node;
+    }
+#elif defined(__linux__)
+    // sysfs links every cpu to its node as /sys/devices/system/cpu/cpuN/nodeM
+    for (int node = 0; node < 64; node++)
+    {
+        std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/node" + std::to_string(node);
+        if (access(path.c_str(), F_OK) == 0)
+        {
+            return node;
+        }
+    }
+#endif
+    return -1;
+}
+
+ThreadPool::ThreadPool(int tasks, bool pinThreads)
+{
+    workerQueues.resize(tasks);
+    placements.resize(tasks);
     for (int i = 0; i < tasks; i++)
     {
-        threads.push_back(std::thread([this]() { run(); }));
+        threads.push_back(std::thread([this, i]() { run(i); }));
+    }
+
+    if (pinThreads)
+    {
+        // Workers take logical cpus 1, 2, ... in the operating system's numbering and wrap
+        // around when there are more workers than cpus. Only the workers are pinned; cpu 0
+        // merely gets no worker while they fit, the thread driving the simulation stays free
+        // to run anywhere. The numbering ignores SMT siblings and NUMA nodes, so consecutive
+        // workers may share a core or sit on different nodes (topologyReport shows the nodes).
+        int cpuCount = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < tasks; i++)
+        {
+            pinThread(i, (i + 1) % cpuCount);
+        }
+    }
+}
+
+void ThreadPool::pinThread(int worker, int cpu)
+{
+    bool pinned = false;
+#ifdef _WIN32
+    if (cpu < 64)
+    {
+        pinned = SetThreadAffinityMask((HANDLE)threads[worker].native_handle(), (DWORD_PTR)1 << cpu) != 0;
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pinned = pthread_setaffinity_np(threads[worker].native_handle(), sizeof(set), &set) == 0;
+#endif
+    if (pinned)
+    {
+        placements[worker].cpu = cpu;
+        placements[worker].numaNode = getNumaNodeOfCpu(cpu);
     }
 }
 
+std::string ThreadPool::topologyReport()
+{
+    std::ostringstream report;
+    report << "Thread pool: " << threads.size() << " workers, " << std::thread::hardware_concurrency() << " logical cpus" << std::endl;
+    for (size_t i = 0; i < placements.size(); i++)
+    {
+        report << "  worker " << i << ": ";
+        if (placements[i].cpu < 0)
+        {
+            report << "not pinned" << std::endl;
+            continue;
+        }
+        report << "cpu " << placements[i].cpu << ", numa node ";
+        if (placements[i].numaNode < 0) report << "unknown"; else report << placements[i].numaNode;
+        report << std::endl;
+    }
+    return report.str();
+}
+
 ThreadPool::~ThreadPool()
 {
     {
@@ -22,8 +112,9 @@ ThreadPool::~ThreadPool()
     }
 }
 
-void ThreadPool::run()
+void ThreadPool::run(int worker)
 {
+    std::queue<std::function<void()>>& ownQueue = workerQueues[worker];
     while (true)
     {
         std::function<void()> toExecute;
@@ -31,14 +122,15 @@ void ThreadPool::run()
         {
             std::unique_lock<std::mutex> lock(m);
             safeIncrementTotalWaitingThreads();
-            cond.wait(lock, [this]() { return !q.empty() || isDone; });
+            cond.wait(lock, [this, &ownQueue]() { return !ownQueue.empty() || !q.empty() || isDone; });
             safeDecrementTotalWaitingThreads();
-            if (q.empty())
+            std::queue<std::function<void()>>& source = !ownQueue.empty() ? ownQueue : q;
+            if (source.empty())
             {
                 break;
             }
-            toExecute = std::move(q.front());
-            q.pop();
+            toExecute = std::move(source.front());
+            source.pop();
         }
 
         toExecute();
@@ -75,6 +167,39 @@ void ThreadPool::enqueueFunction(std::function<void()> func)
     cond.notify_one();
 }
 
+void ThreadPool::enqueueFunctionOn(int worker, std::function<void()> func)
+{
+    std::unique_lock<std::mutex> lock(m);
+    workerQueues[worker].push(std::move(func));
+    cond.notify_all(); // the condition variable is shared, make sure the right worker wakes up
+}
+
+void ThreadPool::runOnEachThread(std::function<void(int, int)> func)
+{
+    int workerCount = threads.size();
+    if (workerCount == 0)
+    {
+        func(0, 1);
+        return;
+    }
+
+    std::mutex doneMutex;
+    std::condition_variable done;
+    int remaining = workerCount;
+    for (int i = 0; i < workerCount; i++)
+    {
+        enqueueFunctionOn(i, [&, i]() {
+            func(i, workerCount);
+            std::unique_lock<std::mutex> lock(doneMutex);
+            remaining--;
+            done.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    done.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
 void ThreadPool::waitUntilAllThreadsWait()
 {
     while (safeGetTotalWaitingThreads() != threads.size() && !q.empty());
@@ -4,28 +4,44 @@
 #include <condition_variable>
 #include <functional>
 #include <queue>
+#include <string>
 #include <thread>
+#include <vector>
 #include <iostream>
 
+// Logical processor and NUMA node a worker runs on (-1 when unknown / not pinned)
+struct WorkerPlacement {
+    int cpu = -1;
+    int numaNode = -1;
+};
+
 class ThreadPool {
 private:
     std::mutex m;
     std::condition_variable cond;
     std::queue<std::function<void()>> q;
+    std::vector<std::queue<std::function<void()>>> workerQueues; // work only the given worker may take
     bool isDone = false;
     std::vector<std::thread> threads;
+    std::vector<WorkerPlacement> placements;
     int totalWaitingThreads = 0;
     std::mutex totalWaitingThreadsMutex;
 
-    void run();
+    void run(int worker);
+    void pinThread(int worker, int cpu);
     void safeIncrementTotalWaitingThreads();
     void safeDecrementTotalWaitingThreads();
     int safeGetTotalWaitingThreads();
 public:
     ThreadPool() {}
-    ThreadPool(int tasks);
+    ThreadPool(int tasks, bool pinThreads = false);
     ~ThreadPool();
     void enqueueFunction(std::function<void()> func);
+    void enqueueFunctionOn(int worker, std::function<void()> func);
+    // Runs func(worker, workerCount) once on every worker thread and waits for all of them
+    void runOnEachThread(std::function<void(int, int)> func);
     int size() { return threads.size(); }
+    bool isPinned() { return !placements.empty() && placements[0].cpu >= 0; }
+    std::string topologyReport();
     void waitUntilAllThreadsWait();
 };
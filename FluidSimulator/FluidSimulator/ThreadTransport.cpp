@@ -0,0 +1,219 @@
+#include "ThreadTransport.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+void ThreadTransportHub::Deliver(int group, int source, int destination, int tag, const void* data, size_t bytes)
+{
+    const char* begin = (const char*)data;
+    std::vector<char> message(begin, begin + bytes);
+    {
+        std::unique_lock<std::mutex> lock(m);
+        mailboxes[{ group, source, destination, tag }].push_back(std::move(message));
+    }
+    arrived.notify_all();
+}
+
+std::vector<char> ThreadTransportHub::Take(int group, int source, int destination, int tag)
+{
+    std::unique_lock<std::mutex> lock(m);
+    std::deque<std::vector<char>>& mailbox = mailboxes[{ group, source, destination, tag }];
+    arrived.wait(lock, [&mailbox]() { return !mailbox.empty(); });
+    std::vector<char> message = std::move(mailbox.front());
+    mailbox.pop_front();
+    return message;
+}
+
+ThreadTransport::ThreadTransport(std::shared_ptr<ThreadTransportHub> hub, int group, int rank, int size)
+    : hub(std::move(hub)), group(group), rank(rank), size(size)
+{
+}
+
+void ThreadTransport::Send(const void* data, size_t bytes, int destination, int tag)
+{
+    if (destination == NoRank) return;
+    hub->Deliver(group, rank, destination, tag, data, bytes);
+    volume.bytesSent += bytes;
+    volume.messagesSent++;
+}
+
+void ThreadTransport::Receive(void* data, size_t bytes, int source, int tag)
+{
+    if (source == NoRank) return;
+    std::vector<char> message = hub->Take(group, source, rank, tag);
+    memcpy(data, message.data(), std::min(bytes, message.size()));
+    volume.bytesReceived += message.size();
+}
+
+void ThreadTransport::SendReceive(const void* sendData, size_t sendBytes, int destination,
+    void* receiveData, size_t receiveBytes, int source, int tag)
+{
+    Send(sendData, sendBytes, destination, tag);
+    Receive(receiveData, receiveBytes, source, tag);
+}
+
+void ThreadTransport::PostSend(const void* data, size_t bytes, int destination, int tag)
+{
+    // Sends are buffered, so they are done right away
+    Send(data, bytes, destination, tag);
+}
+
+void ThreadTransport::PostReceive(void* data, size_t bytes, int source, int tag)
+{
+    postedReceives.push_back({ data, bytes, source, tag });
+}
+
+void ThreadTransport::WaitAll()
+{
+    for (const PostedReceive& receive : postedReceives)
+    {
+        Receive(receive.data, receive.bytes, receive.source, receive.tag);
+    }
+    postedReceives.clear();
+}
+
+int ThreadTransport::CreatePersistentExchange(const std::vector<PersistentMessage>& messages)
+{
+    persistentExchanges.push_back(messages);
+    return persistentExchanges.size() - 1;
+}
+
+void ThreadTransport::StartPersistentExchange(int exchange)
+{
+    for (const PersistentMessage& message : persistentExchanges[exchange])
+    {
+        if (message.send) Send(message.data, message.bytes, message.peer, message.tag);
+    }
+}
+
+void ThreadTransport::WaitPersistentExchange(int exchange)
+{
+    for (const PersistentMessage& message : persistentExchanges[exchange])
+    {
+        if (!message.send) Receive(message.data, message.bytes, message.peer, message.tag);
+    }
+}
+
+void ThreadTransport::Broadcast(void* data, size_t bytes, int root)
+{
+    if (rank != root)
+    {
+        Receive(data, bytes, root, BroadcastTag);
+        return;
+    }
+    for (int r = 0; r < size; r++)
+    {
+        if (r != root) Send(data, bytes, r, BroadcastTag);
+    }
+}
+
+void ThreadTransport::Gather(const void* sendData, size_t bytes, void* receiveData, int root)
+{
+    if (rank != root)
+    {
+        Send(sendData, bytes, root, GatherTag);
+        return;
+    }
+    for (int r = 0; r < size; r++)
+    {
+        char* block = (char*)receiveData + r * bytes;
+        if (r == root) memcpy(block, sendData, bytes);
+        else Receive(block, bytes, r, GatherTag);
+    }
+}
+
+void ThreadTransport::Gatherv(const void* sendData, int sendCount, void* receiveData,
+    const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize, int root)
+{
+    if (rank != root)
+    {
+        Send(sendData, sendCount * elementSize, root, GatherTag);
+        return;
+    }
+    for (int r = 0; r < size; r++)
+    {
+        if (r == root) continue;
+        Receive((char*)receiveData + displacements[r] * elementSize, counts[r] * elementSize, r, GatherTag);
+    }
+}
+
+void ThreadTransport::AllgathervInPlace(void* data, const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize)
+{
+    const char* own = (const char*)data + displacements[rank] * elementSize;
+    for (int r = 0; r < size; r++)
+    {
+        if (r != rank) Send(own, counts[rank] * elementSize, r, AllgatherTag);
+    }
+    for (int r = 0; r < size; r++)
+    {
+        if (r != rank) Receive((char*)data + displacements[r] * elementSize, counts[r] * elementSize, r, AllgatherTag);
+    }
+}
+
+void ThreadTransport::Barrier()
+{
+    char token = 0;
+    std::vector<char> tokens(size);
+    Gather(&token, 1, tokens.data(), 0);
+    Broadcast(&token, 1, 0);
+}
+
+void ThreadTransport::Alltoall(const void* sendData, size_t bytes, void* receiveData)
+{
+    for (int r = 0; r < size; r++)
+    {
+        if (r != rank) Send((const char*)sendData + r * bytes, bytes, r, AlltoallTag);
+    }
+    memcpy((char*)receiveData + rank * bytes, (const char*)sendData + rank * bytes, bytes);
+    for (int r = 0; r < size; r++)
+    {
+        if (r != rank) Receive((char*)receiveData + r * bytes, bytes, r, AlltoallTag);
+    }
+}
+
+bool ThreadTransport::AllSucceeded(bool succeeded)
+{
+    std::vector<char> results(size);
+    char result = succeeded ? 1 : 0;
+    Gather(&result, 1, results.data(), 0);
+    if (rank == 0)
+    {
+        result = std::find(results.begin(), results.end(), 0) == results.end() ? 1 : 0;
+    }
+    Broadcast(&result, 1, 0);
+    return result != 0;
+}
+
+bool ThreadTransport::WriteFileAll(const std::string& path, const std::vector<FileBlock>& blocks)
+{
+    bool created = true;
+    if (rank == 0)
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        created = (bool)file;
+    }
+    if (!AllSucceeded(created)) return false;
+
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    for (const FileBlock& block : blocks)
+    {
+        if (!file) break;
+        file.seekp((std::streamoff)block.offset);
+        file.write((const char*)block.data, block.bytes);
+    }
+    bool written = (bool)file;
+    file.close();
+    return AllSucceeded(written);
+}
+
+bool ThreadTransport::ReadFileAll(const std::string& path, const std::vector<FileBlock>& blocks)
+{
+    std::ifstream file(path, std::ios::binary);
+    for (const FileBlock& block : blocks)
+    {
+        if (!file) break;
+        file.seekg((std::streamoff)block.offset);
+        file.read((char*)block.data, block.bytes);
+    }
+    return AllSucceeded((bool)file);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Transport.h"
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Mailboxes shared by the in-process ranks of one or more ThreadTransport groups. A message
+// is copied in on send and handed out in order per (group, source, destination, tag), so
+// sends never block, just like buffered MPI sends.
+class ThreadTransportHub
+{
+public:
+    void Deliver(int group, int source, int destination, int tag, const void* data, size_t bytes);
+    // Blocks until a message has arrived
+    std::vector<char> Take(int group, int source, int destination, int tag);
+
+private:
+    std::mutex m;
+    std::condition_variable arrived;
+    std::map<std::array<int, 4>, std::deque<std::vector<char>>> mailboxes;
+};
+
+// Transport between threads of this process: one ThreadTransport per rank and group, all
+// ranks of a group use the same hub and group id. Collectives are built from the point to
+// point messages with the plain linear algorithms (root sends to everyone, everyone sends to
+// root), so the counted volume is what every rank really copied. Collective file access is
+// plain positioned file I/O of every rank, rank 0 creates the file.
+class ThreadTransport : public Transport
+{
+public:
+    ThreadTransport(std::shared_ptr<ThreadTransportHub> hub, int group, int rank, int size);
+
+    int Rank() const override { return rank; }
+    int Size() const override { return size; }
+    const char* Name() const override { return "in-process"; }
+
+    void Send(const void* data, size_t bytes, int destination, int tag) override;
+    void Receive(void* data, size_t bytes, int source, int tag) override;
+    void SendReceive(const void* sendData, size_t sendBytes, int destination,
+        void* receiveData, size_t receiveBytes, int source, int tag) override;
+
+    void PostSend(const void* data, size_t bytes, int destination, int tag) override;
+    void PostReceive(void* data, size_t bytes, int source, int tag) override;
+    void WaitAll() override;
+
+    int CreatePersistentExchange(const std::vector<PersistentMessage>& messages) override;
+    void StartPersistentExchange(int exchange) override;
+    void WaitPersistentExchange(int exchange) override;
+
+    void Broadcast(void* data, size_t bytes, int root) override;
+    void Gather(const void* sendData, size_t bytes, void* receiveData, int root) override;
+    void Gatherv(const void* sendData, int sendCount, void* receiveData,
+        const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize, int root) override;
+    void AllgathervInPlace(void* data, const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize) override;
+    void Alltoall(const void* sendData, size_t bytes, void* receiveData) override;
+    void Barrier() override;
+
+    bool WriteFileAll(const std::string& path, const std::vector<FileBlock>& blocks) override;
+    bool ReadFileAll(const std::string& path, const std::vector<FileBlock>& blocks) override;
+
+private:
+    // Tags of the collectives, below the ones the simulation uses
+    static const int BroadcastTag = -1;
+    static const int GatherTag = -2;
+    static const int AllgatherTag = -3;
+    static const int AlltoallTag = -4;
+
+    struct PostedReceive
+    {
+        void* data;
+        size_t bytes;
+        int source;
+        int tag;
+    };
+
+    std::shared_ptr<ThreadTransportHub> hub;
+    int group;
+    int rank;
+    int size;
+    std::vector<PostedReceive> postedReceives;
+    std::vector<std::vector<PersistentMessage>> persistentExchanges;
+
+    bool AllSucceeded(bool succeeded);
+};
@@ -0,0 +1,135 @@
+#include "TimeStepController.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+void ParticleMotion::Add(const ParticleMotion& other)
+{
+    maxSpeed = std::max(maxSpeed, other.maxSpeed);
+    maxAcceleration = std::max(maxAcceleration, other.maxAcceleration);
+}
+
+void ParticleMotion::Measure(Float2 velocity, Float2 stepStartVelocity, float deltaTime)
+{
+    // Roots only for new maxima
+    float squaredSpeed = Dot(velocity, velocity);
+    if (squaredSpeed > maxSpeed * maxSpeed)
+    {
+        maxSpeed = std::sqrt(squaredSpeed);
+    }
+
+    Float2 change = velocity - stepStartVelocity;
+    float squaredChange = Dot(change, change);
+    float maxChange = maxAcceleration * deltaTime;
+    if (deltaTime > 0 && squaredChange > maxChange * maxChange)
+    {
+        maxAcceleration = std::sqrt(squaredChange) / deltaTime;
+    }
+}
+
+ParticleMotion MeasureParticleMotion(Executor* executor, const Float2* velocities, const Float2* stepStartVelocities,
+    unsigned int start, unsigned int end, unsigned int tileSize, float deltaTime)
+{
+    ParticleMotion motion;
+    std::mutex m;
+    ParallelForRange(executor, start, end, tileSize, [&](unsigned int tileStart, unsigned int tileEnd) {
+        ParticleMotion tileMotion;
+        for (unsigned int i = tileStart; i < tileEnd; i++)
+        {
+            tileMotion.Measure(velocities[i], stepStartVelocities[i], deltaTime);
+        }
+        std::unique_lock<std::mutex> lock(m);
+        motion.Add(tileMotion);
+    });
+    return motion;
+}
+
+void TimeStepController::Reset()
+{
+    motion = ParticleMotion();
+    measured = false;
+}
+
+float TimeStepController::StableStep(float smoothingRadius) const
+{
+    float step = maxStep;
+    if (!measured) return step;
+    if (motion.maxSpeed > 0)
+    {
+        step = std::min(step, cflNumber * smoothingRadius / motion.maxSpeed);
+    }
+    if (motion.maxAcceleration > 0)
+    {
+        step = std::min(step, forceNumber * std::sqrt(smoothingRadius / motion.maxAcceleration));
+    }
+    return step;
+}
+
+int TimeStepController::PlanFrame(float frameTime, float smoothingRadius, float& step)
+{
+    float stable = StableStep(smoothingRadius);
+    float speedStep = measured && motion.maxSpeed > 0 ? cflNumber * smoothingRadius / motion.maxSpeed : maxStep;
+
+    Limit limit = stable >= maxStep ? LimitMaxStep : stable == speedStep ? LimitSpeed : LimitAcceleration;
+    // Below minStep the step is clamped anyway, and a step of 0 would ask for endless substeps
+    if (!(stable >= minStep))
+    {
+        stable = minStep;
+        limit = LimitMinStep;
+    }
+    int substeps = std::max(1, (int)std::ceil(frameTime / stable));
+    if (substeps > maxSubsteps)
+    {
+        substeps = std::max(1, maxSubsteps);
+        limit = LimitSubsteps;
+    }
+
+    step = std::min(frameTime / substeps, stable);
+    if (step < minStep)
+    {
+        step = minStep;
+        limit = LimitMinStep;
+    }
+
+    if (frames == 0 || step < smallestStep) smallestStep = step;
+    if (frames == 0 || step > largestStep) largestStep = step;
+    frames++;
+    steps += substeps;
+    simulatedTime += (double)step * substeps;
+    limits[limit]++;
+    return substeps;
+}
+
+void TimeStepController::Record(const ParticleMotion& frameMotion)
+{
+    motion = frameMotion;
+    measured = true;
+}
+
+std::string TimeStepController::Report()
+{
+    static const char* limitNames[LimitCount] = { "max step", "speed", "acceleration", "substep cap", "min step" };
+
+    std::ostringstream report;
+    report << "Time step over " << frames << " frames: " << steps << " steps";
+    if (steps > 0)
+    {
+        report << ", " << smallestStep * 1000 << " to " << largestStep * 1000 << " ms (mean "
+            << simulatedTime / steps * 1000 << " ms, " << (float)steps / frames << " per frame)";
+    }
+    report << ", max speed " << motion.maxSpeed << ", max acceleration " << motion.maxAcceleration << std::endl;
+    report << "  limited by";
+    for (int limit = 0; limit < LimitCount; limit++)
+    {
+        report << (limit > 0 ? ", " : " ") << limitNames[limit] << " " << limits[limit];
+        limits[limit] = 0;
+    }
+    report << std::endl;
+
+    frames = 0;
+    steps = 0;
+    simulatedTime = 0;
+    return report.str();
+}
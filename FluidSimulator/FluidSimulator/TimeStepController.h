@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Executor.h"
+#include "Vec2.h"
+#include <string>
+
+// Largest speed and acceleration of the particles over some steps, what the stable time step
+// depends on. Plain floats, so the MPI ranks can send it with their gathers.
+struct ParticleMotion
+{
+    float maxSpeed = 0;
+    float maxAcceleration = 0;
+
+    void Add(const ParticleMotion& other);
+    // A particle right before it is moved: its speed, and its acceleration from the velocity
+    // change over the step of deltaTime so far. Collisions come after and would count the
+    // bounce off a wall as acceleration.
+    void Measure(Float2 velocity, Float2 stepStartVelocity, float deltaTime);
+};
+
+// Parallel reduction of ParticleMotion::Measure over the particles [start, end)
+ParticleMotion MeasureParticleMotion(Executor* executor, const Float2* velocities, const Float2* stepStartVelocities,
+    unsigned int start, unsigned int end, unsigned int tileSize, float deltaTime);
+
+// Adaptive time stepping (SimulationOptions::adaptiveTimeStep). Every frame is split into equal
+// substeps, as many as the particle motion of the previous frame needs:
+// - no particle may travel more than cflNumber smoothing radii in a step (CFL condition),
+// - and the step stays below forceNumber * sqrt(smoothingRadius / acceleration), so the
+//   fastest accelerating particle cannot overshoot its neighbours either.
+// The bounds are hard: the step never leaves [minStep, maxStep], and a frame never gets more
+// than maxSubsteps substeps. When these win over the frame time the simulation runs slower or
+// faster than real time.
+class TimeStepController
+{
+public:
+    float cflNumber = 0.4f;
+    float forceNumber = 0.25f;
+    float minStep = 0.0005f;
+    float maxStep = 1.0f / 60.0f;
+    int maxSubsteps = 8;
+
+    // Starts over without a measured motion, the first frame runs at maxStep
+    void Reset();
+    // Number of substeps for a frame of frameTime seconds, step receives their length
+    int PlanFrame(float frameTime, float smoothingRadius, float& step);
+    // Motion of the frame just run, for the next plan
+    void Record(const ParticleMotion& motion);
+
+    float StableStep(float smoothingRadius) const;
+    int FramesSinceReport() const { return frames; }
+    // Chosen steps and what limited them since the last report
+    std::string Report();
+
+private:
+    enum Limit
+    {
+        LimitMaxStep,
+        LimitSpeed,
+        LimitAcceleration,
+        LimitSubsteps,
+        LimitMinStep,
+        LimitCount
+    };
+
+    ParticleMotion motion;
+    bool measured = false;
+
+    int frames = 0;
+    int steps = 0;
+    double simulatedTime = 0;
+    float smallestStep = 0;
+    float largestStep = 0;
+    int limits[LimitCount] = {};
+};
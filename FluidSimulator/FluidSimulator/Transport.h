@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// One send or receive of a persistent exchange
+struct PersistentMessage
+{
+    bool send;
+    void* data;
+    size_t bytes;
+    int peer; // NoRank leaves the message out
+    int tag;
+};
+
+// Byte range of a shared file a rank writes or reads, see Transport::WriteFileAll
+struct FileBlock
+{
+    unsigned long long offset;
+    void* data;
+    size_t bytes;
+};
+
+// Traffic of one rank since the last reset, as seen by its transport
+struct TransportVolume
+{
+    unsigned long long bytesSent = 0;
+    unsigned long long bytesReceived = 0;
+    unsigned long long messagesSent = 0;
+};
+
+// Message passing between the ranks of the distributed simulation, so the same coordinator,
+// worker and domain code runs over MPI (MpiTransport) or between threads of one process
+// (ThreadTransport). The operations mirror the MPI calls they replace: collectives must be
+// called by all ranks in the same order, counts and displacements of the *v operations are
+// in elements of elementSize bytes, and a NoRank peer turns its half of an exchange into a
+// no-op like MPI_PROC_NULL.
+class Transport
+{
+public:
+    static const int NoRank = -1;
+
+    virtual ~Transport() = default;
+
+    virtual int Rank() const = 0;
+    virtual int Size() const = 0;
+    virtual const char* Name() const = 0;
+
+    virtual void Send(const void* data, size_t bytes, int destination, int tag) = 0;
+    virtual void Receive(void* data, size_t bytes, int source, int tag) = 0;
+    virtual void SendReceive(const void* sendData, size_t sendBytes, int destination,
+        void* receiveData, size_t receiveBytes, int source, int tag) = 0;
+
+    // Halo exchange: post any number of sends and receives, then wait for all of them.
+    // The buffers must stay untouched until WaitAll returns.
+    virtual void PostSend(const void* data, size_t bytes, int destination, int tag) = 0;
+    virtual void PostReceive(void* data, size_t bytes, int source, int tag) = 0;
+    virtual void WaitAll() = 0;
+
+    // Persistent exchange: sends and receives that repeat with the same buffers and sizes, set
+    // up once (MPI_Send_init / MPI_Recv_init over MPI) and then only started and waited for.
+    // The buffers must stay valid while the exchange is used, a send reads its buffer when started.
+    virtual int CreatePersistentExchange(const std::vector<PersistentMessage>& messages) = 0;
+    virtual void StartPersistentExchange(int exchange) = 0;
+    virtual void WaitPersistentExchange(int exchange) = 0;
+
+    virtual void Broadcast(void* data, size_t bytes, int root) = 0;
+    // Every rank sends bytes, root receives them in rank order (root's own part included)
+    virtual void Gather(const void* sendData, size_t bytes, void* receiveData, int root) = 0;
+    // Root receives counts[r] elements from rank r at displacements[r], its own block stays in place
+    virtual void Gatherv(const void* sendData, int sendCount, void* receiveData,
+        const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize, int root) = 0;
+    // Every rank owns the block counts[rank] at displacements[rank] of data and receives all others
+    virtual void AllgathervInPlace(void* data, const std::vector<int>& counts, const std::vector<int>& displacements, size_t elementSize) = 0;
+    // Every rank sends the block r of bytes in sendData to rank r and receives block r of receiveData from it
+    virtual void Alltoall(const void* sendData, size_t bytes, void* receiveData) = 0;
+    virtual void Barrier() = 0;
+
+    // Collective file access (MPI-IO over MPI): all ranks open the same file together and every
+    // rank moves its own blocks, which may be none, in one operation. Written blocks must not
+    // overlap. WriteFileAll creates or truncates the file. Both return false on every rank if
+    // the file could not be opened or any rank failed.
+    virtual bool WriteFileAll(const std::string& path, const std::vector<FileBlock>& blocks) = 0;
+    virtual bool ReadFileAll(const std::string& path, const std::vector<FileBlock>& blocks) = 0;
+
+    const TransportVolume& Volume() const { return volume; }
+    void ResetVolume() { volume = TransportVolume(); }
+
+    // Wall clock for the wait and compute timers of the distributed code
+    static double Seconds()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+protected:
+    TransportVolume volume;
+};
@@ -3,6 +3,7 @@
 #include <time.h>
 #include <iostream>
 #include <imgui_internal.h>
+#include <GLFW/glfw3.h>
 
 struct HeatmapEntry {
     ImColor color;
@@ -42,11 +43,11 @@ static std::vector<ImVec4> constructHeatmap(size_t numberOfEntries, const std::v
     return heatmap;
 }
 
-FluidSimulatorWindow::FluidSimulatorWindow(
+FluidSimulatorWindow::FluidSimulatorWindow(const SimulationOptions& options
 #if RUN_MPI
-    int mpiWorkersCount
+    , Transport& transport
 #endif
-)
+) : simulationThread(simulation)
 {
     /*std::vector<HeatmapEntry> entries = {
         {ImColor(28, 70, 158), 0.15f},
@@ -69,19 +70,58 @@ FluidSimulatorWindow::FluidSimulatorWindow(
     heatmap = constructHeatmap(1024, entries);
     srand(time(NULL));
 #if RUN_MPI
-    simulation.mpiWorkersCount = mpiWorkersCount;
+    simulation.SetTransport(&transport);
 #endif
+    simulation.options = options;
     simulation.Start();
+    // A restart from a checkpoint brings its own parameters, the sliders start from them
+    settings.Read(simulation.physics);
+    sentSettings = settings;
+}
+
+void FluidSimulatorWindow::StartSimulationThread()
+{
+    simulationThread.Start();
+}
+
+void FluidSimulatorWindow::StopSimulationThread()
+{
+    simulationThread.Stop();
 }
 
 void FluidSimulatorWindow::draw(GLFWwindow* window, ImGuiIO& io)
 {
-    simulation.Update(window, io.DeltaTime);
+    SimulationInput input;
+    input.mousePosition = { ImGui::GetMousePos().x, ImGui::GetMousePos().y };
+    input.isPullInteraction = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    input.isPushInteraction = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+    input.restart = restartRequested;
+    input.settings = settings;
+    input.settingsChanged = settings != sentSettings;
+    sentSettings = settings;
+    restartRequested = false;
+    simulationThread.PushInput(input);
+
+    if (!simulationThread.IsRunning())
+    {
+        simulationThread.StepInline(io.DeltaTime);
+    }
+    const SimulationSnapshot& snapshot = simulationThread.AcquireLatestSnapshot();
     float FACTOR = 5;
 
     ImGui::Begin("Fluid Simulator Main Window", nullptr, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoBringToFrontOnFocus); 
 
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+    ImGui::Text("Simulation %.3f ms/frame (frame %u, %s)", snapshot.frameMilliseconds, snapshot.frameIndex, snapshot.backendName);
+    ImGui::Text("Time step %.3f ms x %d", snapshot.timeStep * 1000.0f, snapshot.substeps);
+    if (snapshot.sleepingParticles > 0)
+    {
+        ImGui::Text("%u of %zu particles sleeping", snapshot.sleepingParticles, snapshot.positions.size());
+    }
+    if (snapshot.fixedTimeStep > 0)
+    {
+        ImGui::Text("Fixed step %.3f ms, %.2f s dropped to catch up", snapshot.fixedTimeStep * 1000.0f, snapshot.droppedTime);
+    }
     
     /*ImVec2 rectPos(50, ImGui::GetFontSize() * 10);
     ImVec2 rectSize(ImGui::GetWindowWidth() - rectPos.x * 2, ImGui::GetWindowHeight() - rectPos.y - ImGui::GetFontSize());
@@ -92,11 +132,17 @@ void FluidSimulatorWindow::draw(GLFWwindow* window, ImGuiIO& io)
     ImGuiStyle& style = ImGui::GetStyle();
     ImU32 bgColor = ImGui::GetColorU32(style.Colors[ImGuiCol_WindowBg]);
     ImGui::GetWindowDrawList()->AddLine(rectPos, {rectPos.x + rectSize.x, rectPos.y}, bgColor);*/
-    for (int i = 0; i < simulation.physics.Positions.size(); i++) {
-        drawParticle(simulation.physics.Positions[i], simulation.physics.Velocities[i]);
+    float weight = snapshot.InterpolationWeight(std::chrono::steady_clock::now());
+    bool blend = weight < 1 && snapshot.previousPositions.size() == snapshot.positions.size();
+    for (int i = 0; i < snapshot.positions.size(); i++) {
+        Float2 position = snapshot.positions[i];
+        if (blend) {
+            position = snapshot.previousPositions[i] + (position - snapshot.previousPositions[i]) * weight;
+        }
+        drawParticle(position, snapshot.velocities[i]);
     }
 
-    ImGui::GetWindowDrawList()->AddCircle(simulation.physics.interactionInputPoint, simulation.physics.interactionInputRadius, IM_COL32(255, 30, 30, 255));
+    ImGui::GetWindowDrawList()->AddCircle(snapshot.interactionInputPoint, snapshot.interactionInputRadius, IM_COL32(255, 30, 30, 255));
 
     ImGui::End();
 }
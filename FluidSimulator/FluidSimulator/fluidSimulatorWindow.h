@@ -1,6 +1,7 @@
 #pragma once
 #include "imgui.h"
 #include "Simulation.h"
+#include "SimulationThread.h"
 #include <vector>
 
 struct GLFWwindow;
@@ -9,12 +10,22 @@ class FluidSimulatorWindow {
 public:
     Simulation simulation;
     std::vector<ImVec4> heatmap;
+    SimulationSettings settings; // edited by the settings window, forwarded when changed
 
-    FluidSimulatorWindow(
+    FluidSimulatorWindow(const SimulationOptions& options
 #if RUN_MPI
-        int mpiWorkersCount
+        , Transport& transport
 #endif
     );
     void draw(GLFWwindow* window, ImGuiIO& io);
     void drawParticle(Float2 position, Float2 velocity);
+
+    void StartSimulationThread();
+    void StopSimulationThread();
+    void RequestRestart() { restartRequested = true; }
+
+private:
+    SimulationThread simulationThread;
+    bool restartRequested = false;
+    SimulationSettings sentSettings; // last forwarded to the simulation
 };
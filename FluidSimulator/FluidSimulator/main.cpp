@@ -8,6 +8,7 @@
 // - Introduction, links and more at the top of imgui.cpp
 
 #include "fluidSimulatorWindow.h"
+#include "HeadlessRunner.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -34,6 +35,8 @@
 #include <mpi.h>
 //#include "MpiWorker.h"
 #include "MpiWorker2.h"
+#include "InProcessRanks.h"
+#include <memory>
 #endif
 
 static void glfw_error_callback(int error, const char* description)
@@ -42,25 +45,77 @@ static void glfw_error_callback(int error, const char* description)
 }
 
 // Main code
-int main(int, char**)
+int main(int argc, char** argv)
 {
+    SimulationOptions options;
+    options.Parse(argc, argv);
+
 #if RUN_MPI
     //_sleep(10000);
 
-    MPI_Init(0, 0);
+    // Rank 0 makes its MPI calls from the simulation thread, never concurrently. The workers
+    // only call MPI from their main thread (FUNNELED), their pool threads just compute.
+    int threadSupport;
+    MPI_Init_thread(0, 0, MPI_THREAD_SERIALIZED, &threadSupport);
     int me;
     int nrProcs;
     MPI_Comm_size(MPI_COMM_WORLD, &nrProcs);
     MPI_Comm_rank(MPI_COMM_WORLD, &me);
 
+    // All simulation traffic runs on its own communicators, created once for the whole run
+    MpiCommunicators communicators;
+    communicators.Create();
+
     if (me > 0)
     {
-        MpiWorker worker{};
+        if (threadSupport < MPI_THREAD_FUNNELED)
+        {
+            options.mpiWorkerThreads = 0;
+        }
+        MpiWorker worker(communicators, options);
         worker.Run();
+        communicators.Free();
         MPI_Finalize();
         return 0; 
     }
+
+    // Rank 0 talks to the worker processes, or to worker threads of this process
+    MpiTransport mpiTransport(communicators.simulation);
+    Transport* transport = &mpiTransport;
+    std::unique_ptr<InProcessRanks> inProcessRanks;
+    if (options.inProcessRanks > 1 && nrProcs == 1)
+    {
+        inProcessRanks.reset(new InProcessRanks(options.inProcessRanks, options));
+        transport = &inProcessRanks->Rank0();
+    }
+    else if (options.inProcessRanks > 1)
+    {
+        std::cerr << "--in-process-ranks ignored, already running as " << nrProcs << " MPI processes" << std::endl;
+    }
+#endif
+
+    // Batch runs: no window, no display needed
+    if (options.headlessSteps > 0)
+    {
+        HeadlessRunner runner(options
+#if RUN_MPI
+            , *transport
+#endif
+            );
+        runner.Run();
+#if RUN_MPI
+        runner.simulation.StopMpiWorkers();
+        if (inProcessRanks)
+        {
+            std::string volumes = inProcessRanks->VolumeReport();
+            inProcessRanks.reset();
+            std::cout << volumes;
+        }
+        communicators.Free();
+        MPI_Finalize();
 #endif
+        return 0;
+    }
 
     glfwSetErrorCallback(glfw_error_callback);
     if (!glfwInit())
@@ -134,11 +189,17 @@ int main(int, char**)
     bool show_demo_window = true;
     bool show_another_window = false;
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
-    FluidSimulatorWindow fluidSimulatorWindow
+    FluidSimulatorWindow fluidSimulatorWindow(options
+#if RUN_MPI
+        , *transport
+#endif
+        );
+#ifndef __EMSCRIPTEN__
 #if RUN_MPI
-        (nrProcs - 1)
+    if (threadSupport >= MPI_THREAD_SERIALIZED)
+#endif
+    fluidSimulatorWindow.StartSimulationThread();
 #endif
-        ;
 
     // Main loop
 #ifdef __EMSCRIPTEN__
@@ -177,20 +238,20 @@ int main(int, char**)
             fluidSimulatorWindow.draw(window, io);
             //glfwMakeContextCurrent(settingsWindow);
             ImGui::Begin("Settings Window", nullptr, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoTitleBar);
-            ImGui::SliderFloat("Interaction Input Radius", &fluidSimulatorWindow.simulation.physics.interactionInputRadius, 0.0f, 1000.0f);
-            ImGui::SliderFloat("Interaction Input Strength", &fluidSimulatorWindow.simulation.physics.interactionInputStrength, 0.0f, 10000.0f);
-            ImGui::SliderFloat("Gravity", &fluidSimulatorWindow.simulation.physics.gravity, -100.0f * SIMULATION_PARAM_FACTOR, 100.0f * SIMULATION_PARAM_FACTOR);
-            ImGui::SliderFloat("Collision Damping", &fluidSimulatorWindow.simulation.physics.collisionDamping, 0.0f, 1.0f);
-            ImGui::SliderFloat("Smoothing Radius", &fluidSimulatorWindow.simulation.physics.smoothingRadius, 0.5f, 10.0f * SIMULATION_PARAM_FACTOR);
-            ImGui::SliderFloat("Target Density", &fluidSimulatorWindow.simulation.physics.targetDensity, 0.0f, 10.0f * SIMULATION_PARAM_FACTOR);
-            ImGui::SliderFloat("Pressure Multiplier", &fluidSimulatorWindow.simulation.physics.pressureMultiplier, 0.0f, 100.0f * SIMULATION_PARAM_FACTOR);
-            ImGui::SliderFloat("Near Pressure Multiplier", &fluidSimulatorWindow.simulation.physics.nearPressureMultiplier, 0.0f, 10.0f * SIMULATION_PARAM_FACTOR);
-            ImGui::SliderFloat("Viscosity Strength", &fluidSimulatorWindow.simulation.physics.viscosityStrength, 0.0f, 1.0f);
+            ImGui::SliderFloat("Interaction Input Radius", &fluidSimulatorWindow.settings.interactionInputRadius, 0.0f, 1000.0f);
+            ImGui::SliderFloat("Interaction Input Strength", &fluidSimulatorWindow.settings.interactionInputStrength, 0.0f, 10000.0f);
+            ImGui::SliderFloat("Gravity", &fluidSimulatorWindow.settings.gravity, -100.0f * SIMULATION_PARAM_FACTOR, 100.0f * SIMULATION_PARAM_FACTOR);
+            ImGui::SliderFloat("Collision Damping", &fluidSimulatorWindow.settings.collisionDamping, 0.0f, 1.0f);
+            ImGui::SliderFloat("Smoothing Radius", &fluidSimulatorWindow.settings.smoothingRadius, 0.5f, 10.0f * SIMULATION_PARAM_FACTOR);
+            ImGui::SliderFloat("Target Density", &fluidSimulatorWindow.settings.targetDensity, 0.0f, 10.0f * SIMULATION_PARAM_FACTOR);
+            ImGui::SliderFloat("Pressure Multiplier", &fluidSimulatorWindow.settings.pressureMultiplier, 0.0f, 100.0f * SIMULATION_PARAM_FACTOR);
+            ImGui::SliderFloat("Near Pressure Multiplier", &fluidSimulatorWindow.settings.nearPressureMultiplier, 0.0f, 10.0f * SIMULATION_PARAM_FACTOR);
+            ImGui::SliderFloat("Viscosity Strength", &fluidSimulatorWindow.settings.viscosityStrength, 0.0f, 1.0f);
             if (ImGui::Button("Restart")) {
-                fluidSimulatorWindow.simulation.Start();
+                fluidSimulatorWindow.RequestRestart();
             }
             if (ImGui::Button("Set Default")) {
-                fluidSimulatorWindow.simulation.SetDefaultParams();
+                fluidSimulatorWindow.settings.SetDefaults();
             }
             ImGui::End();
             // physics should go here
@@ -212,6 +273,11 @@ int main(int, char**)
 #endif
 
     // Cleanup
+    fluidSimulatorWindow.StopSimulationThread();
+#if RUN_MPI
+    fluidSimulatorWindow.simulation.StopMpiWorkers();
+    inProcessRanks.reset();
+#endif
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -220,6 +286,7 @@ int main(int, char**)
     glfwTerminate();
 
 #if RUN_MPI
+    communicators.Free();
     MPI_Finalize();
 #endif
 
@@ -1,6 +1,9 @@
 #include "physics.h"
 #include <vector>
 #include <math.h>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 
 static const int NumThreads = 64;
 
@@ -38,6 +41,77 @@ void Physics::ResizeBuffers() {
     Densities.resize(numParticles);
     SpatialIndices.resize(numParticles);
     SpatialOffsets.resize(numParticles);
+    unsortedEntries.resize(numParticles);
+    keyCursors.resize(numParticles);
+}
+
+// Drops the current allocations, so the next ResizeBuffers() starts from untouched memory
+void Physics::FreeBuffers() {
+    ParticleBuffer<Float2>().swap(Positions);
+    ParticleBuffer<Float2>().swap(PredictedPositions);
+    ParticleBuffer<Float2>().swap(Velocities);
+    ParticleBuffer<Float2>().swap(Densities);
+    ParticleBuffer<SpatialEntry>().swap(SpatialIndices);
+    ParticleBuffer<ImU32>().swap(SpatialOffsets);
+    ParticleBuffer<SpatialEntry>().swap(unsortedEntries);
+    ParticleBuffer<ImU32>().swap(keyCursors);
+}
+
+static_assert(std::is_trivially_copyable<PhysicsParameters>::value, "PhysicsParameters is sent as bytes");
+static_assert(sizeof(PhysicsParameters) == 24 * sizeof(float), "PhysicsParameters must not have padding");
+
+void PhysicsParameters::Read(const Physics& physics)
+{
+    gravity = physics.gravity;
+    deltaTime = physics.deltaTime;
+    collisionDamping = physics.collisionDamping;
+    smoothingRadius = physics.smoothingRadius;
+    targetDensity = physics.targetDensity;
+    pressureMultiplier = physics.pressureMultiplier;
+    nearPressureMultiplier = physics.nearPressureMultiplier;
+    viscosityStrength = physics.viscosityStrength;
+    boundsSize = physics.boundsSize;
+    interactionInputPoint = physics.interactionInputPoint;
+    currentInteractionInputStrength = physics.currentInteractionInputStrength;
+    interactionInputRadius = physics.interactionInputRadius;
+    interactionInputStrength = physics.interactionInputStrength;
+    obstacleSize = physics.obstacleSize;
+    obstacleCentre = physics.obstacleCentre;
+    Poly6ScalingFactor = physics.Poly6ScalingFactor;
+    SpikyPow3ScalingFactor = physics.SpikyPow3ScalingFactor;
+    SpikyPow2ScalingFactor = physics.SpikyPow2ScalingFactor;
+    SpikyPow3DerivativeScalingFactor = physics.SpikyPow3DerivativeScalingFactor;
+    SpikyPow2DerivativeScalingFactor = physics.SpikyPow2DerivativeScalingFactor;
+}
+
+void PhysicsParameters::Apply(Physics& physics) const
+{
+    physics.gravity = gravity;
+    physics.deltaTime = deltaTime;
+    physics.collisionDamping = collisionDamping;
+    physics.smoothingRadius = smoothingRadius;
+    physics.targetDensity = targetDensity;
+    physics.pressureMultiplier = pressureMultiplier;
+    physics.nearPressureMultiplier = nearPressureMultiplier;
+    physics.viscosityStrength = viscosityStrength;
+    physics.boundsSize = boundsSize;
+    physics.interactionInputPoint = interactionInputPoint;
+    physics.currentInteractionInputStrength = currentInteractionInputStrength;
+    physics.interactionInputRadius = interactionInputRadius;
+    physics.interactionInputStrength = interactionInputStrength;
+    physics.obstacleSize = obstacleSize;
+    physics.obstacleCentre = obstacleCentre;
+    physics.Poly6ScalingFactor = Poly6ScalingFactor;
+    physics.SpikyPow3ScalingFactor = SpikyPow3ScalingFactor;
+    physics.SpikyPow2ScalingFactor = SpikyPow2ScalingFactor;
+    physics.SpikyPow3DerivativeScalingFactor = SpikyPow3DerivativeScalingFactor;
+    physics.SpikyPow2DerivativeScalingFactor = SpikyPow2DerivativeScalingFactor;
+}
+
+// Bitwise, so any change counts, also of NaNs
+bool PhysicsParameters::operator==(const PhysicsParameters& other) const
+{
+    return memcmp((const void*)this, (const void*)&other, sizeof(PhysicsParameters)) == 0;
 }
 
 // Calculate offsets into the sorted Entries buffer (used for spatial hashing).
@@ -70,7 +144,7 @@ void Physics::CalculateOffsets(unsigned int id)
     }
 }
 
-static const Int2 offsets2D[9] =
+const Int2 Physics::CellOffsets[9] =
 {
     {-1, 1},
     {0, 1},
@@ -191,7 +265,7 @@ Float2 Physics::CalculateDensityForPos(Float2 pos)
     // Neighbour search
     for (int i = 0; i < 9; i++)
     {
-        ImU32 hash = HashCell2D(originCell + offsets2D[i]);
+        ImU32 hash = HashCell2D(originCell + CellOffsets[i]);
         ImU32 key = KeyFromHash(hash, numParticles);
         ImU32 currIndex = SpatialOffsets[key];
 
@@ -268,23 +342,21 @@ void Physics::HandleCollisions(ImU32 particleIndex)
     const Float2 halfSize = boundsSize;
     Float2 edgeDst = halfSize - Abs(pos);
 
-    const float SPRITE_SIZE = 15.f;
-
-    if (pos.x < SPRITE_SIZE || pos.x > boundsSize.x - SPRITE_SIZE) {
-        if (pos.x < SPRITE_SIZE) {
-            pos.x = SPRITE_SIZE;
+    if (pos.x < SpriteSize || pos.x > boundsSize.x - SpriteSize) {
+        if (pos.x < SpriteSize) {
+            pos.x = SpriteSize;
         }
         else {
-            pos.x = boundsSize.x - SPRITE_SIZE;
+            pos.x = boundsSize.x - SpriteSize;
         }
         vel.x *= -1 * collisionDamping;
     }
-    if (pos.y < SPRITE_SIZE || pos.y > boundsSize.y - SPRITE_SIZE) {
-        if (pos.y < SPRITE_SIZE) {
-            pos.y = SPRITE_SIZE;
+    if (pos.y < SpriteSize || pos.y > boundsSize.y - SpriteSize) {
+        if (pos.y < SpriteSize) {
+            pos.y = SpriteSize;
         }
         else {
-            pos.y = boundsSize.y - SPRITE_SIZE;
+            pos.y = boundsSize.y - SpriteSize;
         }
         vel.y *= -1 * collisionDamping;
     }
@@ -328,7 +400,11 @@ void Physics::ExternalForces(int id)
     // External forces Physics::(gravity and input interaction)
     Velocities[id] += ExternalForces(Positions[id], Velocities[id]) * deltaTime;
 
-    // Predict
+    PredictPosition(id);
+}
+
+void Physics::PredictPosition(int id)
+{
     const float predictionFactor = 1 / 120.0;
     PredictedPositions[id] = Positions[id] + Velocities[id] * predictionFactor;
 }
@@ -375,7 +451,7 @@ void Physics::CalculatePressureForce(int id)
     // Neighbour search
     for (int i = 0; i < 9; i++)
     {
-        ImU32 hash = HashCell2D(originCell + offsets2D[i]);
+        ImU32 hash = HashCell2D(originCell + CellOffsets[i]);
         ImU32 key = KeyFromHash(hash, numParticles);
         ImU32 currIndex = SpatialOffsets[key];
 
@@ -424,7 +500,11 @@ void Physics::CalculateViscosity(int id)
 {
     if (id >= numParticles) return;
 
+    Velocities[id] -= ViscosityForce(id) * viscosityStrength * deltaTime;
+}
 
+Float2 Physics::ViscosityForce(int id)
+{
     Float2 pos = PredictedPositions[id];
     Int2 originCell = GetCell2D(pos, smoothingRadius);
     float sqrRadius = smoothingRadius * smoothingRadius;
@@ -434,7 +514,7 @@ void Physics::CalculateViscosity(int id)
 
     for (int i = 0; i < 9; i++)
     {
-        ImU32 hash = HashCell2D(originCell + offsets2D[i]);
+        ImU32 hash = HashCell2D(originCell + CellOffsets[i]);
         ImU32 key = KeyFromHash(hash, numParticles);
         ImU32 currIndex = SpatialOffsets[key];
 
@@ -464,7 +544,7 @@ void Physics::CalculateViscosity(int id)
         }
 
     }
-    Velocities[id] -= viscosityForce * viscosityStrength * deltaTime;
+    return viscosityForce;
 }
 
 
@@ -475,3 +555,88 @@ void Physics::UpdatePositions(int id)
     Positions[id] += Velocities[id] * deltaTime;
     HandleCollisions(id);
 }
+
+
+void Physics::BuildSpatialIndex()
+{
+    HashForSpatialIndex(0, numParticles);
+    SortSpatialIndex();
+}
+
+// Only writes the given entries, so several ranges may be hashed in parallel
+void Physics::HashForSpatialIndex(ImU32 start, ImU32 end)
+{
+    for (ImU32 i = start; i < end; i++)
+    {
+        ImU32 hash = HashCell2D(GetCell2D(PredictedPositions[i], smoothingRadius));
+        unsortedEntries[i] = { i, hash, KeyFromHash(hash, numParticles) };
+    }
+}
+
+void Physics::SortSpatialIndex()
+{
+    // Keys are in [0, numParticles), count the entries of every key
+    for (ImU32 key = 0; key < numParticles; key++)
+    {
+        keyCursors[key] = 0;
+    }
+    for (ImU32 i = 0; i < numParticles; i++)
+    {
+        keyCursors[unsortedEntries[i].key]++;
+    }
+
+    // Turn the counts into bucket starts, empty buckets keep the "no entry" offset
+    ImU32 start = 0;
+    for (ImU32 key = 0; key < numParticles; key++)
+    {
+        ImU32 count = keyCursors[key];
+        SpatialOffsets[key] = count > 0 ? start : numParticles;
+        keyCursors[key] = start;
+        start += count;
+    }
+
+    for (ImU32 i = 0; i < numParticles; i++)
+    {
+        SpatialIndices[keyCursors[unsortedEntries[i].key]++] = unsortedEntries[i];
+    }
+}
+
+// Collect the tiles of the sorted entries buffer that the particles in the given tile read
+// from during the neighbour search. A tile covers SpatialIndices[tile * tileSize, (tile + 1) * tileSize).
+// Whole key buckets are included, so hash collisions only ever make the set larger.
+void Physics::CalculateTileNeighbours(unsigned int tileSize, unsigned int tile, std::vector<int>& neighbourTiles)
+{
+    neighbourTiles.clear();
+
+    unsigned int start = tile * tileSize;
+    unsigned int end = std::min(start + tileSize, (unsigned int)numParticles);
+    bool hasPrevious = false;
+    ImU32 previousHash = 0;
+
+    for (unsigned int i = start; i < end; i++)
+    {
+        // Only a run of entries of the same cell is skipped. The entries are sorted by key, and
+        // cells whose hashes share a key may interleave, so a cell can be walked more than once;
+        // that only repeats tiles, which the sort below removes.
+        ImU32 hash = SpatialIndices[i].hash;
+        if (hasPrevious && hash == previousHash) continue;
+        hasPrevious = true;
+        previousHash = hash;
+
+        ForEachNeighbourCell(PredictedPositions[SpatialIndices[i].index], [&](ImU32, ImU32 key) {
+            ImU32 bucketStart = SpatialOffsets[key];
+            if (bucketStart >= numParticles) return;
+
+            ImU32 bucketEnd = bucketStart;
+            while (bucketEnd < numParticles && SpatialIndices[bucketEnd].key == key) bucketEnd++;
+
+            for (unsigned int t = bucketStart / tileSize; t <= (bucketEnd - 1) / tileSize; t++)
+            {
+                neighbourTiles.push_back(t);
+            }
+        });
+    }
+
+    std::sort(neighbourTiles.begin(), neighbourTiles.end());
+    neighbourTiles.erase(std::unique(neighbourTiles.begin(), neighbourTiles.end()), neighbourTiles.end());
+}
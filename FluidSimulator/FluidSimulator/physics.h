@@ -4,6 +4,8 @@
 #include <imgui.h>
 #include <vector>
 #include <cmath>
+#include <memory>
+#include <type_traits>
 
 struct SpatialEntry {
     unsigned int index;
@@ -18,6 +20,63 @@ struct Entry
     unsigned int key;
 };
 
+// Allocator that leaves trivially copyable elements uninitialised when a buffer is resized.
+// The pages of a particle buffer are then placed on the NUMA node of the thread that
+// writes them first, instead of all landing on the node of the thread calling resize().
+//
+// It can also be handed an external region (e.g. MPI shared memory), which it returns
+// instead of allocating as long as the requested size fits, and never frees.
+template<typename T>
+struct FirstTouchAllocator : std::allocator<T>
+{
+    template<typename U>
+    struct rebind { typedef FirstTouchAllocator<U> other; };
+
+    // Stateful because of the region, so it has to move with the buffer
+    typedef std::false_type is_always_equal;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    void* region = nullptr;
+    size_t regionBytes = 0;
+
+    FirstTouchAllocator() = default;
+    FirstTouchAllocator(void* region, size_t regionBytes) : region(region), regionBytes(regionBytes) {}
+    template<typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U>& other) : region(other.region), regionBytes(other.regionBytes) {}
+
+    T* allocate(size_t n)
+    {
+        if (region != nullptr && n * sizeof(T) <= regionBytes) return (T*)region;
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (p != region) std::allocator<T>::deallocate(p, n);
+    }
+
+    template<typename U>
+    void construct(U* p)
+    {
+        if (!std::is_trivially_copyable<U>::value) ::new((void*)p) U();
+    }
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    bool operator==(const FirstTouchAllocator<U>& other) const { return region == other.region; }
+    template<typename U>
+    bool operator!=(const FirstTouchAllocator<U>& other) const { return region != other.region; }
+};
+
+template<typename T>
+using ParticleBuffer = std::vector<T, FirstTouchAllocator<T>>;
+
 struct Physics
 {
     //GPUSort
@@ -51,17 +110,23 @@ struct Physics
     float SpikyPow3DerivativeScalingFactor;
     float SpikyPow2DerivativeScalingFactor;
 
-    std::vector<Float2> Positions;
-    std::vector<Float2> PredictedPositions;
-    std::vector<Float2> Velocities;
-    std::vector<Float2> Densities; // Density, Near Density
-    std::vector<SpatialEntry> SpatialIndices; // used for spatial hashing
-    std::vector<ImU32> SpatialOffsets; // used for spatial hashing
+    ParticleBuffer<Float2> Positions;
+    ParticleBuffer<Float2> PredictedPositions;
+    ParticleBuffer<Float2> Velocities;
+    ParticleBuffer<Float2> Densities; // Density, Near Density
+    ParticleBuffer<SpatialEntry> SpatialIndices; // used for spatial hashing
+    ParticleBuffer<ImU32> SpatialOffsets; // used for spatial hashing
+
+    // Scratch buffers of BuildSpatialIndex, sized by ResizeBuffers
+    ParticleBuffer<SpatialEntry> unsortedEntries;
+    ParticleBuffer<ImU32> keyCursors;
 
     void CalculateOffsets(unsigned int id);
 
     void ResizeBuffers();
 
+    void FreeBuffers();
+
     void Sort(unsigned int id);
 
     static Int2 GetCell2D(Float2 position, float radius);
@@ -70,6 +135,49 @@ struct Physics
 
     static ImU32 KeyFromHash(ImU32 hash, ImU32 tableSize);
 
+    // The 3x3 cells around a particle's cell, all that the smoothing radius reaches
+    static const Int2 CellOffsets[9];
+    // Particles are kept this far inside boundsSize
+    static constexpr float SpriteSize = 15.f;
+
+    // Calls visit(hash, key) for the cells around pos
+    template<typename Visit>
+    void ForEachNeighbourCell(Float2 pos, Visit visit) const
+    {
+        Int2 originCell = GetCell2D(pos, smoothingRadius);
+        for (int i = 0; i < 9; i++)
+        {
+            ImU32 hash = HashCell2D(originCell + CellOffsets[i]);
+            visit(hash, KeyFromHash(hash, numParticles));
+        }
+    }
+
+    // Calls visit(neighbourIndex, offset, sqrDst) for every particle but self whose predicted
+    // position is within the smoothing radius of pos, offset pointing from the neighbour to
+    // pos. Needs the sorted spatial index.
+    template<typename Visit>
+    void ForEachNeighbour(Float2 pos, ImU32 self, Visit visit) const
+    {
+        float sqrRadius = smoothingRadius * smoothingRadius;
+        ForEachNeighbourCell(pos, [&](ImU32 hash, ImU32 key) {
+            ImU32 currIndex = SpatialOffsets[key];
+            while (currIndex < numParticles)
+            {
+                SpatialEntry indexData = SpatialIndices[currIndex];
+                currIndex++;
+                // Exit if no longer looking at correct bin
+                if (indexData.key != key) break;
+                // Skip if hash does not match
+                if (indexData.hash != hash) continue;
+                if (indexData.index == self) continue;
+
+                Float2 offset = pos - PredictedPositions[indexData.index];
+                float sqrDst = Dot(offset, offset);
+                if (sqrDst <= sqrRadius) visit(indexData.index, offset, sqrDst);
+            }
+        });
+    }
+
     float SmoothingKernelPoly6(float dst, float radius);
 
     float SpikyKernelPow3(float dst, float radius);
@@ -102,6 +210,9 @@ struct Physics
 
     void ExternalForces(int id);
 
+    // Where the particle is a short time ahead, the neighbour search and the forces work on that
+    void PredictPosition(int id);
+
     void UpdateSpatialHash(int id);
 
     void CalculateDensity(int id);
@@ -110,8 +221,20 @@ struct Physics
 
     void CalculateViscosity(int id);
 
+    // Velocity difference to the neighbours weighted by the viscosity kernel, before the strength
+    Float2 ViscosityForce(int id);
+
     void UpdatePositions(int id);
 
+    // Hashes all particles and sorts the entries by key with a counting sort. Same result as
+    // UpdateSpatialHash + GpuSortAndCalculateOffsets in O(n), for ranks without a thread pool.
+    void BuildSpatialIndex();
+    // The two halves of BuildSpatialIndex, particles can be hashed in several parts
+    void HashForSpatialIndex(ImU32 start, ImU32 end);
+    void SortSpatialIndex();
+
+    void CalculateTileNeighbours(unsigned int tileSize, unsigned int tile, std::vector<int>& neighbourTiles);
+
 
     int nextPowerOfTwo(unsigned int n)
     {
@@ -159,3 +282,35 @@ struct Physics
         }
     }
 };
+
+// The step parameters of Physics as one plain block: rank 0 sends it to the distributed
+// workers only when a value changed, so it must stay free of padding and pointers.
+// The particle count is not part of it, it only changes with a restart.
+struct PhysicsParameters
+{
+    float gravity;
+    float deltaTime;
+    float collisionDamping;
+    float smoothingRadius;
+    float targetDensity;
+    float pressureMultiplier;
+    float nearPressureMultiplier;
+    float viscosityStrength;
+    Float2 boundsSize;
+    Float2 interactionInputPoint;
+    float currentInteractionInputStrength;
+    float interactionInputRadius;
+    float interactionInputStrength;
+    Float2 obstacleSize;
+    Float2 obstacleCentre;
+    float Poly6ScalingFactor;
+    float SpikyPow3ScalingFactor;
+    float SpikyPow2ScalingFactor;
+    float SpikyPow3DerivativeScalingFactor;
+    float SpikyPow2DerivativeScalingFactor;
+
+    void Read(const Physics& physics);
+    void Apply(Physics& physics) const;
+    bool operator==(const PhysicsParameters& other) const;
+    bool operator!=(const PhysicsParameters& other) const { return !(*this == other); }
+};
@@ -0,0 +1,69 @@
+#include "../FixedStepClock.h"
+#include "TestCheck.h"
+#include <cmath>
+#include <initializer_list>
+
+static bool Near(double a, double b)
+{
+    return std::abs(a - b) < 1e-5;
+}
+
+static void PaysOutWholeSteps()
+{
+    FixedStepClock clock;
+    clock.Configure(0.01f, 5);
+    CHECK(clock.Advance(0.004f) == 0);
+    CHECK(Near(clock.Accumulated(), 0.004));
+    CHECK(Near(clock.TimeToNextStep(), 0.006));
+    CHECK(clock.Advance(0.004f) == 0);
+    CHECK(clock.Advance(0.004f) == 1);
+    CHECK(Near(clock.Accumulated(), 0.002));
+    CHECK(clock.Advance(0.025f) == 2);
+    CHECK(Near(clock.Accumulated(), 0.007));
+    CHECK(clock.DroppedTime() == 0);
+}
+
+static void DropsTimeBeyondTheCatchUpBudget()
+{
+    FixedStepClock clock;
+    clock.Configure(0.01f, 3);
+    CHECK(clock.Advance(0.1055f) == 3);
+    // The fraction of a step is kept, the whole steps beyond the budget are dropped
+    CHECK(Near(clock.Accumulated(), 0.0055));
+    CHECK(Near(clock.DroppedTime(), 0.07));
+    CHECK(clock.Advance(0.005f) == 1);
+
+    clock.Reset();
+    CHECK(clock.Accumulated() == 0);
+    CHECK(clock.DroppedTime() == 0);
+}
+
+static void IgnoresNegativeElapsedTime()
+{
+    FixedStepClock clock;
+    clock.Configure(0.01f, 5);
+    CHECK(clock.Advance(0.005f) == 0);
+    CHECK(clock.Advance(-1.0f) == 0);
+    CHECK(Near(clock.Accumulated(), 0.005));
+}
+
+static void StepsThatAreNotPositiveFallBack()
+{
+    for (float step : { 0.0f, -0.01f })
+    {
+        FixedStepClock clock;
+        clock.Configure(step, 0);
+        CHECK(clock.Step() == FixedStepClock::DefaultStep);
+        // A catch-up budget below one still runs a step
+        CHECK(clock.Advance(1.0f) == 1);
+    }
+}
+
+int main()
+{
+    PaysOutWholeSteps();
+    DropsTimeBeyondTheCatchUpBudget();
+    IgnoresNegativeElapsedTime();
+    StepsThatAreNotPositiveFallBack();
+    return TestResult("FixedStepClockTest");
+}
@@ -0,0 +1,144 @@
+#include "../MpiWireCodec.h"
+#include "TestCheck.h"
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+static bool SameBits(float a, float b)
+{
+    return std::memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+// Encodes values with one codec and decodes them with another, checks the bytes read
+static std::vector<Float2> RoundTrip(MpiWireCodec& encoder, MpiWireCodec& decoder, const std::vector<Float2>& values)
+{
+    std::vector<unsigned char> bytes;
+    encoder.Encode(values.data(), 0, (unsigned int)values.size(), bytes);
+    CHECK(bytes.size() <= MpiWireCodec::MaxBytes((unsigned int)values.size()));
+
+    std::vector<Float2> decoded(values.size());
+    size_t read = decoder.Decode(bytes.data(), decoded.data(), 0, (unsigned int)decoded.size());
+    CHECK(read == bytes.size());
+    return decoded;
+}
+
+static void FloatsAreLossless()
+{
+    // Neighbours of opposite sign and the extremes give the largest differences of the ordered integers
+    std::vector<Float2> values = {
+        Float2(0.0f, -0.0f), Float2(1.0f, -1.0f), Float2(FLT_MAX, -FLT_MAX), Float2(-FLT_MAX, FLT_MAX),
+        Float2(FLT_MIN, -FLT_MIN), Float2(INFINITY, -INFINITY), Float2(1e-40f, -1e-40f), Float2(123.456f, -0.001f),
+    };
+    for (bool slotReferences : { false, true })
+    {
+        MpiWireCodec encoder(MpiWireCodec::Kind::Float, slotReferences);
+        MpiWireCodec decoder(MpiWireCodec::Kind::Float, slotReferences);
+        for (int message = 0; message < 3; message++)
+        {
+            std::vector<Float2> decoded = RoundTrip(encoder, decoder, values);
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                CHECK(SameBits(decoded[i].x, values[i].x));
+                CHECK(SameBits(decoded[i].y, values[i].y));
+            }
+            for (Float2& value : values) value = Float2(value.y, value.x);
+        }
+    }
+}
+
+static void FewerMantissaBitsStayWithinTheError()
+{
+    MpiWireCodec encoder(MpiWireCodec::Kind::Float, false);
+    MpiWireCodec decoder(MpiWireCodec::Kind::Float, false);
+    encoder.SetMantissaBits(10);
+    decoder.SetMantissaBits(10);
+    float maxError = encoder.MaxError();
+    CHECK(maxError == std::ldexp(1.0f, -11));
+
+    std::vector<Float2> values;
+    for (int i = 0; i < 1000; i++) values.push_back(Float2(std::sin(i * 0.37f) * 500, -std::exp(i * 0.01f)));
+    std::vector<Float2> decoded = RoundTrip(encoder, decoder, values);
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        CHECK(std::abs(decoded[i].x - values[i].x) <= maxError * std::abs(values[i].x));
+        CHECK(std::abs(decoded[i].y - values[i].y) <= maxError * std::abs(values[i].y));
+    }
+}
+
+static void PositionsStayOnTheGrid()
+{
+    const float cellSize = 35;
+    for (bool slotReferences : { false, true })
+    {
+        MpiWireCodec encoder(MpiWireCodec::Kind::Position, slotReferences);
+        MpiWireCodec decoder(MpiWireCodec::Kind::Position, slotReferences);
+        encoder.SetCellSize(cellSize);
+        decoder.SetCellSize(cellSize);
+        float maxError = encoder.MaxError();
+        CHECK(maxError == cellSize / (1 << MpiWireCodec::PositionBits) / 2);
+
+        // Particles moving at constant velocity, and a few far apart and out of bounds
+        std::vector<Float2> values;
+        for (int i = 0; i < 200; i++) values.push_back(Float2(15.0f + i * 3.1f, 700.0f - i * 1.7f));
+        values.push_back(Float2(-1e5f, 1e5f));
+        values.push_back(Float2(0, 0));
+        for (int message = 0; message < 4; message++)
+        {
+            std::vector<Float2> decoded = RoundTrip(encoder, decoder, values);
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                // Plus the float rounding of the coordinate itself
+                float tolerance = maxError + std::abs(values[i].x) * FLT_EPSILON;
+                CHECK(std::abs(decoded[i].x - values[i].x) <= tolerance);
+                tolerance = maxError + std::abs(values[i].y) * FLT_EPSILON;
+                CHECK(std::abs(decoded[i].y - values[i].y) <= tolerance);
+            }
+            for (size_t i = 0; i < 200; i++) values[i] += Float2(0.25f, -0.5f);
+        }
+    }
+}
+
+static void SlotReferencesShrinkSteadyMotion()
+{
+    MpiWireCodec encoder(MpiWireCodec::Kind::Position, true);
+    encoder.SetCellSize(35);
+
+    std::vector<Float2> values;
+    for (int i = 0; i < 100; i++) values.push_back(Float2(20.0f + i * 7.3f, 40.0f + (i % 10) * 9.1f));
+    std::vector<size_t> sizes;
+    for (int message = 0; message < 3; message++)
+    {
+        std::vector<unsigned char> bytes;
+        encoder.Encode(values.data(), 0, (unsigned int)values.size(), bytes);
+        sizes.push_back(bytes.size());
+        for (Float2& value : values) value += Float2(0.5f, 0.25f);
+    }
+    // Constant velocity is predicted exactly from the third message on, one byte per coordinate
+    CHECK(sizes[2] == 2 * values.size());
+    CHECK(sizes[2] < sizes[0]);
+}
+
+static void DecodesIntoASubrange()
+{
+    MpiWireCodec encoder(MpiWireCodec::Kind::Float, true);
+    MpiWireCodec decoder(MpiWireCodec::Kind::Float, true);
+    std::vector<Float2> values = { Float2(1, 2), Float2(3, 4), Float2(5, 6), Float2(7, 8) };
+    std::vector<unsigned char> bytes;
+    encoder.Encode(values.data(), 1, 2, bytes);
+
+    std::vector<Float2> decoded(4, Float2(-1, -1));
+    CHECK(decoder.Decode(bytes.data(), decoded.data(), 1, 2) == bytes.size());
+    CHECK(decoded[0].x == -1 && decoded[3].x == -1);
+    CHECK(decoded[1].x == 3 && decoded[1].y == 4 && decoded[2].x == 5 && decoded[2].y == 6);
+}
+
+int main()
+{
+    FloatsAreLossless();
+    FewerMantissaBitsStayWithinTheError();
+    PositionsStayOnTheGrid();
+    SlotReferencesShrinkSteadyMotion();
+    DecodesIntoASubrange();
+    return TestResult("MpiWireCodecTest");
+}
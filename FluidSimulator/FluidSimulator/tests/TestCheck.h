@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal checks for the unit tests: a failed check is printed and counted, and the test's main
+// returns TestResult() so make test stops at the first failing program
+static int testFailures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+static int TestResult(const char* name)
+{
+    std::printf("%s: %s\n", name, testFailures == 0 ? "passed" : "FAILED");
+    return testFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "../ThreadCountTuner.h"
+#include "TestCheck.h"
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+static const char* path = "ThreadCountTunerTest.txt";
+
+static void WriteFile(const std::string& contents)
+{
+    std::ofstream file(path, std::ios::trunc | std::ios::binary);
+    file << contents;
+}
+
+// A stage that Load skipped is tuned again, starting with one worker
+static bool Calibrating(ThreadCountTuner& tuner, const char* stage)
+{
+    return tuner.WorkersFor(stage) == 1 && !tuner.IsCalibrated();
+}
+
+static void LoadsValidLines()
+{
+    WriteFile("key|density|4\nkey|pressure|2\r\nother|density|1\n");
+    ThreadCountTuner tuner;
+    tuner.Reset(8, "key");
+    CHECK(tuner.Load(path));
+    CHECK(tuner.WorkersFor("density") == 4);
+    CHECK(tuner.WorkersFor("pressure") == 2);
+    CHECK(tuner.IsCalibrated());
+}
+
+static void SkipsMalformedLines()
+{
+    WriteFile("key|density|four\n"
+        "key|pressure|\n"
+        "key|viscosity|3x\n"
+        "key|sort|0\n"
+        "key|integrate|-2\n"
+        "key|no count\n"
+        "garbage\n"
+        "key|forces|2\n");
+    ThreadCountTuner tuner;
+    tuner.Reset(8, "key");
+    CHECK(tuner.Load(path));
+    CHECK(tuner.WorkersFor("forces") == 2);
+    CHECK(Calibrating(tuner, "density"));
+    CHECK(Calibrating(tuner, "pressure"));
+    CHECK(Calibrating(tuner, "viscosity"));
+    CHECK(Calibrating(tuner, "sort"));
+    CHECK(Calibrating(tuner, "integrate"));
+    CHECK(Calibrating(tuner, "no count"));
+}
+
+static void ClampsToPoolSize()
+{
+    WriteFile("key|offsets|99999999999999999999\nkey|density|64\n");
+    ThreadCountTuner tuner;
+    tuner.Reset(4, "key");
+    CHECK(tuner.Load(path));
+    CHECK(tuner.WorkersFor("offsets") == 4);
+    CHECK(tuner.WorkersFor("density") == 4);
+}
+
+static void FailsWithoutMatchingLines()
+{
+    WriteFile("key|density|x\nother|density|2\n");
+    ThreadCountTuner tuner;
+    tuner.Reset(8, "key");
+    CHECK(!tuner.Load(path));
+
+    std::remove(path);
+    CHECK(!tuner.Load(path));
+}
+
+int main()
+{
+    LoadsValidLines();
+    SkipsMalformedLines();
+    ClampsToPoolSize();
+    FailsWithoutMatchingLines();
+    std::remove(path);
+    return TestResult("ThreadCountTunerTest");
+}